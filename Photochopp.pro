@@ -1,4 +1,4 @@
-QT       += core gui
+QT       += core gui concurrent network
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -9,15 +9,51 @@ CONFIG += c++17
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    adjustmentdialog.cpp \
+    batchcomparison.cpp \
+    bufferpool.cpp \
+    colorspace.cpp \
+    contactsheet.cpp \
     convolutionwindow.cpp \
+    cpufeatures.cpp \
+    exportqueue.cpp \
+    framesequence.cpp \
+    histogramdock.cpp \
+    imagecache.cpp \
+    imageloader.cpp \
+    imageops.cpp \
     imageviewer.cpp \
     main.cpp \
-    mainwindow.cpp
+    mainwindow.cpp \
+    operationchain.cpp \
+    processingclient.cpp \
+    processingserver.cpp \
+    rawimage.cpp \
+    resultcache.cpp \
+    tracer.cpp
 
 HEADERS += \
+    adjustmentdialog.h \
+    batchcomparison.h \
+    bufferpool.h \
+    colorspace.h \
+    contactsheet.h \
+    cpufeatures.h \
+    exportqueue.h \
+    framesequence.h \
+    histogramdock.h \
+    imagecache.h \
+    imageloader.h \
+    imageops.h \
     imageviewer.h \
     convolutionwindow.h \
-    mainwindow.h
+    mainwindow.h \
+    operationchain.h \
+    processingclient.h \
+    processingserver.h \
+    rawimage.h \
+    resultcache.h \
+    tracer.h
 
 FORMS += \
     mainwindow.ui
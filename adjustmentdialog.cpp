@@ -0,0 +1,68 @@
+#include "adjustmentdialog.h"
+#include <QDialogButtonBox>
+#include <QHBoxLayout>
+#include <QLabel>
+#include <QSlider>
+#include <QVBoxLayout>
+
+AdjustmentDialog::AdjustmentDialog(const QString &title, const QString &label, int minimum, int maximum, int value,
+                                   int divisor, QWidget *parent)
+    : QDialog(parent), slider(new QSlider(Qt::Horizontal)), valueLabel(new QLabel), divisor(divisor)
+{
+    setWindowTitle(title);
+
+    slider->setRange(minimum, maximum);
+    slider->setValue(value);
+    slider->setMinimumWidth(300);
+    valueLabel->setMinimumWidth(50);
+    valueLabel->setAlignment(Qt::AlignRight | Qt::AlignVCenter);
+
+    QHBoxLayout *sliderLayout = new QHBoxLayout;
+    sliderLayout->addWidget(slider);
+    sliderLayout->addWidget(valueLabel);
+
+    QDialogButtonBox *buttonBox = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+
+    QVBoxLayout *mainLayout = new QVBoxLayout(this);
+    mainLayout->addWidget(new QLabel(label));
+    mainLayout->addLayout(sliderLayout);
+    mainLayout->addWidget(buttonBox);
+
+    // One preview per 60 Hz frame at most, always with the latest value
+    previewTimer.setSingleShot(true);
+    previewTimer.setInterval(16);
+    commitTimer.setSingleShot(true);
+    commitTimer.setInterval(250);
+
+    connect(&previewTimer, &QTimer::timeout, this, [this]() { emit previewRequested(slider->value()); });
+    connect(&commitTimer, &QTimer::timeout, this, &AdjustmentDialog::commit);
+    connect(slider, &QSlider::valueChanged, this, &AdjustmentDialog::valueChanged);
+    connect(slider, &QSlider::sliderReleased, this, &AdjustmentDialog::commit);
+    connect(buttonBox, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttonBox, &QDialogButtonBox::rejected, this, &QDialog::reject);
+
+    valueLabel->setText(divisor > 1 ? QString::number(double(value) / divisor, 'f', 2) : QString::number(value));
+}
+
+int AdjustmentDialog::value() const
+{
+    return slider->value();
+}
+
+void AdjustmentDialog::valueChanged(int value)
+{
+    valueLabel->setText(divisor > 1 ? QString::number(double(value) / divisor, 'f', 2) : QString::number(value));
+
+    if (!previewTimer.isActive())
+        previewTimer.start();
+    // Keyboard and page steps have no release, so they commit once they settle
+    if (!slider->isSliderDown())
+        commitTimer.start();
+}
+
+void AdjustmentDialog::commit()
+{
+    previewTimer.stop();
+    commitTimer.stop();
+    emit commitRequested(slider->value());
+}
@@ -0,0 +1,38 @@
+#ifndef ADJUSTMENTDIALOG_H
+#define ADJUSTMENTDIALOG_H
+
+#include <QDialog>
+#include <QTimer>
+
+class QLabel;
+class QSlider;
+
+// Slider for a single adjustment value. previewRequested() is throttled to one
+// frame per display refresh while dragging; commitRequested() fires when the
+// slider is released, or shortly after the last keyboard change.
+class AdjustmentDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    AdjustmentDialog(const QString &title, const QString &label, int minimum, int maximum, int value,
+                     int divisor = 1, QWidget *parent = nullptr);
+
+    int value() const;
+
+signals:
+    void previewRequested(int value);
+    void commitRequested(int value);
+
+private:
+    void valueChanged(int value);
+    void commit();
+
+    QSlider *slider;
+    QLabel *valueLabel;
+    QTimer previewTimer;
+    QTimer commitTimer;
+    int divisor;
+};
+
+#endif // ADJUSTMENTDIALOG_H
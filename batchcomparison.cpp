@@ -0,0 +1,144 @@
+#include "batchcomparison.h"
+#include "imageloader.h"
+#include "imageops.h"
+#include "tracer.h"
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+struct Pair
+{
+    QString name;
+    QString reference;
+    QString result;
+};
+
+struct Outcome
+{
+    ImageOps::Comparison comparison;
+    QString errorString;
+};
+
+QImage readImage(const QString &fileName, QString *errorString)
+{
+    QString readError;
+    const QImage image = ImageLoader::readImage(fileName, &readError);
+    if (image.isNull())
+        *errorString = QStringLiteral("%1: %2").arg(QDir::toNativeSeparators(fileName), readError);
+    return image;
+}
+
+// Runs on a thread of the batch pool; the kernel itself spreads over the global pool
+Outcome comparePair(const Pair &pair, const QString &heatmapDirectory)
+{
+    Outcome outcome;
+    const QImage reference = readImage(pair.reference, &outcome.errorString);
+    if (reference.isNull())
+        return outcome;
+    const QImage result = readImage(pair.result, &outcome.errorString);
+    if (result.isNull())
+        return outcome;
+    if (reference.size() != result.size()) {
+        outcome.errorString = QObject::tr("the images differ in size (%1x%2 and %3x%4)")
+                                  .arg(reference.width()).arg(reference.height())
+                                  .arg(result.width()).arg(result.height());
+        return outcome;
+    }
+
+    QImage heatmap;
+    {
+        TraceScope trace("compare", "op", qint64(reference.width()) * reference.height());
+        outcome.comparison = ImageOps::compare(reference, result, heatmapDirectory.isEmpty() ? nullptr : &heatmap);
+    }
+    if (!heatmap.isNull() && outcome.comparison.mse > 0) {
+        const QString fileName = QDir(heatmapDirectory).filePath(QFileInfo(pair.name).completeBaseName() + QStringLiteral(".png"));
+        QImageWriter writer(fileName);
+        if (!writer.write(heatmap))
+            outcome.errorString = QStringLiteral("%1: %2").arg(QDir::toNativeSeparators(fileName), writer.errorString());
+    }
+    return outcome;
+}
+
+bool collectPairs(const QString &reference, const QString &result, QList<Pair> *pairs, QString *errorString)
+{
+    const QFileInfo referenceInfo(reference);
+    const QFileInfo resultInfo(result);
+    if (referenceInfo.isDir() != resultInfo.isDir()) {
+        *errorString = QObject::tr("Compare two files or two directories");
+        return false;
+    }
+    if (!referenceInfo.isDir()) {
+        pairs->append({resultInfo.fileName(), reference, result});
+        return true;
+    }
+
+    const QDir referenceDirectory(reference);
+    const QDir resultDirectory(result);
+    const QStringList entries = referenceDirectory.entryList(ImageLoader::nameFilters(), QDir::Files, QDir::Name);
+    for (const QString &entry : entries)
+        pairs->append({entry, referenceDirectory.filePath(entry), resultDirectory.filePath(entry)});
+    if (pairs->isEmpty()) {
+        *errorString = QObject::tr("No images in %1").arg(QDir::toNativeSeparators(reference));
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int BatchComparison::run(const QString &reference, const QString &result, const QString &heatmapDirectory,
+                         double minimumPsnr, double minimumSsim)
+{
+    QList<Pair> pairs;
+    QString errorString;
+    if (!collectPairs(reference, result, &pairs, &errorString)) {
+        qWarning("%s", qPrintable(errorString));
+        return -1;
+    }
+    if (!heatmapDirectory.isEmpty() && !QDir().mkpath(heatmapDirectory)) {
+        qWarning("Cannot create %s", qPrintable(QDir::toNativeSeparators(heatmapDirectory)));
+        return -1;
+    }
+
+    // Decoding dominates small images, so whole pairs run side by side; a dedicated
+    // pool keeps them from occupying the threads the comparison kernel runs on
+    QThreadPool pool;
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+    QElapsedTimer timer;
+    timer.start();
+    QFuture<Outcome> outcomes = QtConcurrent::mapped(&pool, pairs, [&heatmapDirectory](const Pair &pair) {
+        return comparePair(pair, heatmapDirectory);
+    });
+
+    int failures = 0;
+    double worstPsnr = INFINITY;
+    double worstSsim = 1.0;
+    for (int i = 0; i < pairs.size(); ++i) {
+        // Results arrive in order, each as soon as its pair is done
+        const Outcome outcome = outcomes.resultAt(i);
+        const ImageOps::Comparison &comparison = outcome.comparison;
+        if (!outcome.errorString.isEmpty()) {
+            ++failures;
+            qInfo("%s: FAIL, %s", qPrintable(pairs.at(i).name), qPrintable(outcome.errorString));
+            continue;
+        }
+        const bool passed = comparison.psnr >= minimumPsnr && comparison.ssim >= minimumSsim;
+        failures += passed ? 0 : 1;
+        worstPsnr = std::min(worstPsnr, comparison.psnr);
+        worstSsim = std::min(worstSsim, comparison.ssim);
+        qInfo("%s: MSE %.6g, PSNR %.2f dB, SSIM %.5f%s", qPrintable(pairs.at(i).name), comparison.mse, comparison.psnr,
+              comparison.ssim, passed ? "" : ", FAIL");
+    }
+
+    qInfo("%lld pairs in %.2f s, %d failed; lowest PSNR %.2f dB, lowest SSIM %.5f", qint64(pairs.size()),
+          timer.elapsed() / 1000.0, failures, worstPsnr, worstSsim);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef BATCHCOMPARISON_H
+#define BATCHCOMPARISON_H
+
+#include <QString>
+
+// Headless regression check of result images against references. reference and
+// result are two image files, or two directories whose images are paired by file
+// name. Every pair is printed with its MSE, PSNR and SSIM; a pair below one of the
+// thresholds, one that differs in size or one that is missing fails the check.
+namespace BatchComparison {
+
+// Heatmaps of the pairs that are not identical go to heatmapDirectory as PNG when
+// it is given. Returns 0 when every pair passes, 1 when one fails and -1 on errors
+// that stop the check.
+int run(const QString &reference, const QString &result, const QString &heatmapDirectory, double minimumPsnr,
+        double minimumSsim);
+
+}
+
+#endif // BATCHCOMPARISON_H
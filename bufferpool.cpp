@@ -0,0 +1,190 @@
+#include "bufferpool.h"
+#include "tracer.h"
+#include <QColorSpace>
+#include <cstring>
+#include <new>
+
+static constexpr std::size_t BufferAlignment = 64;
+
+static void copyMetadata(const QImage &source, QImage &target)
+{
+    target.setColorTable(source.colorTable());
+    target.setDotsPerMeterX(source.dotsPerMeterX());
+    target.setDotsPerMeterY(source.dotsPerMeterY());
+    if (source.colorSpace().isValid())
+        target.setColorSpace(source.colorSpace());
+}
+
+ImageBufferPool &ImageBufferPool::instance()
+{
+    static ImageBufferPool pool;
+    return pool;
+}
+
+ImageBufferPool::~ImageBufferPool()
+{
+    for (const auto &entry : freeBuffers) {
+        ::operator delete(entry.second->data, std::align_val_t(BufferAlignment));
+        delete entry.second;
+    }
+}
+
+// Rounds up to a quarter of the leading power of two, so buffers of similar
+// size (e.g. an image and its 90 degree rotation) share a bucket.
+qsizetype ImageBufferPool::bucketSize(qsizetype bytes)
+{
+    if (bytes <= 65536)
+        return (bytes + 4095) & ~qsizetype(4095);
+
+    int shift = 0;
+    while ((qsizetype(1) << (shift + 1)) <= bytes)
+        ++shift;
+    const qsizetype step = qsizetype(1) << (shift - 2);
+    return (bytes + step - 1) & ~(step - 1);
+}
+
+QImage ImageBufferPool::acquire(int width, int height, QImage::Format format)
+{
+    if (width <= 0 || height <= 0 || format == QImage::Format_Invalid)
+        return QImage();
+
+    const int bitsPerPixel = QImage::toPixelFormat(format).bitsPerPixel();
+    const qsizetype bytesPerLine = ((qsizetype(width) * bitsPerPixel + 7) / 8 + BufferAlignment - 1)
+                                   & ~qsizetype(BufferAlignment - 1);
+    const qsizetype size = bucketSize(bytesPerLine * height);
+
+    Buffer *buffer = nullptr;
+    {
+        QMutexLocker locker(&mutex);
+        auto it = freeBuffers.find(size);
+        if (it != freeBuffers.end()) {
+            buffer = it->second;
+            freeBuffers.erase(it);
+            cached -= size;
+        }
+        inUse += size;
+        peak = std::max(peak, inUse);
+        updateCounters();
+    }
+
+    if (!buffer) {
+        TraceScope trace("allocate", "memory");
+        buffer = new Buffer{this, size, 0, static_cast<uchar *>(::operator new(size, std::align_val_t(BufferAlignment)))};
+    }
+    {
+        QMutexLocker locker(&mutex);
+        trackedPixels.insert(buffer->data);
+    }
+
+    return QImage(buffer->data, width, height, bytesPerLine, format, &ImageBufferPool::release, buffer);
+}
+
+QImage ImageBufferPool::copy(const QImage &source)
+{
+    QImage result = acquire(source.width(), source.height(), source.format());
+    if (result.isNull())
+        return result;
+
+    const qsizetype rowBytes = std::min(source.bytesPerLine(), result.bytesPerLine());
+    for (int y = 0; y < source.height(); ++y)
+        std::memcpy(result.scanLine(y), source.constScanLine(y), rowBytes);
+    copyMetadata(source, result);
+    return result;
+}
+
+QImage ImageBufferPool::adopt(QImage image)
+{
+    if (image.isNull() || !image.isDetached())
+        return image;
+
+    QMutexLocker locker(&mutex);
+    if (trackedPixels.count(image.constBits()))
+        return image;
+    Adopted *adopted = new Adopted{this, image.sizeInBytes(), std::move(image)};
+    // The pixels are not shared, so bits() does not copy them
+    const QImage &source = adopted->image;
+    uchar *pixels = adopted->image.bits();
+    trackedPixels.insert(pixels);
+    inUse += adopted->size;
+    peak = std::max(peak, inUse);
+    updateCounters();
+    locker.unlock();
+
+    QImage result(pixels, source.width(), source.height(), source.bytesPerLine(), source.format(),
+                  &ImageBufferPool::releaseAdopted, adopted);
+    copyMetadata(source, result);
+    return result;
+}
+
+void ImageBufferPool::release(void *info)
+{
+    Buffer *buffer = static_cast<Buffer *>(info);
+    buffer->pool->recycle(buffer);
+}
+
+void ImageBufferPool::releaseAdopted(void *info)
+{
+    Adopted *adopted = static_cast<Adopted *>(info);
+    ImageBufferPool *pool = adopted->pool;
+    {
+        QMutexLocker locker(&pool->mutex);
+        pool->trackedPixels.erase(adopted->image.constBits());
+        pool->inUse -= adopted->size;
+        pool->updateCounters();
+    }
+    delete adopted;
+}
+
+void ImageBufferPool::recycle(Buffer *buffer)
+{
+    QMutexLocker locker(&mutex);
+    trackedPixels.erase(buffer->data);
+    inUse -= buffer->size;
+
+    // Evict the least recently released buffers to stay under the cap
+    while (buffer->size <= maxCachedBytes && !freeBuffers.empty() && cached + buffer->size > maxCachedBytes) {
+        auto oldest = freeBuffers.begin();
+        for (auto it = freeBuffers.begin(); it != freeBuffers.end(); ++it) {
+            if (it->second->releaseTick < oldest->second->releaseTick)
+                oldest = it;
+        }
+        cached -= oldest->first;
+        ::operator delete(oldest->second->data, std::align_val_t(BufferAlignment));
+        delete oldest->second;
+        freeBuffers.erase(oldest);
+    }
+
+    if (buffer->size > maxCachedBytes) {
+        ::operator delete(buffer->data, std::align_val_t(BufferAlignment));
+        delete buffer;
+    } else {
+        buffer->releaseTick = ++tick;
+        freeBuffers.emplace(buffer->size, buffer);
+        cached += buffer->size;
+    }
+    updateCounters();
+}
+
+void ImageBufferPool::updateCounters()
+{
+    Tracer::instance().counter("pixelMemory", inUse);
+    Tracer::instance().counter("pooledMemory", cached);
+}
+
+qint64 ImageBufferPool::currentBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return inUse;
+}
+
+qint64 ImageBufferPool::peakBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return peak;
+}
+
+qint64 ImageBufferPool::cachedBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return cached;
+}
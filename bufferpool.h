@@ -0,0 +1,66 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QImage>
+#include <QMutex>
+#include <map>
+#include <set>
+
+// Recycles pixel buffers between operations. Images returned by acquire() own
+// a pooled buffer that goes back to the pool when the last copy of the image is
+// destroyed, so repeated edits reuse memory that is already mapped. Images that
+// Qt allocates, e.g. decodes and format conversions, are adopted so that the
+// figures cover all pixel memory.
+class ImageBufferPool
+{
+public:
+    static ImageBufferPool &instance();
+
+    QImage acquire(int width, int height, QImage::Format format);
+    QImage copy(const QImage &source);
+    // Counts the pixels of image as in use until its last copy is destroyed, without
+    // moving them. An image that shares its pixels, or whose pixels are counted
+    // already, is returned as it is.
+    QImage adopt(QImage image);
+
+    qint64 currentBytes() const;
+    qint64 peakBytes() const;
+    qint64 cachedBytes() const;
+
+private:
+    ImageBufferPool() = default;
+    ~ImageBufferPool();
+
+    struct Buffer
+    {
+        ImageBufferPool *pool;
+        qsizetype size;
+        quint64 releaseTick;
+        uchar *data;
+    };
+
+    struct Adopted
+    {
+        ImageBufferPool *pool;
+        qsizetype size;
+        QImage image;
+    };
+
+    static qsizetype bucketSize(qsizetype bytes);
+    static void release(void *info);
+    static void releaseAdopted(void *info);
+    void recycle(Buffer *buffer);
+    void updateCounters();
+
+    mutable QMutex mutex;
+    std::multimap<qsizetype, Buffer *> freeBuffers;
+    // Pixels of pooled buffers in use and of adopted images
+    std::set<const uchar *> trackedPixels;
+    qint64 inUse = 0;
+    qint64 peak = 0;
+    qint64 cached = 0;
+    quint64 tick = 0;
+    qint64 maxCachedBytes = qint64(768) << 20;
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,30 @@
+#include "colorspace.h"
+#include <cmath>
+
+namespace ColorSpace {
+
+LabConverter::LabConverter(int max)
+    : decoded(max + 1), cubeRoots(Steps + 1), encoded(Steps + 1)
+{
+    for (int value = 0; value <= max; ++value) {
+        const double v = double(value) / max;
+        decoded[value] = float(v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+    }
+
+    const double epsilon = 216.0 / 24389.0;
+    for (int i = 0; i <= Steps; ++i) {
+        const double t = double(i) / Steps;
+        cubeRoots[i] = float(t > epsilon ? std::cbrt(t) : t * 841.0 / 108.0 + 4.0 / 29.0);
+        const double v = t <= 0.0031308 ? t * 12.92 : 1.055 * std::pow(t, 1.0 / 2.4) - 0.055;
+        encoded[i] = float(v * max);
+    }
+}
+
+const LabConverter &labConverter(int max)
+{
+    static const LabConverter converter8(255);
+    static const LabConverter converter16(65535);
+    return max > 255 ? converter16 : converter8;
+}
+
+}
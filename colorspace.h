@@ -0,0 +1,123 @@
+#ifndef COLORSPACE_H
+#define COLORSPACE_H
+
+#include <QtGlobal>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+// Per-pixel conversions between RGB and YCbCr (BT.601, full range) or CIE Lab (sRGB
+// primaries, D65). Channel values run from 0 to the image maximum. Everything on
+// the pixel path is inline so kernels can fuse a conversion into their own loop.
+namespace ColorSpace {
+
+// Fixed point with 16 fractional bits for 8-bit channels and 30 for 16-bit ones;
+// Cb and Cr are offset by half the range
+template <int Max>
+struct YCbCrFixed
+{
+    using Int = std::conditional_t<(Max > 255), qint64, int>;
+    static constexpr int Shift = Max > 255 ? 30 : 16;
+    static constexpr Int Round = Int(1) << (Shift - 1);
+    static constexpr Int Half = (Max + 1) / 2;
+
+    static constexpr Int coefficient(double value)
+    {
+        return Int(value * double(Int(1) << Shift) + (value < 0 ? -0.5 : 0.5));
+    }
+};
+
+template <int Max>
+inline void rgbToYCbCr(int r, int g, int b, int &y, int &cb, int &cr)
+{
+    using F = YCbCrFixed<Max>;
+    using Int = typename F::Int;
+    y = int((F::coefficient(0.299) * r + F::coefficient(0.587) * g + F::coefficient(0.114) * Int(b) + F::Round) >> F::Shift);
+    cb = int(((F::coefficient(-0.168736) * r + F::coefficient(-0.331264) * g + F::coefficient(0.5) * Int(b) + F::Round) >> F::Shift) + F::Half);
+    cr = int(((F::coefficient(0.5) * r + F::coefficient(-0.418688) * g + F::coefficient(-0.081312) * Int(b) + F::Round) >> F::Shift) + F::Half);
+}
+
+template <int Max>
+inline void yCbCrToRgb(int y, int cb, int cr, int &r, int &g, int &b)
+{
+    using F = YCbCrFixed<Max>;
+    using Int = typename F::Int;
+    const Int u = cb - F::Half;
+    const Int v = cr - F::Half;
+    r = std::clamp(int(y + ((F::coefficient(1.402) * v + F::Round) >> F::Shift)), 0, Max);
+    g = std::clamp(int(y - ((F::coefficient(0.344136) * u + F::coefficient(0.714136) * v + F::Round) >> F::Shift)), 0, Max);
+    b = std::clamp(int(y + ((F::coefficient(1.772) * u + F::Round) >> F::Shift)), 0, Max);
+}
+
+// Lab with L from 0 to 100. The sRGB transfer curve and the cube root are table
+// lookups, built once per channel range.
+class LabConverter
+{
+public:
+    explicit LabConverter(int max);
+
+    inline float lightness(int r, int g, int b) const;
+    inline void toLab(int r, int g, int b, float &l, float &a, float &bb) const;
+    inline void toRgb(float l, float a, float bb, int &r, int &g, int &b) const;
+
+private:
+    static constexpr int Steps = 4096;
+
+    inline float cubeRoot(float t) const;
+    inline int encode(float linear) const;
+
+    std::vector<float> decoded;
+    std::vector<float> cubeRoots;
+    std::vector<float> encoded;
+};
+
+const LabConverter &labConverter(int max);
+
+inline float LabConverter::cubeRoot(float t) const
+{
+    const float position = std::clamp(t, 0.0f, 1.0f) * Steps;
+    const int index = std::min(int(position), Steps - 1);
+    return cubeRoots[index] + (position - index) * (cubeRoots[index + 1] - cubeRoots[index]);
+}
+
+inline int LabConverter::encode(float linear) const
+{
+    const float position = std::clamp(linear, 0.0f, 1.0f) * Steps;
+    const int index = std::min(int(position), Steps - 1);
+    return int(encoded[index] + (position - index) * (encoded[index + 1] - encoded[index]) + 0.5f);
+}
+
+inline float LabConverter::lightness(int r, int g, int b) const
+{
+    const float y = 0.2126729f * decoded[r] + 0.7151522f * decoded[g] + 0.0721750f * decoded[b];
+    return 116.0f * cubeRoot(y) - 16.0f;
+}
+
+inline void LabConverter::toLab(int r, int g, int b, float &l, float &a, float &bb) const
+{
+    const float red = decoded[r];
+    const float green = decoded[g];
+    const float blue = decoded[b];
+    const float fx = cubeRoot((0.4124564f * red + 0.3575761f * green + 0.1804375f * blue) / 0.95047f);
+    const float fy = cubeRoot(0.2126729f * red + 0.7151522f * green + 0.0721750f * blue);
+    const float fz = cubeRoot((0.0193339f * red + 0.1191920f * green + 0.9503041f * blue) / 1.08883f);
+    l = 116.0f * fy - 16.0f;
+    a = 500.0f * (fx - fy);
+    bb = 200.0f * (fy - fz);
+}
+
+inline void LabConverter::toRgb(float l, float a, float bb, int &r, int &g, int &b) const
+{
+    auto inverse = [](float f) { return f > 6.0f / 29.0f ? f * f * f : 3.0f * (6.0f / 29.0f) * (6.0f / 29.0f) * (f - 4.0f / 29.0f); };
+    const float fy = (l + 16.0f) / 116.0f;
+    const float x = 0.95047f * inverse(fy + a / 500.0f);
+    const float y = inverse(fy);
+    const float z = 1.08883f * inverse(fy - bb / 200.0f);
+    r = encode(3.2404542f * x - 1.5371385f * y - 0.4985314f * z);
+    g = encode(-0.9692660f * x + 1.8760108f * y + 0.0415560f * z);
+    b = encode(0.0556434f * x - 0.2040259f * y + 1.0572252f * z);
+}
+
+}
+
+#endif // COLORSPACE_H
@@ -0,0 +1,260 @@
+#include "contactsheet.h"
+#include "exportqueue.h"
+#include "imageloader.h"
+#include "tracer.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QPainter>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+constexpr int Margin = 8;
+
+struct Thumbnail
+{
+    QImage image;
+    QString errorString;
+    bool cached = false;
+};
+
+// One small PNG per source file, named by a hash of its path, modification time,
+// size and the thumbnail size; an edited file gets a new name and its old entry
+// is never read again. After each run the least recently used entries are removed
+// until the cache is back under its cap.
+class ThumbnailCache
+{
+public:
+    ThumbnailCache(const QString &directory, int thumbnailSize, qint64 maxBytes)
+        : directory(directory), thumbnailSize(thumbnailSize), maxBytes(maxBytes) {}
+
+    QImage find(const QFileInfo &file) const
+    {
+        const QString path = fileName(file);
+        QImage image;
+        if (!image.load(path, "png"))
+            return image;
+        // The modification time orders the pruning, so a hit makes the entry the newest
+        QFile entry(path);
+        if (entry.open(QIODevice::ReadWrite))
+            entry.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+        return image;
+    }
+
+    // Written through a temporary file, so a concurrent run never reads half a thumbnail
+    void insert(const QFileInfo &file, const QImage &image) const
+    {
+        QSaveFile output(fileName(file));
+        if (!output.open(QIODevice::WriteOnly))
+            return;
+        QImageWriter writer(&output, "png");
+        if (writer.write(image))
+            output.commit();
+    }
+
+    // Oldest first. The directory is listed each time, since it may be shared with
+    // other runs and thumbnail sizes.
+    void prune() const
+    {
+        TraceScope trace("pruneThumbnails", "io");
+        const QFileInfoList entries = QDir(directory).entryInfoList({QStringLiteral("*.png")}, QDir::Files,
+                                                                    QDir::Time | QDir::Reversed);
+        qint64 totalBytes = 0;
+        for (const QFileInfo &entry : entries)
+            totalBytes += entry.size();
+        for (const QFileInfo &entry : entries) {
+            if (totalBytes <= maxBytes)
+                break;
+            if (QFile::remove(entry.filePath()))
+                totalBytes -= entry.size();
+        }
+    }
+
+private:
+    QString fileName(const QFileInfo &file) const
+    {
+        const QByteArray key = file.absoluteFilePath().toUtf8() + '\n'
+                               + QByteArray::number(file.lastModified().toMSecsSinceEpoch()) + '\n'
+                               + QByteArray::number(file.size()) + '\n' + QByteArray::number(thumbnailSize);
+        return QDir(directory).filePath(QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex())
+                                        + QStringLiteral(".png"));
+    }
+
+    QString directory;
+    int thumbnailSize;
+    qint64 maxBytes;
+};
+
+// Runs on a worker thread
+Thumbnail makeThumbnail(const QString &fileName, int thumbnailSize, const ThumbnailCache *cache)
+{
+    Thumbnail thumbnail;
+    const QFileInfo file(fileName);
+    if (cache) {
+        thumbnail.image = cache->find(file);
+        thumbnail.cached = !thumbnail.image.isNull();
+        if (thumbnail.cached)
+            return thumbnail;
+    }
+    thumbnail.image = ImageLoader::readThumbnail(fileName, QSize(thumbnailSize, thumbnailSize), &thumbnail.errorString);
+    if (cache && !thumbnail.image.isNull())
+        cache->insert(file, thumbnail.image);
+    return thumbnail;
+}
+
+QString sheetFileName(const QFileInfo &output, int page, int pages)
+{
+    if (pages == 1)
+        return output.filePath();
+    const int digits = std::max(2, int(QString::number(pages).size()));
+    return output.dir().filePath(QStringLiteral("%1_%2.%3")
+                                     .arg(output.completeBaseName())
+                                     .arg(page + 1, digits, 10, QLatin1Char('0'))
+                                     .arg(output.suffix()));
+}
+
+class SheetPainter
+{
+public:
+    SheetPainter(const ContactSheetOptions &options, int count)
+        : options(options), labelHeight(QFontMetrics(QFont()).height() + 4)
+    {
+        const int rows = (count + options.columns - 1) / options.columns;
+        sheet = QImage(Margin + options.columns * (options.thumbnailSize + Margin),
+                       Margin + rows * (options.thumbnailSize + labelHeight + Margin), QImage::Format_RGB32);
+        sheet.fill(QColor(48, 48, 48));
+        painter.begin(&sheet);
+        painter.setPen(QColor(224, 224, 224));
+    }
+
+    void draw(int index, const QString &name, const Thumbnail &thumbnail)
+    {
+        const int size = options.thumbnailSize;
+        const QPoint cell(Margin + index % options.columns * (size + Margin),
+                          Margin + index / options.columns * (size + labelHeight + Margin));
+        const QRect frame(cell, QSize(size, size));
+        if (thumbnail.image.isNull()) {
+            painter.drawRect(frame.adjusted(0, 0, -1, -1));
+            painter.drawText(frame, Qt::AlignCenter, QObject::tr("Unreadable"));
+        } else {
+            QRect placed(QPoint(), thumbnail.image.size());
+            placed.moveCenter(frame.center());
+            painter.drawImage(placed.topLeft(), thumbnail.image);
+        }
+        const QRect label(cell.x(), cell.y() + size, size, labelHeight);
+        painter.drawText(label, Qt::AlignCenter, painter.fontMetrics().elidedText(name, Qt::ElideMiddle, size));
+    }
+
+    QImage finish()
+    {
+        painter.end();
+        return sheet;
+    }
+
+private:
+    const ContactSheetOptions &options;
+    const int labelHeight;
+    QImage sheet;
+    QPainter painter;
+};
+
+} // namespace
+
+QString ContactSheet::defaultCacheDirectory()
+{
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath(QStringLiteral("thumbnails"));
+}
+
+int ContactSheet::run(const QString &directory, const QString &output, const ContactSheetOptions &options)
+{
+    const QFileInfo outputInfo(output);
+    if (!ExportQueue::isWritable(outputInfo.suffix().toLower().toLatin1())) {
+        qWarning("Cannot write %s: unsupported image format", qPrintable(QDir::toNativeSeparators(output)));
+        return -1;
+    }
+    if (options.thumbnailSize < 16 || options.columns < 1 || options.rows < 1) {
+        qWarning("Thumbnails must be at least 16 pixels, with at least one row and column per sheet");
+        return -1;
+    }
+
+    // Sheets of an earlier run in the same directory are not part of the review
+    const QRegularExpression sheetName(QStringLiteral("^%1(_\\d+)?\\.%2$").arg(QRegularExpression::escape(outputInfo.completeBaseName()),
+                                                                              QRegularExpression::escape(outputInfo.suffix())));
+    const QDir source(directory);
+    const bool sameDirectory = source.absolutePath() == outputInfo.absolutePath();
+    QStringList files;
+    for (const QString &entry : source.entryList(ImageLoader::nameFilters(), QDir::Files, QDir::Name | QDir::IgnoreCase | QDir::LocaleAware)) {
+        if (!sameDirectory || !sheetName.match(entry).hasMatch())
+            files.append(source.filePath(entry));
+    }
+    if (files.isEmpty()) {
+        qWarning("No images in %s", qPrintable(QDir::toNativeSeparators(directory)));
+        return -1;
+    }
+
+    std::unique_ptr<ThumbnailCache> cache;
+    if (!options.cacheDirectory.isEmpty()) {
+        if (QDir().mkpath(options.cacheDirectory))
+            cache = std::make_unique<ThumbnailCache>(options.cacheDirectory, options.thumbnailSize, options.cacheMaxBytes);
+        else
+            qWarning("Cannot create %s; thumbnails are not cached", qPrintable(QDir::toNativeSeparators(options.cacheDirectory)));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QThreadPool pool;
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+    const int thumbnailSize = options.thumbnailSize;
+    const ThumbnailCache *thumbnailCache = cache.get();
+    QFuture<Thumbnail> thumbnails = QtConcurrent::mapped(&pool, files, [thumbnailSize, thumbnailCache](const QString &fileName) {
+        return makeThumbnail(fileName, thumbnailSize, thumbnailCache);
+    });
+
+    // Sheets are painted and written here as their thumbnails arrive in order, while the pool makes the next ones
+    const int perSheet = options.columns * options.rows;
+    const int pages = (int(files.size()) + perSheet - 1) / perSheet;
+    int cached = 0;
+    int unreadable = 0;
+    for (int page = 0; page < pages; ++page) {
+        const int first = page * perSheet;
+        const int count = std::min(perSheet, int(files.size()) - first);
+        SheetPainter painter(options, count);
+        for (int i = 0; i < count; ++i) {
+            const Thumbnail thumbnail = thumbnails.resultAt(first + i);
+            if (thumbnail.image.isNull()) {
+                ++unreadable;
+                qWarning("%s: %s", qPrintable(QDir::toNativeSeparators(files.at(first + i))), qPrintable(thumbnail.errorString));
+            }
+            cached += thumbnail.cached ? 1 : 0;
+            painter.draw(i, QFileInfo(files.at(first + i)).fileName(), thumbnail);
+        }
+
+        ExportTarget target;
+        target.fileName = sheetFileName(outputInfo, page, pages);
+        target.format = outputInfo.suffix().toLower().toLatin1();
+        QString errorString;
+        if (!ExportQueue::write(painter.finish(), target, &errorString)) {
+            qWarning("%s: %s", qPrintable(QDir::toNativeSeparators(target.fileName)), qPrintable(errorString));
+            thumbnails.cancel();
+            return -1;
+        }
+    }
+
+    if (cache)
+        cache->prune();
+    qInfo("%lld images, %d thumbnails from the cache, %d unreadable; %d sheets in %.2f s", qint64(files.size()), cached,
+          unreadable, pages, timer.elapsed() / 1000.0);
+    return 0;
+}
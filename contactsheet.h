@@ -0,0 +1,28 @@
+#ifndef CONTACTSHEET_H
+#define CONTACTSHEET_H
+
+#include <QString>
+
+struct ContactSheetOptions
+{
+    int thumbnailSize = 256;
+    int columns = 6;
+    int rows = 5;
+    QString cacheDirectory;   // no thumbnail cache when empty
+    qint64 cacheMaxBytes = qint64(256) << 20;
+};
+
+// Headless contact sheets of a directory for reviewing batch output. Thumbnails
+// are made on a worker pool and kept in a cache keyed by file path, modification
+// time and size, so sheets of unchanged folders only read the small cached files.
+// The least recently used thumbnails are removed once the cache grows past its cap.
+namespace ContactSheet {
+
+QString defaultCacheDirectory();
+// Writes one sheet per columns x rows images to output, numbered as name_01.jpg,
+// name_02.jpg... when there is more than one. Returns an exit code.
+int run(const QString &directory, const QString &output, const ContactSheetOptions &options);
+
+}
+
+#endif // CONTACTSHEET_H
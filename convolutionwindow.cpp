@@ -6,6 +6,10 @@
 #include <QLabel>
 #include <QMessageBox>
 #include <QDoubleValidator>
+#include <QSpinBox>
+#include <QDoubleSpinBox>
+#include <QComboBox>
+#include <QCheckBox>
 
 convolutionwindow::convolutionwindow(QWidget *parent)
     : QMainWindow{parent} {
@@ -125,6 +129,131 @@ convolutionwindow::convolutionwindow(QWidget *parent)
 
     mainLayout->addLayout(thirdButtonLayout);
 
+    // Median and other rank filters; 50% is the median
+    QHBoxLayout *rankLayout = new QHBoxLayout();
+
+    rankRadiusInput = new QSpinBox(this);
+    rankRadiusInput->setRange(1, 50);
+    rankRadiusInput->setValue(1);
+    rankRadiusInput->setPrefix("Radius ");
+    rankRadiusInput->setFixedHeight(40);
+    rankLayout->addWidget(rankRadiusInput);
+
+    rankPercentileInput = new QSpinBox(this);
+    rankPercentileInput->setRange(0, 100);
+    rankPercentileInput->setValue(50);
+    rankPercentileInput->setSuffix("%");
+    rankPercentileInput->setFixedHeight(40);
+    rankLayout->addWidget(rankPercentileInput);
+
+    QPushButton *rankButton = new QPushButton("Median / Rank", this);
+    rankButton->setStyleSheet("background-color: #333; color: white; "
+                              "font-size: 14px; font-weight: bold; padding: 10px 24px; "
+                              "border: none; border-radius: 5px;");
+    rankButton->setFixedSize(155, 40);
+    rankButton->setCursor(Qt::PointingHandCursor);
+    rankButton->setFocusPolicy(Qt::NoFocus);
+    rankLayout->addWidget(rankButton);
+
+    mainLayout->addLayout(rankLayout);
+
+    QHBoxLayout *blurLayout = new QHBoxLayout();
+
+    blurSizeInput = new QDoubleSpinBox(this);
+    blurSizeInput->setRange(0.5, 200.0);
+    blurSizeInput->setValue(2.0);
+    blurSizeInput->setDecimals(1);
+    blurSizeInput->setPrefix("Radius / Sigma ");
+    blurSizeInput->setFixedHeight(40);
+    blurLayout->addWidget(blurSizeInput);
+
+    QPushButton *boxBlurButton = new QPushButton("Box Blur", this);
+    boxBlurButton->setStyleSheet("background-color: #333; color: white; "
+                                 "font-size: 14px; font-weight: bold; padding: 10px 24px; "
+                                 "border: none; border-radius: 5px;");
+    boxBlurButton->setFixedSize(155, 40);
+    boxBlurButton->setCursor(Qt::PointingHandCursor);
+    boxBlurButton->setFocusPolicy(Qt::NoFocus);
+    blurLayout->addWidget(boxBlurButton);
+
+    QPushButton *gaussianBlurButton = new QPushButton("Gaussian Blur", this);
+    gaussianBlurButton->setStyleSheet("background-color: #333; color: white; "
+                                      "font-size: 14px; font-weight: bold; padding: 10px 24px; "
+                                      "border: none; border-radius: 5px;");
+    gaussianBlurButton->setFixedSize(155, 40);
+    gaussianBlurButton->setCursor(Qt::PointingHandCursor);
+    gaussianBlurButton->setFocusPolicy(Qt::NoFocus);
+    blurLayout->addWidget(gaussianBlurButton);
+
+    mainLayout->addLayout(blurLayout);
+
+    // Sobel or Prewitt magnitude from both derivatives in one pass
+    QHBoxLayout *gradientLayout = new QHBoxLayout();
+
+    gradientOperatorInput = new QComboBox(this);
+    gradientOperatorInput->addItem("Sobel");
+    gradientOperatorInput->addItem("Prewitt");
+    gradientOperatorInput->setFixedHeight(40);
+    gradientLayout->addWidget(gradientOperatorInput);
+
+    gradientNormInput = new QComboBox(this);
+    gradientNormInput->addItem("|Gx| + |Gy|");
+    gradientNormInput->addItem("sqrt(Gx² + Gy²)");
+    gradientNormInput->setFixedHeight(40);
+    gradientLayout->addWidget(gradientNormInput);
+
+    gradientOrientationInput = new QCheckBox("Orientation", this);
+    gradientLayout->addWidget(gradientOrientationInput);
+
+    QPushButton *gradientButton = new QPushButton("Gradient", this);
+    gradientButton->setStyleSheet("background-color: #333; color: white; "
+                                  "font-size: 14px; font-weight: bold; padding: 10px 24px; "
+                                  "border: none; border-radius: 5px;");
+    gradientButton->setFixedSize(155, 40);
+    gradientButton->setCursor(Qt::PointingHandCursor);
+    gradientButton->setFocusPolicy(Qt::NoFocus);
+    gradientLayout->addWidget(gradientButton);
+
+    mainLayout->addLayout(gradientLayout);
+
+    // Erosion, dilation and their compositions for cleaning up masks
+    QHBoxLayout *morphologyLayout = new QHBoxLayout();
+
+    morphologyOperationInput = new QComboBox(this);
+    morphologyOperationInput->addItem("Erode");
+    morphologyOperationInput->addItem("Dilate");
+    morphologyOperationInput->addItem("Open");
+    morphologyOperationInput->addItem("Close");
+    morphologyOperationInput->addItem("Top-hat");
+    morphologyOperationInput->addItem("Black-hat");
+    morphologyOperationInput->setFixedHeight(40);
+    morphologyLayout->addWidget(morphologyOperationInput);
+
+    morphologyShapeInput = new QComboBox(this);
+    morphologyShapeInput->addItem("Square");
+    morphologyShapeInput->addItem("Horizontal line");
+    morphologyShapeInput->addItem("Vertical line");
+    morphologyShapeInput->setFixedHeight(40);
+    morphologyLayout->addWidget(morphologyShapeInput);
+
+    morphologyRadiusInput = new QSpinBox(this);
+    morphologyRadiusInput->setRange(1, 500);
+    morphologyRadiusInput->setValue(1);
+    morphologyRadiusInput->setPrefix("Radius ");
+    morphologyRadiusInput->setFixedHeight(40);
+    morphologyLayout->addWidget(morphologyRadiusInput);
+
+    QPushButton *morphologyButton = new QPushButton("Morphology", this);
+    morphologyButton->setStyleSheet("background-color: #333; color: white; "
+                                    "font-size: 14px; font-weight: bold; padding: 10px 24px; "
+                                    "border: none; border-radius: 5px;");
+    morphologyButton->setFixedSize(155, 40);
+    morphologyButton->setCursor(Qt::PointingHandCursor);
+    morphologyButton->setFocusPolicy(Qt::NoFocus);
+    morphologyLayout->addWidget(morphologyButton);
+
+    mainLayout->addLayout(morphologyLayout);
+
     connect(applyButton, &QPushButton::clicked, this, &convolutionwindow::saveKernelValues);
     connect(gaussianButton, &QPushButton::clicked, this, &convolutionwindow::gaussianFilter);
     connect(laplacianButton, &QPushButton::clicked, this, &convolutionwindow::laplacianFilter);
@@ -133,6 +262,25 @@ convolutionwindow::convolutionwindow(QWidget *parent)
     connect(prewittHyButton, &QPushButton::clicked, this, &convolutionwindow::prewittHyFilter);
     connect(sobelHxButton, &QPushButton::clicked, this, &convolutionwindow::sobelHxFilter);
     connect(sobelHyButton, &QPushButton::clicked, this, &convolutionwindow::sobelHyFilter);
+    connect(rankButton, &QPushButton::clicked, this, [this]() {
+        emit rankFilter(rankRadiusInput->value(), rankPercentileInput->value());
+    });
+    connect(boxBlurButton, &QPushButton::clicked, this, [this]() {
+        emit boxBlur(qRound(blurSizeInput->value()));
+    });
+    connect(gaussianBlurButton, &QPushButton::clicked, this, [this]() {
+        emit gaussianBlur(blurSizeInput->value());
+    });
+    connect(gradientButton, &QPushButton::clicked, this, [this]() {
+        emit gradient(gradientOperatorInput->currentIndex() == 0, gradientNormInput->currentIndex() == 1,
+                      gradientOrientationInput->isChecked());
+    });
+    connect(morphologyButton, &QPushButton::clicked, this, [this]() {
+        const int radius = morphologyRadiusInput->value();
+        const int shape = morphologyShapeInput->currentIndex();
+        emit morphology(ImageOps::MorphologyOperation(morphologyOperationInput->currentIndex()),
+                        shape == 2 ? 0 : radius, shape == 1 ? 0 : radius);
+    });
 
     setWindowTitle("Entrada de Kernel 3x3");
     resize(500, 300);
@@ -3,7 +3,12 @@
 
 #include <QMainWindow>
 #include <QLineEdit>
+#include <QSpinBox>
+#include <QDoubleSpinBox>
+#include <QComboBox>
+#include <QCheckBox>
 #include <QVector>
+#include "imageops.h"
 
 class convolutionwindow : public QMainWindow
 {
@@ -17,6 +22,15 @@ private slots:
 
 private:
     QLineEdit *kernelInputs[9]; 
+    QSpinBox *rankRadiusInput;
+    QSpinBox *rankPercentileInput;
+    QDoubleSpinBox *blurSizeInput;
+    QComboBox *gradientOperatorInput;
+    QComboBox *gradientNormInput;
+    QCheckBox *gradientOrientationInput;
+    QComboBox *morphologyOperationInput;
+    QComboBox *morphologyShapeInput;
+    QSpinBox *morphologyRadiusInput;
     void gaussianFilter();
     void laplacianFilter();
     void highPassFilter();
@@ -27,6 +41,11 @@ private:
 
 signals:
     void convolution(const  std::vector<std::vector<float>> &kernel);
+    void rankFilter(int radius, int percentile);
+    void boxBlur(int radius);
+    void gaussianBlur(double sigma);
+    void gradient(bool sobel, bool euclidean, bool orientation);
+    void morphology(ImageOps::MorphologyOperation operation, int radiusX, int radiusY);
 };
 
 #endif // CONVOLUTIONWINDOW_H
@@ -0,0 +1,66 @@
+#include "cpufeatures.h"
+#include <QByteArray>
+#include <QtGlobal>
+
+namespace CpuFeatures {
+
+static Level detect()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+        return Level::Avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return Level::Avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return Level::Sse2;
+#endif
+    return Level::Generic;
+}
+
+Level supported()
+{
+    static const Level level = detect();
+    return level;
+}
+
+Level active()
+{
+    static const Level level = [] {
+        const QByteArray requested = qgetenv("PHOTOCHOPP_SIMD").trimmed().toLower();
+        if (requested.isEmpty())
+            return supported();
+
+        for (Level candidate : {Level::Generic, Level::Sse2, Level::Avx2, Level::Avx512}) {
+            if (requested != name(candidate))
+                continue;
+            // A level the CPU lacks would crash on the first kernel
+            if (candidate > supported()) {
+                qWarning("PHOTOCHOPP_SIMD=%s is not supported by this CPU, using %s",
+                         requested.constData(), name(supported()));
+                return supported();
+            }
+            return candidate;
+        }
+        qWarning("Unknown PHOTOCHOPP_SIMD value %s, using %s", requested.constData(), name(supported()));
+        return supported();
+    }();
+    return level;
+}
+
+const char *name(Level level)
+{
+    switch (level) {
+    case Level::Sse2:
+        return "sse2";
+    case Level::Avx2:
+        return "avx2";
+    case Level::Avx512:
+        return "avx512";
+    case Level::Generic:
+        break;
+    }
+    return "generic";
+}
+
+}
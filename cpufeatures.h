@@ -0,0 +1,17 @@
+#ifndef CPUFEATURES_H
+#define CPUFEATURES_H
+
+// Instruction set level the hot image kernels run at. It is detected once from
+// CPUID and can be forced lower with the PHOTOCHOPP_SIMD environment variable
+// (generic, sse2, avx2 or avx512) for testing and benchmarking.
+namespace CpuFeatures {
+
+enum class Level { Generic, Sse2, Avx2, Avx512 };
+
+Level supported();
+Level active();
+const char *name(Level level);
+
+}
+
+#endif // CPUFEATURES_H
@@ -0,0 +1,136 @@
+#include "exportqueue.h"
+#include "bufferpool.h"
+#include "imageops.h"
+#include "rawimage.h"
+#include "tracer.h"
+#include <QFutureWatcher>
+#include <QImageWriter>
+#include <QRegularExpression>
+#include <QtConcurrent>
+#include <algorithm>
+
+ExportQueue::ExportQueue(QObject *parent)
+    : QObject(parent)
+{
+    pool.setMaxThreadCount(std::max(2, QThread::idealThreadCount() / 2));
+}
+
+bool ExportQueue::isWritable(const QByteArray &format)
+{
+    return format == RawImage::formatName() || QImageWriter::supportedImageFormats().contains(format);
+}
+
+// Parses a comma separated list such as "png, jpg:85, webp:80@1024": a format,
+// an optional quality and an optional bound for the longest side
+QList<ExportTarget> ExportQueue::parseTargets(const QString &specification, const QString &baseName, QString *errorString)
+{
+    static const QRegularExpression targetPattern(QStringLiteral("^([A-Za-z0-9]+)(?::(\\d+))?(?:@(\\d+))?$"));
+    QList<ExportTarget> targets;
+    const QStringList items = specification.split(',', Qt::SkipEmptyParts);
+    for (const QString &item : items) {
+        const QRegularExpressionMatch match = targetPattern.match(item.trimmed());
+        if (!match.hasMatch()) {
+            *errorString = QObject::tr("Invalid export target \"%1\"").arg(item.trimmed());
+            return {};
+        }
+
+        ExportTarget target;
+        target.format = match.captured(1).toLower().toLatin1();
+        if (target.format == "jpeg")
+            target.format = "jpg";
+        if (!isWritable(target.format)) {
+            *errorString = QObject::tr("Unsupported format \"%1\"").arg(QString::fromLatin1(target.format));
+            return {};
+        }
+        if (!match.captured(2).isEmpty())
+            target.quality = qBound(0, match.captured(2).toInt(), 100);
+        if (!match.captured(3).isEmpty())
+            target.maxSize = match.captured(3).toInt();
+
+        // The size bound, the quality and then a running number only go into the name
+        // when needed to tell targets apart, so no two targets write the same file
+        auto taken = [&targets](const QString &fileName) {
+            return std::any_of(targets.cbegin(), targets.cend(),
+                               [&fileName](const ExportTarget &other) { return other.fileName == fileName; });
+        };
+        const QString suffix = '.' + QString::fromLatin1(target.format);
+        QString name = baseName;
+        if (target.maxSize > 0)
+            name += QStringLiteral("_%1").arg(target.maxSize);
+        if (taken(name + suffix) && target.quality >= 0)
+            name += QStringLiteral("_q%1").arg(target.quality);
+        target.fileName = name + suffix;
+        for (int number = 2; taken(target.fileName); ++number)
+            target.fileName = name + QStringLiteral("_%1").arg(number) + suffix;
+        targets.append(target);
+    }
+
+    if (targets.isEmpty())
+        *errorString = QObject::tr("No export targets given");
+    return targets;
+}
+
+bool ExportQueue::write(const QImage &image, const ExportTarget &target, QString *errorString)
+{
+    TraceScope trace("encode", "io", qint64(image.width()) * image.height());
+
+    QImage output = image;
+    if (target.maxSize > 0 && (image.width() > target.maxSize || image.height() > target.maxSize))
+        output = ImageBufferPool::instance().adopt(image.scaled(target.maxSize, target.maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation));
+
+    // Raw files take the pixels as they are, in one sequential write
+    if (target.format == RawImage::formatName())
+        return RawImage::write(output, target.fileName, errorString);
+
+    // Only PNG and TIFF keep 16 bits per channel; other formats get the 8-bit result
+    if (target.format != "png" && target.format != "tif" && target.format != "tiff")
+        output = ImageOps::toDisplayFormat(std::move(output));
+
+    QImageWriter writer(target.fileName, target.format);
+    if (target.quality >= 0)
+        writer.setQuality(target.quality);
+    if (!writer.write(output)) {
+        *errorString = writer.errorString();
+        return false;
+    }
+    return true;
+}
+
+// The image is shared, not copied; an edit that follows detaches its own buffer
+void ExportQueue::enqueue(const QImage &image, const QList<ExportTarget> &targets)
+{
+    if (isIdle()) {
+        done = 0;
+        total = 0;
+    }
+    total += targets.size();
+    emit progress(done, total);
+
+    for (const ExportTarget &target : targets) {
+        QFutureWatcher<QString> *watcher = new QFutureWatcher<QString>(this);
+        connect(watcher, &QFutureWatcher<QString>::finished, this, [this, watcher, target]() {
+            watcher->deleteLater();
+            finished(target, watcher->result());
+        });
+        watcher->setFuture(QtConcurrent::run(&pool, [image, target]() {
+            QString errorString;
+            write(image, target, &errorString);
+            return errorString;
+        }));
+    }
+}
+
+bool ExportQueue::isIdle() const
+{
+    return done == total;
+}
+
+void ExportQueue::finished(const ExportTarget &target, const QString &errorString)
+{
+    ++done;
+    if (errorString.isEmpty())
+        emit exported(target.fileName);
+    else
+        emit failed(target.fileName, errorString);
+    emit progress(done, total);
+}
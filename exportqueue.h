@@ -0,0 +1,50 @@
+#ifndef EXPORTQUEUE_H
+#define EXPORTQUEUE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+
+struct ExportTarget
+{
+    QString fileName;
+    QByteArray format;
+    int quality = -1;
+    int maxSize = 0;
+};
+
+// Encodes snapshots of the result on worker threads. Every target of a request
+// is written concurrently from the same implicitly shared image, so editing can
+// continue while the files are written.
+class ExportQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ExportQueue(QObject *parent = nullptr);
+
+    // Formats QImageWriter supports, and the raw intermediate format
+    static bool isWritable(const QByteArray &format);
+    static QList<ExportTarget> parseTargets(const QString &specification, const QString &baseName, QString *errorString);
+    static bool write(const QImage &image, const ExportTarget &target, QString *errorString);
+
+    void enqueue(const QImage &image, const QList<ExportTarget> &targets);
+    bool isIdle() const;
+
+signals:
+    void progress(int done, int total);
+    void exported(const QString &fileName);
+    void failed(const QString &fileName, const QString &errorString);
+
+private:
+    void finished(const ExportTarget &target, const QString &errorString);
+
+    QThreadPool pool;
+    int done = 0;
+    int total = 0;
+};
+
+#endif // EXPORTQUEUE_H
@@ -0,0 +1,661 @@
+#include "framesequence.h"
+#include "bufferpool.h"
+#include "colorspace.h"
+#include "exportqueue.h"
+#include "imageloader.h"
+#include "imageops.h"
+#include "operationchain.h"
+#include "resultcache.h"
+#include "tracer.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <numeric>
+
+namespace {
+
+// Frames queued between two stages; at most two are decoded ahead of processing
+// and two processed frames wait for the encoder
+constexpr int QueueCapacity = 2;
+
+struct Frame
+{
+    int index = 0;
+    QImage image;
+    QByteArray cacheKey;
+    bool cached = false;   // image is the cached result
+};
+
+// Closing the queue ends the stream: push() fails from then on and pop() fails
+// once the queued frames are drained. A stage that stops early closes both of
+// its queues, so the stages around it stop too.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(int capacity) : capacity(capacity) {}
+
+    bool push(T item)
+    {
+        QMutexLocker locker(&mutex);
+        while (int(items.size()) >= capacity && !closed)
+            notFull.wait(&mutex);
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        notEmpty.wakeOne();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        QMutexLocker locker(&mutex);
+        while (items.empty() && !closed)
+            notEmpty.wait(&mutex);
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.wakeOne();
+        return true;
+    }
+
+    void close()
+    {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        notFull.wakeAll();
+        notEmpty.wakeAll();
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition notFull;
+    QWaitCondition notEmpty;
+    std::deque<T> items;
+    int capacity;
+    bool closed = false;
+};
+
+// Geometry and tags of a planar 8-bit YUV stream
+struct StreamFormat
+{
+    QSize size;
+    int chromaShiftX = 1;
+    int chromaShiftY = 1;
+    bool mono = false;
+    bool fullRange = false;
+    QByteArray chroma = "420jpeg";
+    QByteArray frameRate = "25:1";
+    QByteArray interlacing = "p";
+    QByteArray aspect = "0:0";
+
+    int chromaWidth() const { return (size.width() + (1 << chromaShiftX) - 1) >> chromaShiftX; }
+    int chromaHeight() const { return (size.height() + (1 << chromaShiftY) - 1) >> chromaShiftY; }
+    qsizetype lumaBytes() const { return qsizetype(size.width()) * size.height(); }
+    qsizetype frameBytes() const { return lumaBytes() + (mono ? 0 : 2 * qsizetype(chromaWidth()) * chromaHeight()); }
+};
+
+// Video levels: luma from 16 to 235 and chroma from 16 to 240, unless the stream says full range
+struct RangeTables
+{
+    quint8 lumaToFull[256];
+    quint8 chromaToFull[256];
+    quint8 lumaToLimited[256];
+    quint8 chromaToLimited[256];
+
+    RangeTables()
+    {
+        for (int v = 0; v < 256; ++v) {
+            lumaToFull[v] = quint8(std::clamp(int(std::lround((v - 16) * 255.0 / 219.0)), 0, 255));
+            chromaToFull[v] = quint8(std::clamp(int(std::lround((v - 128) * 255.0 / 224.0)) + 128, 0, 255));
+            lumaToLimited[v] = quint8(std::lround(v * 219.0 / 255.0) + 16);
+            chromaToLimited[v] = quint8(std::lround((v - 128) * 224.0 / 255.0) + 128);
+        }
+    }
+};
+
+const RangeTables &rangeTables()
+{
+    static const RangeTables tables;
+    return tables;
+}
+
+template <typename Function>
+void forEachBand(int height, Function function)
+{
+    const int bandCount = std::max(1, std::min(QThread::idealThreadCount() * 2, height / 16));
+    std::vector<int> bands(bandCount);
+    std::iota(bands.begin(), bands.end(), 0);
+    QtConcurrent::blockingMap(bands, [&](int band) {
+        function(int(qint64(band) * height / bandCount), int(qint64(band + 1) * height / bandCount));
+    });
+}
+
+// Planar YUV into an RGB32 image, or Grayscale8 for a mono stream
+QImage fromYuv(const uchar *data, const StreamFormat &format)
+{
+    const int width = format.size.width();
+    const int height = format.size.height();
+    QImage image = ImageBufferPool::instance().acquire(width, height, format.mono ? QImage::Format_Grayscale8 : QImage::Format_RGB32);
+    const RangeTables &tables = rangeTables();
+    const quint8 *lumaTable = format.fullRange ? nullptr : tables.lumaToFull;
+    const quint8 *chromaTable = format.fullRange ? nullptr : tables.chromaToFull;
+    // scanLine() detaches on every call, which races between the bands; rows are
+    // offsets from pixels detached once here
+    uchar *const bits = image.bits();
+    const qsizetype bytesPerLine = image.bytesPerLine();
+
+    forEachBand(height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const uchar *luma = data + qsizetype(y) * width;
+            if (format.mono) {
+                uchar *out = bits + qsizetype(y) * bytesPerLine;
+                for (int x = 0; x < width; ++x)
+                    out[x] = lumaTable ? lumaTable[luma[x]] : luma[x];
+                continue;
+            }
+            const qsizetype chromaOffset = qsizetype(y >> format.chromaShiftY) * format.chromaWidth();
+            const uchar *cb = data + format.lumaBytes() + chromaOffset;
+            const uchar *cr = cb + qsizetype(format.chromaWidth()) * format.chromaHeight();
+            QRgb *out = reinterpret_cast<QRgb *>(bits + qsizetype(y) * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                const int c = x >> format.chromaShiftX;
+                int r, g, b;
+                if (lumaTable)
+                    ColorSpace::yCbCrToRgb<255>(lumaTable[luma[x]], chromaTable[cb[c]], chromaTable[cr[c]], r, g, b);
+                else
+                    ColorSpace::yCbCrToRgb<255>(luma[x], cb[c], cr[c], r, g, b);
+                out[x] = qRgb(r, g, b);
+            }
+        }
+    });
+    return image;
+}
+
+// Any working format into planar YUV; subsampled chroma is the mean of its pixels
+void toYuv(const QImage &frame, const StreamFormat &format, uchar *data)
+{
+    const QImage image = frame.format() == QImage::Format_Grayscale8 || frame.format() == QImage::Format_RGB32
+                             ? frame
+                             : ImageOps::toDisplayFormat(frame).convertToFormat(ImageOps::isGrayscale(frame) ? QImage::Format_Grayscale8
+                                                                                                                : QImage::Format_RGB32);
+    const bool gray = image.format() == QImage::Format_Grayscale8;
+    const int width = format.size.width();
+    const int chromaWidth = format.chromaWidth();
+    const RangeTables &tables = rangeTables();
+    const quint8 *lumaTable = format.fullRange ? nullptr : tables.lumaToLimited;
+    const quint8 *chromaTable = format.fullRange ? nullptr : tables.chromaToLimited;
+    uchar *cbPlane = data + format.lumaBytes();
+    uchar *crPlane = cbPlane + qsizetype(chromaWidth) * format.chromaHeight();
+
+    forEachBand(format.chromaHeight(), [&](int c0, int c1) {
+        std::vector<int> cbSums(chromaWidth);
+        std::vector<int> crSums(chromaWidth);
+        std::vector<int> counts(chromaWidth);
+        for (int cy = c0; cy < c1; ++cy) {
+            std::fill(cbSums.begin(), cbSums.end(), 0);
+            std::fill(crSums.begin(), crSums.end(), 0);
+            std::fill(counts.begin(), counts.end(), 0);
+            const int y0 = cy << format.chromaShiftY;
+            const int y1 = std::min(y0 + (1 << format.chromaShiftY), format.size.height());
+            for (int y = y0; y < y1; ++y) {
+                uchar *luma = data + qsizetype(y) * width;
+                if (gray) {
+                    const uchar *in = image.constScanLine(y);
+                    for (int x = 0; x < width; ++x)
+                        luma[x] = lumaTable ? lumaTable[in[x]] : in[x];
+                    continue;
+                }
+                const QRgb *in = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+                for (int x = 0; x < width; ++x) {
+                    int l, cb, cr;
+                    ColorSpace::rgbToYCbCr<255>(qRed(in[x]), qGreen(in[x]), qBlue(in[x]), l, cb, cr);
+                    luma[x] = lumaTable ? lumaTable[l] : uchar(l);
+                    const int c = x >> format.chromaShiftX;
+                    cbSums[c] += cb;
+                    crSums[c] += cr;
+                    ++counts[c];
+                }
+            }
+            if (format.mono)
+                continue;
+            uchar *cbRow = cbPlane + qsizetype(cy) * chromaWidth;
+            uchar *crRow = crPlane + qsizetype(cy) * chromaWidth;
+            for (int c = 0; c < chromaWidth; ++c) {
+                const int cb = gray ? 128 : (cbSums[c] + counts[c] / 2) / counts[c];
+                const int cr = gray ? 128 : (crSums[c] + counts[c] / 2) / counts[c];
+                cbRow[c] = chromaTable ? chromaTable[cb] : uchar(cb);
+                crRow[c] = chromaTable ? chromaTable[cr] : uchar(cr);
+            }
+        }
+    });
+}
+
+class FrameReader
+{
+public:
+    virtual ~FrameReader() = default;
+    // False at the end of the input, or on an error with errorString set
+    virtual bool read(QImage &image, QString *errorString) = 0;
+    virtual int firstIndex() const { return 0; }
+    // File the next read() decodes when every frame is a file of its own; skip() passes it by
+    virtual QString nextFileName() const { return QString(); }
+    virtual void skip() {}
+    virtual const StreamFormat *streamFormat() const { return nullptr; }
+};
+
+class FrameWriter
+{
+public:
+    virtual ~FrameWriter() = default;
+    virtual bool write(const QImage &image, int index, QString *errorString) = 0;
+};
+
+// Replaces the %d or %0Nd in pattern with index
+QString frameFileName(const QString &pattern, int index)
+{
+    static const QRegularExpression number(QStringLiteral("%(0\\d+)?d"));
+    const QRegularExpressionMatch match = number.match(pattern);
+    const int width = match.captured(1).toInt();
+    return QString(pattern).replace(match.capturedStart(), match.capturedLength(),
+                                    QStringLiteral("%1").arg(index, width, 10, QLatin1Char('0')));
+}
+
+class NumberedFrameReader : public FrameReader
+{
+public:
+    NumberedFrameReader(const QString &pattern, int first) : pattern(pattern), first(first), next(first) {}
+
+    bool read(QImage &image, QString *errorString) override
+    {
+        const QString fileName = frameFileName(pattern, next);
+        if (!QFileInfo::exists(fileName))
+            return false;
+        TraceScope trace("decode", "io");
+        QString readError;
+        image = ImageLoader::readImage(fileName, &readError);
+        if (image.isNull()) {
+            *errorString = QStringLiteral("%1: %2").arg(fileName, readError);
+            return false;
+        }
+        trace.setPixels(qint64(image.width()) * image.height());
+        ++next;
+        return true;
+    }
+
+    int firstIndex() const override { return first; }
+    QString nextFileName() const override { return frameFileName(pattern, next); }
+    void skip() override { ++next; }
+
+private:
+    QString pattern;
+    int first;
+    int next;
+};
+
+class YuvReader : public FrameReader
+{
+public:
+    YuvReader(const QString &fileName, bool raw) : file(fileName), raw(raw) {}
+
+    bool open(const QSize &frameSize, QString *errorString)
+    {
+        if (!file.open(QIODevice::ReadOnly)) {
+            *errorString = file.errorString();
+            return false;
+        }
+        if (raw) {
+            // Headerless captures carry no tags: I420 at video levels
+            if (!frameSize.isValid()) {
+                *errorString = QObject::tr("Raw YUV input needs --frame-size");
+                return false;
+            }
+            format.size = frameSize;
+            format.chroma = "420";
+        } else if (!parseHeader(file.readLine(1024), errorString)) {
+            return false;
+        }
+        buffer.resize(size_t(format.frameBytes()));
+        return true;
+    }
+
+    bool read(QImage &image, QString *errorString) override
+    {
+        if (!raw) {
+            const QByteArray marker = file.readLine(1024);
+            if (marker.isEmpty())
+                return false;
+            if (!marker.startsWith("FRAME")) {
+                *errorString = QObject::tr("Invalid frame header in %1").arg(file.fileName());
+                return false;
+            }
+        }
+        TraceScope trace("decode", "io", format.lumaBytes());
+        const qint64 bytes = file.read(reinterpret_cast<char *>(buffer.data()), qint64(buffer.size()));
+        if (bytes == 0 && raw)
+            return false;
+        if (bytes != qint64(buffer.size())) {
+            *errorString = QObject::tr("Truncated frame in %1").arg(file.fileName());
+            return false;
+        }
+        image = fromYuv(buffer.data(), format);
+        return true;
+    }
+
+    const StreamFormat *streamFormat() const override { return &format; }
+
+private:
+    bool parseHeader(const QByteArray &header, QString *errorString)
+    {
+        const QList<QByteArray> tokens = header.trimmed().split(' ');
+        if (tokens.value(0) != "YUV4MPEG2") {
+            *errorString = QObject::tr("%1 is not a YUV4MPEG2 stream").arg(file.fileName());
+            return false;
+        }
+        for (const QByteArray &token : tokens.mid(1)) {
+            const QByteArray value = token.mid(1);
+            switch (token.at(0)) {
+            case 'W': format.size.setWidth(value.toInt()); break;
+            case 'H': format.size.setHeight(value.toInt()); break;
+            case 'F': format.frameRate = value; break;
+            case 'I': format.interlacing = value; break;
+            case 'A': format.aspect = value; break;
+            case 'C': format.chroma = value; break;
+            case 'X':
+                if (value == "COLORRANGE=FULL")
+                    format.fullRange = true;
+                break;
+            default: break;
+            }
+        }
+
+        if (format.chroma == "420" || format.chroma == "420jpeg" || format.chroma == "420paldv" || format.chroma == "420mpeg2") {
+            format.chromaShiftX = format.chromaShiftY = 1;
+        } else if (format.chroma == "422") {
+            format.chromaShiftX = 1;
+            format.chromaShiftY = 0;
+        } else if (format.chroma == "444") {
+            format.chromaShiftX = format.chromaShiftY = 0;
+        } else if (format.chroma == "mono") {
+            format.mono = true;
+        } else {
+            *errorString = QObject::tr("Unsupported YUV4MPEG2 color space C%1; only 8-bit 420, 422, 444 and mono are read")
+                               .arg(QString::fromLatin1(format.chroma));
+            return false;
+        }
+        if (format.size.isEmpty()) {
+            *errorString = QObject::tr("%1 has no frame size").arg(file.fileName());
+            return false;
+        }
+        return true;
+    }
+
+    QFile file;
+    bool raw;
+    StreamFormat format;
+    std::vector<uchar> buffer;
+};
+
+class NumberedFrameWriter : public FrameWriter
+{
+public:
+    explicit NumberedFrameWriter(const QString &pattern) : pattern(pattern)
+    {
+        target.format = QFileInfo(pattern).suffix().toLower().toLatin1();
+        if (target.format == "jpeg")
+            target.format = "jpg";
+    }
+
+    bool write(const QImage &image, int index, QString *errorString) override
+    {
+        target.fileName = frameFileName(pattern, index);
+        return ExportQueue::write(image, target, errorString);
+    }
+
+private:
+    QString pattern;
+    ExportTarget target;
+};
+
+class YuvWriter : public FrameWriter
+{
+public:
+    YuvWriter(const QString &fileName, bool raw, const StreamFormat *input) : file(fileName), raw(raw)
+    {
+        // Streams keep the layout and tags of a YUV input; everything else becomes 4:2:0
+        if (input && !raw)
+            format = *input;
+        else if (raw)
+            format.chroma = "420";
+    }
+
+    bool open(QString *errorString)
+    {
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            *errorString = file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    bool write(const QImage &image, int, QString *errorString) override
+    {
+        if (buffer.empty()) {
+            // The first frame fixes the size of the stream
+            format.size = image.size();
+            buffer.resize(size_t(format.frameBytes()));
+            if (!raw) {
+                QByteArray header = "YUV4MPEG2 W" + QByteArray::number(image.width()) + " H" + QByteArray::number(image.height())
+                                    + " F" + format.frameRate + " I" + format.interlacing + " A" + format.aspect
+                                    + " C" + format.chroma;
+                if (format.fullRange)
+                    header += " XCOLORRANGE=FULL";
+                if (file.write(header + '\n') < 0) {
+                    *errorString = file.errorString();
+                    return false;
+                }
+            }
+        }
+        if (image.size() != format.size) {
+            *errorString = QObject::tr("Frames of a YUV stream must all have the same size");
+            return false;
+        }
+
+        TraceScope trace("encode", "io", format.lumaBytes());
+        toYuv(image, format, buffer.data());
+        if ((!raw && file.write("FRAME\n") < 0)
+            || file.write(reinterpret_cast<const char *>(buffer.data()), qint64(buffer.size())) != qint64(buffer.size())) {
+            *errorString = file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+private:
+    QFile file;
+    bool raw;
+    StreamFormat format;
+    std::vector<uchar> buffer;
+};
+
+bool isStream(const QString &fileName, bool *raw)
+{
+    const QString suffix = QFileInfo(fileName).suffix().toLower();
+    *raw = suffix == QLatin1String("yuv");
+    return *raw || suffix == QLatin1String("y4m");
+}
+
+std::unique_ptr<FrameReader> openReader(const QString &input, const QSize &frameSize, QString *errorString)
+{
+    bool raw = false;
+    if (isStream(input, &raw)) {
+        auto reader = std::make_unique<YuvReader>(input, raw);
+        if (!reader->open(frameSize, errorString))
+            return nullptr;
+        return reader;
+    }
+    if (!FrameSequence::isPattern(input)) {
+        *errorString = QObject::tr("The input must be a .y4m or .yuv file or a numbered pattern such as frame_%04d.png");
+        return nullptr;
+    }
+    // Numbering starts at 0 or 1 as a rule, or a little later when the first frames were dropped
+    for (int first = 0; first < 5; ++first) {
+        if (QFileInfo::exists(frameFileName(input, first)))
+            return std::make_unique<NumberedFrameReader>(input, first);
+    }
+    *errorString = QObject::tr("No frames match %1").arg(input);
+    return nullptr;
+}
+
+std::unique_ptr<FrameWriter> openWriter(const QString &output, const FrameReader &reader, QString *errorString)
+{
+    bool raw = false;
+    if (isStream(output, &raw)) {
+        auto writer = std::make_unique<YuvWriter>(output, raw, reader.streamFormat());
+        if (!writer->open(errorString))
+            return nullptr;
+        return writer;
+    }
+    if (!FrameSequence::isPattern(output)) {
+        *errorString = QObject::tr("The output must be a .y4m or .yuv file or a numbered pattern such as frame_%04d.png");
+        return nullptr;
+    }
+    if (!ExportQueue::isWritable(QFileInfo(output).suffix().toLower().toLatin1())) {
+        *errorString = QObject::tr("Unsupported format \"%1\"").arg(QFileInfo(output).suffix());
+        return nullptr;
+    }
+    return std::make_unique<NumberedFrameWriter>(output);
+}
+
+}
+
+bool FrameSequence::isPattern(const QString &fileName)
+{
+    static const QRegularExpression number(QStringLiteral("%(0\\d+)?d"));
+    return fileName.contains(number);
+}
+
+bool FrameSequence::run(const QString &input, const QString &output, const OperationChain &chain, const QSize &frameSize,
+                        ResultCache *cache, SequenceStatistics *statistics, QString *errorString,
+                        const std::function<void(int frames, double framesPerSecond)> &progress)
+{
+    std::unique_ptr<FrameReader> reader = openReader(input, frameSize, errorString);
+    if (!reader)
+        return false;
+    std::unique_ptr<FrameWriter> writer = openWriter(output, *reader, errorString);
+    if (!writer)
+        return false;
+
+    *statistics = SequenceStatistics();
+    BoundedQueue<Frame> decoded(QueueCapacity);
+    BoundedQueue<Frame> processed(QueueCapacity);
+    QString decodeError;
+    QString encodeError;
+    const QString recipe = cache ? chain.recipe() : QString();
+    QElapsedTimer clock;
+    clock.start();
+
+    // Decoding and encoding get threads of their own; processing runs here and
+    // spreads each frame over the global pool
+    QThreadPool stages;
+    stages.setMaxThreadCount(2);
+
+    QFuture<void> decoder = QtConcurrent::run(&stages, [&]() {
+        QElapsedTimer busy;
+        for (int index = reader->firstIndex();; ++index) {
+            busy.start();
+            Frame frame{index, QImage(), QByteArray(), false};
+            const QString source = cache ? reader->nextFileName() : QString();
+            if (!source.isEmpty() && QFileInfo::exists(source)) {
+                frame.cacheKey = ResultCache::fileKey(source, recipe);
+                frame.image = cache->find(frame.cacheKey);
+                frame.cached = !frame.image.isNull();
+            }
+            bool ok = true;
+            if (frame.cached)
+                reader->skip();
+            else
+                ok = reader->read(frame.image, &decodeError);
+            statistics->decodeTime += busy.nsecsElapsed();
+            if (!ok || !decoded.push(std::move(frame)))
+                break;
+        }
+        decoded.close();
+    });
+
+    QFuture<void> encoder = QtConcurrent::run(&stages, [&]() {
+        QElapsedTimer busy;
+        qint64 lastProgress = 0;
+        Frame frame;
+        while (processed.pop(frame)) {
+            busy.start();
+            const bool ok = writer->write(frame.image, frame.index, &encodeError);
+            if (ok && cache && !frame.cached)
+                cache->insert(frame.cacheKey, frame.image);
+            statistics->encodeTime += busy.nsecsElapsed();
+            if (!ok)
+                break;
+            ++statistics->frames;
+            statistics->elapsed = clock.nsecsElapsed();
+            if (progress && statistics->elapsed - lastProgress >= 1000000000) {
+                lastProgress = statistics->elapsed;
+                progress(statistics->frames, statistics->framesPerSecond());
+            }
+        }
+        processed.close();
+        decoded.close();
+    });
+
+    Frame frame;
+    QElapsedTimer busy;
+    while (decoded.pop(frame)) {
+        busy.start();
+        // Frames of a stream have no file of their own, so they are looked up by their pixels
+        if (cache && !frame.cached && frame.cacheKey.isEmpty()) {
+            frame.cacheKey = ResultCache::imageKey(frame.image, recipe);
+            const QImage result = cache->find(frame.cacheKey);
+            frame.cached = !result.isNull();
+            if (frame.cached)
+                frame.image = result;
+        }
+        if (frame.cached) {
+            ++statistics->cachedFrames;
+        } else {
+            TraceScope trace("processFrame", "op", qint64(frame.image.width()) * frame.image.height());
+            const bool highBitDepth = ImageOps::isHighBitDepth(frame.image);
+            frame.image = ImageOps::toWorkingFormat(std::move(frame.image), highBitDepth);
+            chain.apply(frame.image);
+        }
+        statistics->processTime += busy.nsecsElapsed();
+        if (!processed.push(std::move(frame)))
+            break;
+    }
+    processed.close();
+    decoded.close();
+
+    decoder.waitForFinished();
+    encoder.waitForFinished();
+    statistics->elapsed = clock.nsecsElapsed();
+
+    for (const QString &error : {decodeError, encodeError}) {
+        if (!error.isEmpty()) {
+            *errorString = error;
+            return false;
+        }
+    }
+    if (statistics->frames == 0) {
+        *errorString = QObject::tr("No frames in %1").arg(input);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef FRAMESEQUENCE_H
+#define FRAMESEQUENCE_H
+
+#include <QSize>
+#include <QString>
+#include <functional>
+
+class OperationChain;
+class ResultCache;
+
+struct SequenceStatistics
+{
+    int frames = 0;
+    qint64 elapsed = 0;      // nanoseconds from the first decode to the last encode
+    qint64 decodeTime = 0;   // nanoseconds each stage spent working
+    qint64 processTime = 0;
+    qint64 encodeTime = 0;
+    int cachedFrames = 0;    // frames whose result came from the result cache
+
+    double framesPerSecond() const { return elapsed > 0 ? frames * 1e9 / elapsed : 0.0; }
+};
+
+// Headless processing of frame sequences. The input and output are numbered
+// image files given as a pattern such as "shot_%04d.png", a YUV4MPEG2 (.y4m)
+// stream, or raw 8-bit I420 (.yuv) of frameSize. Decoding, processing and
+// encoding run on their own threads connected by short bounded queues, so
+// neighbouring frames overlap in the stages while memory stays bounded.
+namespace FrameSequence {
+
+bool isPattern(const QString &fileName);
+// With a cache, frames of numbered files whose result is cached are neither decoded
+// nor processed. progress is called from the encoding thread at most once a second.
+bool run(const QString &input, const QString &output, const OperationChain &chain, const QSize &frameSize,
+         ResultCache *cache, SequenceStatistics *statistics, QString *errorString,
+         const std::function<void(int frames, double framesPerSecond)> &progress = {});
+
+}
+
+#endif // FRAMESEQUENCE_H
@@ -0,0 +1,139 @@
+#include "histogramdock.h"
+#include "bufferpool.h"
+#include "imageops.h"
+#include "tracer.h"
+#include <QImage>
+#include <QPainter>
+#include <QPainterPath>
+
+static constexpr int Bins = 256;
+
+// Folds a histogram of any depth into 256 bins
+static std::vector<quint32> binned(const std::vector<quint32> &histogram)
+{
+    std::vector<quint32> result(Bins, 0);
+    const std::size_t step = std::max<std::size_t>(1, histogram.size() / Bins);
+    for (std::size_t i = 0; i < histogram.size(); ++i)
+        result[std::min<std::size_t>(i / step, Bins - 1)] += histogram[i];
+    return result;
+}
+
+class HistogramView : public QWidget
+{
+public:
+    explicit HistogramView(QWidget *parent = nullptr)
+        : QWidget(parent)
+    {
+        setMinimumSize(Bins + 16, 160);
+        setBackgroundRole(QPalette::Base);
+        setAutoFillBackground(true);
+    }
+
+    QSize sizeHint() const override { return QSize(2 * Bins + 16, 240); }
+
+    std::vector<quint32> originalLuma;
+    std::vector<quint32> luma;
+    std::vector<std::vector<quint32>> channels;
+
+protected:
+    void paintEvent(QPaintEvent *) override
+    {
+        QPainter painter(this);
+        painter.setRenderHint(QPainter::Antialiasing);
+        const QRectF plot = QRectF(rect()).adjusted(8, 8, -8, -8);
+
+        quint32 peak = 1;
+        for (const std::vector<quint32> *histogram : {&originalLuma, &luma})
+            for (quint32 count : *histogram)
+                peak = std::max(peak, count);
+
+        auto path = [&](const std::vector<quint32> &histogram, bool closed) {
+            QPainterPath result;
+            result.moveTo(plot.bottomLeft());
+            for (int i = 0; i < int(histogram.size()); ++i) {
+                const qreal x = plot.left() + plot.width() * (i + 0.5) / Bins;
+                result.lineTo(x, plot.bottom() - plot.height() * std::min(1.0, double(histogram[i]) / peak));
+            }
+            result.lineTo(plot.bottomRight());
+            if (closed)
+                result.closeSubpath();
+            return result;
+        };
+
+        if (!luma.empty())
+            painter.fillPath(path(luma, true), QColor(0, 120, 215, 160));
+        const QColor colors[3] = {QColor(220, 40, 40), QColor(40, 170, 40), QColor(40, 80, 230)};
+        for (std::size_t c = 0; c < channels.size() && c < 3; ++c) {
+            painter.setPen(QPen(colors[c], 1));
+            painter.drawPath(path(channels[c], false));
+        }
+        if (!originalLuma.empty()) {
+            painter.setPen(QPen(Qt::gray, 1, Qt::DashLine));
+            painter.drawPath(path(originalLuma, false));
+        }
+        painter.setPen(palette().color(QPalette::Mid));
+        painter.drawRect(plot);
+    }
+};
+
+HistogramDock::HistogramDock(QWidget *parent)
+    : QDockWidget(tr("Histogram"), parent), view(new HistogramView)
+{
+    setObjectName(QStringLiteral("histogramDock"));
+    setWidget(view);
+
+    // Coalesces any number of edits into one refresh per 60 Hz frame
+    refreshTimer.setSingleShot(true);
+    refreshTimer.setInterval(16);
+    connect(&refreshTimer, &QTimer::timeout, this, &HistogramDock::refresh);
+}
+
+void HistogramDock::setSources(const QImage *originalImage, const QImage *resultImage)
+{
+    original = originalImage;
+    result = resultImage;
+    invalidate();
+}
+
+void HistogramDock::invalidate()
+{
+    if (isVisible() && !refreshTimer.isActive())
+        refreshTimer.start();
+}
+
+void HistogramDock::showEvent(QShowEvent *event)
+{
+    QDockWidget::showEvent(event);
+    invalidate();
+}
+
+// Reads the images on the GUI thread at refresh time rather than keeping copies,
+// which would make every in-place edit detach and copy the pixels
+void HistogramDock::refresh()
+{
+    if (!result || !isVisible())
+        return;
+
+    bool changed = false;
+    if (original && original->cacheKey() != originalKey) {
+        originalKey = original->cacheKey();
+        view->originalLuma = original->isNull() ? std::vector<quint32>() : binned(ImageOps::lumaHistogram(ImageBufferPool::instance().adopt(ImageOps::toWorkingFormat(*original, false))));
+        changed = true;
+    }
+    if (result->cacheKey() != resultKey) {
+        TraceScope trace("histogram", "display", qint64(result->width()) * result->height());
+        resultKey = result->cacheKey();
+        view->luma.clear();
+        view->channels.clear();
+        if (!result->isNull()) {
+            view->luma = binned(ImageOps::lumaHistogram(*result));
+            if (!ImageOps::isGrayscale(*result)) {
+                for (const std::vector<quint32> &channel : ImageOps::histograms(*result))
+                    view->channels.push_back(binned(channel));
+            }
+        }
+        changed = true;
+    }
+    if (changed)
+        view->update();
+}
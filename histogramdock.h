@@ -0,0 +1,39 @@
+#ifndef HISTOGRAMDOCK_H
+#define HISTOGRAMDOCK_H
+
+#include <QDockWidget>
+#include <QTimer>
+#include <vector>
+
+class HistogramView;
+class QImage;
+
+// Dockable histogram of the processed image: luma filled, R, G and B as lines for
+// color images, and the luma of the original as an outline. invalidate() is cheap;
+// the histograms are recomputed at most once per display frame, only while the
+// dock is visible and only for images whose contents changed since the last time.
+class HistogramDock : public QDockWidget
+{
+    Q_OBJECT
+
+public:
+    explicit HistogramDock(QWidget *parent = nullptr);
+
+    void setSources(const QImage *original, const QImage *result);
+    void invalidate();
+
+protected:
+    void showEvent(QShowEvent *event) override;
+
+private:
+    void refresh();
+
+    HistogramView *view;
+    const QImage *original = nullptr;
+    const QImage *result = nullptr;
+    qint64 originalKey = 0;
+    qint64 resultKey = 0;
+    QTimer refreshTimer;
+};
+
+#endif // HISTOGRAMDOCK_H
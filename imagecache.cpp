@@ -0,0 +1,96 @@
+#include "imagecache.h"
+#include <QFileInfo>
+#include <QtConcurrent>
+#include <algorithm>
+
+static constexpr qsizetype MaxCachedBytes = qsizetype(512) << 20;
+
+static qsizetype imageBytes(const DecodedImage &decoded)
+{
+    return decoded.image.sizeInBytes() + decoded.display.sizeInBytes();
+}
+
+ImageCache::ImageCache(QObject *parent)
+    : QObject(parent), cache(MaxCachedBytes)
+{
+    prefetchPool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() / 2));
+}
+
+bool ImageCache::find(const QString &fileName, DecodedImage *decoded) const
+{
+    const Entry *entry = cache.object(fileName);
+    if (!entry || entry->lastModified != QFileInfo(fileName).lastModified())
+        return false;
+    *decoded = entry->decoded;
+    return true;
+}
+
+bool ImageCache::isLoading(const QString &fileName) const
+{
+    return pending.contains(fileName);
+}
+
+// Decodes on the shared pool; the result arrives through loaded()
+void ImageCache::load(const QString &fileName, const QSize &boundingSize)
+{
+    start(fileName, boundingSize, QThreadPool::globalInstance());
+}
+
+// Drops queued prefetches that are no longer wanted and decodes the new ones
+void ImageCache::prefetch(const QStringList &fileNames, const QSize &boundingSize)
+{
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        if (it.value().pool == &prefetchPool && !fileNames.contains(it.key()))
+            it.value().cancelled->store(true);
+    }
+
+    DecodedImage decoded;
+    for (const QString &fileName : fileNames) {
+        if (!find(fileName, &decoded))
+            start(fileName, boundingSize, &prefetchPool);
+    }
+}
+
+qint64 ImageCache::totalBytes() const
+{
+    return cache.totalCost();
+}
+
+void ImageCache::start(const QString &fileName, const QSize &boundingSize, QThreadPool *pool)
+{
+    auto it = pending.find(fileName);
+    if (it != pending.end()) {
+        it.value().cancelled->store(false);
+        return;
+    }
+
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    QFutureWatcher<DecodedImage> *watcher = new QFutureWatcher<DecodedImage>(this);
+    pending.insert(fileName, Pending{watcher, cancelled, boundingSize, pool});
+    connect(watcher, &QFutureWatcher<DecodedImage>::finished, this, [this, fileName]() {
+        finished(fileName);
+    });
+    watcher->setFuture(QtConcurrent::run(pool, [fileName, boundingSize, cancelled]() {
+        if (cancelled->load())
+            return DecodedImage();
+        return ImageLoader::read(fileName, boundingSize);
+    }));
+}
+
+void ImageCache::finished(const QString &fileName)
+{
+    const Pending job = pending.take(fileName);
+    job.watcher->deleteLater();
+    const DecodedImage decoded = job.watcher->result();
+
+    // Skipped as cancelled; decode it after all if it was asked for again meanwhile
+    if (decoded.image.isNull() && decoded.errorString.isEmpty()) {
+        if (!job.cancelled->load())
+            start(fileName, job.boundingSize, job.pool);
+        return;
+    }
+
+    if (!decoded.image.isNull())
+        cache.insert(fileName, new Entry{decoded, QFileInfo(fileName).lastModified()}, imageBytes(decoded));
+    emit loaded(fileName, decoded);
+}
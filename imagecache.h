@@ -0,0 +1,56 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include "imageloader.h"
+#include <QCache>
+#include <QDateTime>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QObject>
+#include <QThreadPool>
+#include <atomic>
+#include <memory>
+
+// LRU cache of decoded images and their display proxies, keyed by file path
+// and bounded by bytes. Files are decoded on worker threads; prefetches run on
+// a small pool of their own so they never hold up the file being opened.
+class ImageCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ImageCache(QObject *parent = nullptr);
+
+    bool find(const QString &fileName, DecodedImage *decoded) const;
+    bool isLoading(const QString &fileName) const;
+    void load(const QString &fileName, const QSize &boundingSize);
+    void prefetch(const QStringList &fileNames, const QSize &boundingSize);
+    qint64 totalBytes() const;
+
+signals:
+    void loaded(const QString &fileName, const DecodedImage &decoded);
+
+private:
+    struct Entry
+    {
+        DecodedImage decoded;
+        QDateTime lastModified;
+    };
+
+    struct Pending
+    {
+        QFutureWatcher<DecodedImage> *watcher;
+        std::shared_ptr<std::atomic<bool>> cancelled;
+        QSize boundingSize;
+        QThreadPool *pool;
+    };
+
+    void start(const QString &fileName, const QSize &boundingSize, QThreadPool *pool);
+    void finished(const QString &fileName);
+
+    QCache<QString, Entry> cache;
+    QHash<QString, Pending> pending;
+    QThreadPool prefetchPool;
+};
+
+#endif // IMAGECACHE_H
@@ -0,0 +1,155 @@
+#include "imageloader.h"
+#include "bufferpool.h"
+#include "imageops.h"
+#include "rawimage.h"
+#include "tracer.h"
+#include <QColorSpace>
+#include <QImageIOHandler>
+#include <QImageReader>
+
+// Size the decoder should produce so the transformed image fits the bounds
+static QSize previewSize(const QImageReader &reader, const QSize &boundingSize)
+{
+    QSize bounds = boundingSize;
+    if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+        bounds.transpose();
+    return reader.size().scaled(bounds, Qt::KeepAspectRatio);
+}
+
+QStringList ImageLoader::nameFilters()
+{
+    QStringList filters;
+    for (const QByteArray &format : QImageReader::supportedImageFormats())
+        filters.append("*." + QString::fromLatin1(format));
+    filters.append("*." + QString::fromLatin1(RawImage::formatName()));
+    return filters;
+}
+
+QImage ImageLoader::readImage(const QString &fileName, QString *errorString)
+{
+    if (RawImage::isRawFile(fileName))
+        return ImageBufferPool::instance().adopt(RawImage::read(fileName, errorString));
+
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    QImage image = reader.read();
+    if (image.isNull()) {
+        *errorString = reader.errorString();
+        return image;
+    }
+    if (image.colorSpace().isValid())
+        image.convertToColorSpace(QColorSpace::SRgb);
+    return ImageBufferPool::instance().adopt(std::move(image));
+}
+
+// Only worth it when the decoder scales natively and the image is larger than the screen
+bool ImageLoader::canReadPreview(const QString &fileName, const QSize &boundingSize)
+{
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    if (!reader.supportsOption(QImageIOHandler::ScaledSize))
+        return false;
+    const QSize size = reader.size();
+    return size.isValid() && previewSize(reader, boundingSize).width() < size.width();
+}
+
+QImage ImageLoader::readPreview(const QString &fileName, const QSize &boundingSize, QString *errorString)
+{
+    TraceScope trace("preview", "io");
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    reader.setScaledSize(previewSize(reader, boundingSize));
+    QImage preview = reader.read();
+    if (preview.isNull()) {
+        if (errorString)
+            *errorString = reader.errorString();
+        return preview;
+    }
+    trace.setPixels(qint64(preview.width()) * preview.height());
+
+    if (preview.colorSpace().isValid())
+        preview.convertToColorSpace(QColorSpace::SRgb);
+    return ImageBufferPool::instance().adopt(ImageOps::toDisplayFormat(std::move(preview)));
+}
+
+DecodedImage ImageLoader::read(const QString &fileName, const QSize &boundingSize)
+{
+    DecodedImage result;
+    {
+        TraceScope trace("decode", "io");
+        result.image = readImage(fileName, &result.errorString);
+        if (result.image.isNull())
+            return result;
+        trace.setPixels(qint64(result.image.width()) * result.image.height());
+    }
+
+    result.display = scaledForDisplay(result.image, boundingSize);
+    return result;
+}
+
+QImage ImageLoader::scaledForDisplay(const QImage &image, const QSize &boundingSize)
+{
+    QImage scaledImage = image;
+    if (image.width() > boundingSize.width() || image.height() > boundingSize.height()) {
+        TraceScope trace("scale", "display", qint64(image.width()) * image.height());
+        scaledImage = image.scaled(boundingSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+    return ImageBufferPool::instance().adopt(ImageOps::toDisplayFormat(std::move(scaledImage)));
+}
+
+QImage ImageLoader::readThumbnail(const QString &fileName, const QSize &boundingSize, QString *errorString)
+{
+    TraceScope trace("thumbnail", "io");
+    QImage image;
+    const uchar *mappedPixels = nullptr;
+    if (RawImage::isRawFile(fileName)) {
+        // Mapping costs nothing up front; the pages are read as the halving below averages them
+        QString rawError;
+        image = RawImage::read(fileName, &rawError);
+        if (image.isNull()) {
+            if (errorString)
+                *errorString = rawError;
+            return image;
+        }
+        mappedPixels = image.constBits();
+    } else {
+        QImageReader reader(fileName);
+        reader.setAutoTransform(true);
+        // Decoders scale by powers of two cheaply, so stop at the last one that still covers the bounds
+        if (reader.supportsOption(QImageIOHandler::ScaledSize)) {
+            const QSize size = reader.size();
+            const QSize target = previewSize(reader, boundingSize);
+            int factor = 1;
+            while (factor < 8 && size.width() / (2 * factor) >= target.width() && size.height() / (2 * factor) >= target.height())
+                factor *= 2;
+            if (factor > 1)
+                reader.setScaledSize(size / factor);
+        }
+        image = reader.read();
+        if (image.isNull()) {
+            if (errorString)
+                *errorString = reader.errorString();
+            return image;
+        }
+        if (image.colorSpace().isValid())
+            image.convertToColorSpace(QColorSpace::SRgb);
+    }
+    trace.setPixels(qint64(image.width()) * image.height());
+
+    image = ImageOps::toWorkingFormat(std::move(image), false);
+    QSize target = image.size();
+    if (target.width() > boundingSize.width() || target.height() > boundingSize.height())
+        target = target.scaled(boundingSize, Qt::KeepAspectRatio);
+    while (image.width() >= 2 * target.width() && image.height() >= 2 * target.height()) {
+        QImage half(image.width() / 2, image.height() / 2, image.format());
+        ImageOps::zoomOut(image, half);
+        image = std::move(half);
+    }
+    if (image.size() != target)
+        image = image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    // A raw file small enough to need no scaling would otherwise stay mapped and open
+    // for as long as the contact sheet holds its thumbnail
+    if (mappedPixels && image.constBits() == mappedPixels)
+        image = image.copy();
+    return image;
+}
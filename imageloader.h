@@ -0,0 +1,36 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+
+struct DecodedImage
+{
+    QImage image;
+    QImage display;
+    QString errorString;
+};
+
+// Decoding for the open path. readPreview() asks the decoder for a reduced
+// resolution image (JPEG scales in the DCT), read() does the full decode and
+// the display downscale so both can run off the GUI thread.
+namespace ImageLoader {
+
+// Patterns of every readable file, the raw format included
+QStringList nameFilters();
+// Full decode, with the orientation applied and converted to sRGB; raw files are mapped
+QImage readImage(const QString &fileName, QString *errorString);
+
+bool canReadPreview(const QString &fileName, const QSize &boundingSize);
+QImage readPreview(const QString &fileName, const QSize &boundingSize, QString *errorString);
+DecodedImage read(const QString &fileName, const QSize &boundingSize);
+QImage scaledForDisplay(const QImage &image, const QSize &boundingSize);
+// Small 8-bit image that fits boundingSize: a reduced decode where the decoder offers
+// one, halved with 2x2 box averages while it is twice the bounds, then scaled smoothly
+QImage readThumbnail(const QString &fileName, const QSize &boundingSize, QString *errorString);
+
+}
+
+#endif // IMAGELOADER_H
@@ -0,0 +1,2356 @@
+#include "imageops.h"
+#include "bufferpool.h"
+#include "colorspace.h"
+#include "cpufeatures.h"
+#include <QMutex>
+#include <QtConcurrent>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+// Channel layout of a working format. Alpha is -1 when there is none.
+template <typename T, int ChannelCount, int RedIndex, int GreenIndex, int BlueIndex, int AlphaIndex>
+struct Layout
+{
+    using Channel = T;
+    static constexpr int Channels = ChannelCount;
+    static constexpr int Red = RedIndex;
+    static constexpr int Green = GreenIndex;
+    static constexpr int Blue = BlueIndex;
+    static constexpr int Alpha = AlphaIndex;
+    static constexpr int Max = std::numeric_limits<T>::max();
+    static constexpr int Scale = Max / 255;
+};
+
+using Gray8 = Layout<quint8, 1, 0, 0, 0, -1>;
+using Gray16 = Layout<quint16, 1, 0, 0, 0, -1>;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+using Argb32 = Layout<quint8, 4, 2, 1, 0, 3>;
+#else
+using Argb32 = Layout<quint8, 4, 1, 2, 3, 0>;
+#endif
+using Rgba64 = Layout<quint16, 4, 0, 1, 2, 3>;
+
+template <typename Function>
+void withLayout(QImage::Format format, Function &&function)
+{
+    switch (format) {
+    case QImage::Format_Grayscale8:
+        function(Gray8());
+        break;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+        function(Argb32());
+        break;
+    case QImage::Format_Grayscale16:
+        function(Gray16());
+        break;
+    case QImage::Format_RGBX64:
+    case QImage::Format_RGBA64:
+        function(Rgba64());
+        break;
+    default:
+        Q_ASSERT(!"ImageOps: not a working format");
+        break;
+    }
+}
+
+// Hot kernels are built once per instruction set level, and the level matching
+// CpuFeatures::active() is picked at run time. Each variant is flattened so what it
+// calls is inlined and vectorised for its target. FMA is left out on purpose so every
+// level produces identical pixels. SSE2 is part of x86-64, so only 32-bit x86 builds
+// an SSE2 variant; elsewhere that level runs the generic code.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_VARIANTS
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2"), flatten))
+#define TARGET_AVX2 __attribute__((target("avx2"), flatten))
+#define TARGET_SSE2 __attribute__((target("sse2"), flatten))
+#endif
+
+template <typename Function>
+Function selectVariant(Function generic, Function sse2, Function avx2, Function avx512)
+{
+    switch (CpuFeatures::active()) {
+    case CpuFeatures::Level::Avx512:
+        return avx512;
+    case CpuFeatures::Level::Avx2:
+        return avx2;
+    case CpuFeatures::Level::Sse2:
+        return sse2;
+    case CpuFeatures::Level::Generic:
+        break;
+    }
+    return generic;
+}
+
+template <typename Function>
+void runBand(const Function &function, int index)
+{
+    function(index);
+}
+
+#ifdef SIMD_VARIANTS
+template <typename Function>
+TARGET_AVX512 void runBandAvx512(const Function &function, int index)
+{
+    function(index);
+}
+
+template <typename Function>
+TARGET_AVX2 void runBandAvx2(const Function &function, int index)
+{
+    function(index);
+}
+
+#ifdef __i386__
+template <typename Function>
+TARGET_SSE2 void runBandSse2(const Function &function, int index)
+{
+    function(index);
+}
+#endif
+#endif
+
+// QtConcurrent::blockingMap() over band or tile indices for parallel kernels. The
+// lambdas QtConcurrent runs are out of reach of a flattened caller, so each call goes
+// through a variant that flattens function for the level picked on the calling thread.
+template <typename Function>
+void blockingMapVariant(std::vector<int> &indices, const Function &function)
+{
+#if defined(SIMD_VARIANTS) && defined(__i386__)
+    const auto run = selectVariant(&runBand<Function>, &runBandSse2<Function>, &runBandAvx2<Function>, &runBandAvx512<Function>);
+#elif defined(SIMD_VARIANTS)
+    const auto run = selectVariant(&runBand<Function>, &runBand<Function>, &runBandAvx2<Function>, &runBandAvx512<Function>);
+#else
+    const auto run = &runBand<Function>;
+#endif
+    QtConcurrent::blockingMap(indices, [&function, run](int index) { run(function, index); });
+}
+
+template <typename L>
+inline typename L::Channel clampChannel(int value)
+{
+    return typename L::Channel(value < 0 ? 0 : (value > L::Max ? L::Max : value));
+}
+
+template <typename L>
+inline typename L::Channel clampChannel(float value)
+{
+    return typename L::Channel(value < 0.0f ? 0.0f : (value > float(L::Max) ? float(L::Max) : value));
+}
+
+template <typename L>
+inline typename L::Channel *line(QImage &image, int y)
+{
+    return reinterpret_cast<typename L::Channel *>(image.scanLine(y));
+}
+
+template <typename L>
+inline const typename L::Channel *line(const QImage &image, int y)
+{
+    return reinterpret_cast<const typename L::Channel *>(image.constScanLine(y));
+}
+
+// Rows of an image that worker threads write to. scanLine() detaches and counts the
+// detach on every call, which races between threads and, while the pixels are shared,
+// leaves each thread writing into a copy of its own. The image is detached once here
+// on the calling thread and the workers only offset from the start of its pixels.
+template <typename T>
+class RowPointers
+{
+public:
+    RowPointers() = default;
+    explicit RowPointers(QImage &image) : bits(image.bits()), bytesPerLine(image.bytesPerLine()) {}
+    T *operator[](int y) const { return reinterpret_cast<T *>(bits + qsizetype(y) * bytesPerLine); }
+
+private:
+    uchar *bits = nullptr;
+    qsizetype bytesPerLine = 0;
+};
+
+// Applies map to every color channel, leaving alpha untouched. The channel loop
+// is unrolled at compile time so the row loop vectorises.
+template <typename L, typename Map>
+void mapColorChannels(QImage &image, Map map)
+{
+    const int width = image.width();
+    for (int y = 0; y < image.height(); ++y) {
+        typename L::Channel *pixels = line<L>(image, y);
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < L::Channels; ++c) {
+                if (c != L::Alpha)
+                    pixels[x * L::Channels + c] = map(pixels[x * L::Channels + c]);
+            }
+        }
+    }
+}
+
+template <typename L>
+void grayRows(const QImage &source, QImage &target)
+{
+    using T = typename L::Channel;
+    const int width = source.width();
+    for (int y = 0; y < source.height(); ++y) {
+        const T *in = line<L>(source, y);
+        T *out = reinterpret_cast<T *>(target.scanLine(y));
+        if (L::Channels == 1) {
+            std::memcpy(out, in, width * sizeof(T));
+            continue;
+        }
+        // 0.299, 0.587 and 0.114 in 16-bit fixed point; fits 32 bits for 16-bit channels
+        for (int x = 0; x < width; ++x) {
+            const quint32 r = in[x * L::Channels + L::Red];
+            const quint32 g = in[x * L::Channels + L::Green];
+            const quint32 b = in[x * L::Channels + L::Blue];
+            out[x] = T((19595u * r + 38470u * g + 7471u * b + 32768u) >> 16);
+        }
+    }
+}
+
+template <typename L>
+bool quantizeRows(QImage &image, int levels)
+{
+    using T = typename L::Channel;
+    const int width = image.width();
+
+    int t1 = L::Max;
+    int t2 = 0;
+    for (int y = 0; y < image.height(); ++y) {
+        const T *pixels = line<L>(static_cast<const QImage &>(image), y);
+        for (int x = 0; x < width; ++x) {
+            t1 = std::min<int>(t1, pixels[x]);
+            t2 = std::max<int>(t2, pixels[x]);
+        }
+    }
+
+    const int tam_int = t2 - t1 + 1;
+    if (levels >= tam_int)
+        return false;
+
+    // Each value maps to the centre of its bin
+    const float tb = float(tam_int) / levels;
+    std::vector<T> lut(L::Max + 1);
+    for (int value = t1; value <= t2; ++value) {
+        const int bin = (value - t1 + 0.5f) / tb;
+        lut[value] = clampChannel<L>(int(t1 - 0.5f + (bin + 0.5f) * tb));
+    }
+    mapColorChannels<L>(image, [&lut](T value) { return lut[value]; });
+    return true;
+}
+
+template <typename L>
+std::vector<std::vector<quint32>> histogramRows(const QImage &image)
+{
+    using T = typename L::Channel;
+    const int colorChannels = L::Channels == 1 ? 1 : 3;
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+    std::vector<std::vector<quint32>> result(colorChannels, std::vector<quint32>(L::Max + 1, 0));
+
+    const int width = image.width();
+    for (int y = 0; y < image.height(); ++y) {
+        const T *pixels = line<L>(image, y);
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < colorChannels; ++c)
+                ++result[c][pixels[x * L::Channels + channelIndex[c]]];
+        }
+    }
+    return result;
+}
+
+// Cumulative histogram scaled to 0..255, rounding each bin before it is added as
+// the original 8-bit code did. With 16-bit levels most bins would round to nothing.
+std::array<int, 256> roundedCumulative(const quint32 *histogram, qint64 pixelCount)
+{
+    const float alpha = 255.0f / float(pixelCount);
+    std::array<int, 256> cumulative;
+    int sum = 0;
+    for (int i = 0; i < 256; i++) {
+        sum += int(std::round(alpha * float(histogram[i])));
+        cumulative[i] = sum;
+    }
+    return cumulative;
+}
+
+// The per-channel equalization and matching of 8-bit images keep the mapping of the
+// original code, including its lookup against the next target level
+template <typename L>
+void equalizationLevels(const quint32 *histogram, qint64 pixelCount, quint16 *lut)
+{
+    if constexpr (L::Max == 255) {
+        const std::array<int, 256> cumulative = roundedCumulative(histogram, pixelCount);
+        for (int i = 0; i < 256; i++)
+            lut[i] = quint16(std::min(255, cumulative[i]));
+    } else {
+        ImageOps::equalizationLut(histogram, L::Max + 1, pixelCount, lut);
+    }
+}
+
+void originalMatchingLut(const std::vector<quint32> &source, qint64 sourceCount, const std::vector<quint32> &target,
+                         qint64 targetCount, quint16 *lut)
+{
+    const std::array<int, 256> cumulativeSource = roundedCumulative(source.data(), sourceCount);
+    const std::array<int, 256> cumulativeTarget = roundedCumulative(target.data(), targetCount);
+    int j = 0;
+    for (int i = 0; i < 256; i++) {
+        while (j < 255 && cumulativeSource[i] > cumulativeTarget[j + 1])
+            ++j;
+        lut[i] = quint16(j);
+    }
+}
+
+template <typename L>
+void equalizeRows(QImage &image)
+{
+    using T = typename L::Channel;
+    const std::vector<std::vector<quint32>> channelHistograms = histogramRows<L>(image);
+    const int colorChannels = int(channelHistograms.size());
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+    const qint64 numPixels = qint64(image.width()) * image.height();
+
+    std::vector<quint16> cdf(colorChannels * (L::Max + 1));
+    for (int c = 0; c < colorChannels; ++c)
+        equalizationLevels<L>(channelHistograms[c].data(), numPixels, cdf.data() + c * (L::Max + 1));
+
+    const int width = image.width();
+    for (int y = 0; y < image.height(); ++y) {
+        T *pixels = line<L>(image, y);
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < colorChannels; ++c) {
+                T &value = pixels[x * L::Channels + channelIndex[c]];
+                value = T(cdf[c * (L::Max + 1) + value]);
+            }
+        }
+    }
+}
+
+// Tones for equalizing and matching color images without touching their hue.
+// index() gives the tone of a pixel in 0..L::Max, and map() replaces it through
+// a LUT with the conversion to and from the color space fused into one step.
+template <typename L>
+struct LumaTone
+{
+    using T = typename L::Channel;
+
+    int index(const T *pixel) const
+    {
+        int y, cb, cr;
+        ColorSpace::rgbToYCbCr<L::Max>(pixel[L::Red], pixel[L::Green], pixel[L::Blue], y, cb, cr);
+        return y;
+    }
+
+    void map(T *pixel, const quint16 *lut) const
+    {
+        int y, cb, cr, r, g, b;
+        ColorSpace::rgbToYCbCr<L::Max>(pixel[L::Red], pixel[L::Green], pixel[L::Blue], y, cb, cr);
+        ColorSpace::yCbCrToRgb<L::Max>(lut[y], cb, cr, r, g, b);
+        pixel[L::Red] = T(r);
+        pixel[L::Green] = T(g);
+        pixel[L::Blue] = T(b);
+    }
+};
+
+template <typename L>
+struct LightnessTone
+{
+    using T = typename L::Channel;
+    const ColorSpace::LabConverter &lab = ColorSpace::labConverter(L::Max);
+
+    static int bin(float lightness)
+    {
+        return std::clamp(int(lightness * (L::Max / 100.0f) + 0.5f), 0, L::Max);
+    }
+
+    int index(const T *pixel) const
+    {
+        return bin(lab.lightness(pixel[L::Red], pixel[L::Green], pixel[L::Blue]));
+    }
+
+    void map(T *pixel, const quint16 *lut) const
+    {
+        float l, a, bb;
+        int r, g, b;
+        lab.toLab(pixel[L::Red], pixel[L::Green], pixel[L::Blue], l, a, bb);
+        lab.toRgb(lut[bin(l)] * (100.0f / L::Max), a, bb, r, g, b);
+        pixel[L::Red] = T(r);
+        pixel[L::Green] = T(g);
+        pixel[L::Blue] = T(b);
+    }
+};
+
+template <typename L, typename Tone>
+std::vector<quint32> toneHistogram(const QImage &image, const Tone &tone)
+{
+    const int width = image.width();
+    const int height = image.height();
+    std::vector<quint32> histogram(L::Max + 1, 0);
+    QMutex mutex;
+
+    const int bandHeight = 64;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    blockingMapVariant(bands, [&](int band) {
+        std::vector<quint32> bandHistogram(L::Max + 1, 0);
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            const typename L::Channel *pixels = line<L>(image, y);
+            for (int x = 0; x < width; ++x)
+                ++bandHistogram[tone.index(pixels + x * L::Channels)];
+        }
+        QMutexLocker locker(&mutex);
+        for (int i = 0; i <= L::Max; ++i)
+            histogram[i] += bandHistogram[i];
+    });
+    return histogram;
+}
+
+template <typename L, typename Tone>
+void mapTone(QImage &image, const Tone &tone, const std::vector<quint16> &lut)
+{
+    const int width = image.width();
+    const int height = image.height();
+    const int bandHeight = 64;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    const RowPointers<typename L::Channel> pixelRows(image);
+    blockingMapVariant(bands, [&](int band) {
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            typename L::Channel *pixels = pixelRows[y];
+            for (int x = 0; x < width; ++x)
+                tone.map(pixels + x * L::Channels, lut.data());
+        }
+    });
+}
+
+// Maps each level to the first target level whose cumulative share is at least as large
+void matchingLut(const std::vector<quint32> &source, qint64 sourceCount, const std::vector<quint32> &target,
+                 qint64 targetCount, quint16 *lut)
+{
+    const int bins = int(source.size());
+    qint64 cumulativeSource = 0;
+    qint64 cumulativeTarget = target[0];
+    int j = 0;
+    for (int i = 0; i < bins; i++) {
+        cumulativeSource += source[i];
+        while (j < bins - 1 && cumulativeTarget * sourceCount < cumulativeSource * targetCount)
+            cumulativeTarget += target[++j];
+        lut[i] = quint16(j);
+    }
+}
+
+template <typename L, typename Tone>
+void equalizeTone(QImage &image, const Tone &tone)
+{
+    const std::vector<quint32> histogram = toneHistogram<L>(image, tone);
+    std::vector<quint16> lut(L::Max + 1);
+    ImageOps::equalizationLut(histogram.data(), L::Max + 1, qint64(image.width()) * image.height(), lut.data());
+    mapTone<L>(image, tone, lut);
+}
+
+template <typename L, typename Tone>
+void matchTone(QImage &image, const QImage &reference, const Tone &tone)
+{
+    std::vector<quint16> lut(L::Max + 1);
+    matchingLut(toneHistogram<L>(image, tone), qint64(image.width()) * image.height(),
+                toneHistogram<L>(reference, tone), qint64(reference.width()) * reference.height(), lut.data());
+    mapTone<L>(image, tone, lut);
+}
+
+template <typename L>
+void matchChannels(QImage &image, const QImage &reference)
+{
+    using T = typename L::Channel;
+    const std::vector<std::vector<quint32>> source = histogramRows<L>(image);
+    const std::vector<std::vector<quint32>> target = histogramRows<L>(reference);
+    const int colorChannels = int(source.size());
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+
+    const qint64 sourceCount = qint64(image.width()) * image.height();
+    const qint64 targetCount = qint64(reference.width()) * reference.height();
+    std::vector<quint16> luts(colorChannels * (L::Max + 1));
+    for (int c = 0; c < colorChannels; ++c) {
+        if constexpr (L::Max == 255)
+            originalMatchingLut(source[c], sourceCount, target[c], targetCount, luts.data() + c * (L::Max + 1));
+        else
+            matchingLut(source[c], sourceCount, target[c], targetCount, luts.data() + c * (L::Max + 1));
+    }
+
+    const int width = image.width();
+    for (int y = 0; y < image.height(); ++y) {
+        T *pixels = line<L>(image, y);
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < colorChannels; ++c) {
+                T &value = pixels[x * L::Channels + channelIndex[c]];
+                value = T(luts[c * (L::Max + 1) + value]);
+            }
+        }
+    }
+}
+
+// Clips each bin at limit and spreads the excess evenly over all bins
+void clipHistogram(quint32 *histogram, int bins, quint32 limit)
+{
+    qint64 excess = 0;
+    for (int i = 0; i < bins; i++) {
+        if (histogram[i] > limit) {
+            excess += histogram[i] - limit;
+            histogram[i] = limit;
+        }
+    }
+
+    const quint32 increment = quint32(excess / bins);
+    qint64 remainder = excess % bins;
+    for (int i = 0; i < bins; i++)
+        histogram[i] += increment;
+    const int step = remainder > 0 ? std::max<qint64>(1, bins / remainder) : bins;
+    for (int i = 0; i < bins && remainder > 0; i += step, --remainder)
+        ++histogram[i];
+}
+
+// Neighbouring tiles and the weight of the second one for each pixel column or row
+struct TileWeight
+{
+    int first;
+    int second;
+    float weight;
+};
+
+std::vector<TileWeight> tileWeights(int size, int tiles)
+{
+    std::vector<TileWeight> weights(size);
+    const float tileSize = float(size) / tiles;
+    for (int i = 0; i < size; ++i) {
+        const float position = (i + 0.5f) / tileSize - 0.5f;
+        const int first = std::clamp(int(std::floor(position)), 0, tiles - 1);
+        weights[i] = {first, std::min(first + 1, tiles - 1), std::clamp(position - first, 0.0f, 1.0f)};
+    }
+    return weights;
+}
+
+template <typename L>
+inline int lumaValue(const typename L::Channel *pixel)
+{
+    return int((19595u * pixel[L::Red] + 38470u * pixel[L::Green] + 7471u * pixel[L::Blue] + 32768u) >> 16);
+}
+
+// Equalizes each tile with a clipped histogram and blends the mappings of the
+// four nearest tile centres, so every pixel costs four lookups whatever the tile count
+template <typename L>
+void claheRows(QImage &image, int tilesX, int tilesY, float clipLimit, bool luminance)
+{
+    using T = typename L::Channel;
+    const int width = image.width();
+    const int height = image.height();
+    tilesX = std::clamp(tilesX, 1, width);
+    tilesY = std::clamp(tilesY, 1, height);
+    const bool luma = luminance && L::Channels > 1;
+    const int colorChannels = L::Channels == 1 || luma ? 1 : 3;
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+    // 16-bit tiles are equalized on 4096 bins of 16 levels, since full-depth LUTs for
+    // 64 x 64 tiles would take gigabytes. Levels inside a bin are interpolated between
+    // the mappings of its lower and upper edge.
+    constexpr int binShift = L::Max > 4095 ? 4 : 0;
+    constexpr int bins = (L::Max >> binShift) + 1;
+    const float binScale = float(L::Max) / (bins - 1);
+    const QImage &source = image;
+
+    std::vector<quint16> luts(std::size_t(tilesX) * tilesY * colorChannels * bins);
+    std::vector<int> tiles(tilesX * tilesY);
+    std::iota(tiles.begin(), tiles.end(), 0);
+    blockingMapVariant(tiles, [&](int tile) {
+        const int x0 = int(qint64(tile % tilesX) * width / tilesX);
+        const int x1 = int(qint64(tile % tilesX + 1) * width / tilesX);
+        const int y0 = int(qint64(tile / tilesX) * height / tilesY);
+        const int y1 = int(qint64(tile / tilesX + 1) * height / tilesY);
+
+        std::vector<quint32> histogram(std::size_t(colorChannels) * bins, 0);
+        for (int y = y0; y < y1; ++y) {
+            const T *pixels = line<L>(source, y);
+            for (int x = x0; x < x1; ++x) {
+                const T *pixel = pixels + x * L::Channels;
+                if (luma) {
+                    ++histogram[lumaValue<L>(pixel) >> binShift];
+                } else {
+                    for (int c = 0; c < colorChannels; ++c)
+                        ++histogram[c * bins + (pixel[channelIndex[c]] >> binShift)];
+                }
+            }
+        }
+
+        const qint64 count = qint64(x1 - x0) * (y1 - y0);
+        const quint32 limit = quint32(std::max<qint64>(1, std::llround(double(clipLimit) * count / bins)));
+        for (int c = 0; c < colorChannels; ++c) {
+            quint32 *channelHistogram = histogram.data() + c * bins;
+            clipHistogram(channelHistogram, bins, limit);
+            ImageOps::equalizationLut(channelHistogram, bins, count,
+                                      luts.data() + (std::size_t(tile) * colorChannels + c) * bins);
+        }
+    });
+
+    const std::vector<TileWeight> columns = tileWeights(width, tilesX);
+    const std::vector<TileWeight> rows = tileWeights(height, tilesY);
+    auto lut = [&](int tileX, int tileY, int c) {
+        return luts.data() + (std::size_t(tileY * tilesX + tileX) * colorChannels + c) * bins;
+    };
+    auto level = [binScale](const quint16 *tileLut, int value) -> float {
+        if constexpr (binShift == 0) {
+            return tileLut[value];
+        } else {
+            const int bin = value >> binShift;
+            const float lower = bin > 0 ? tileLut[bin - 1] : 0.0f;
+            const float fraction = float((value & ((1 << binShift) - 1)) + 1) / (1 << binShift);
+            return (lower + (tileLut[bin] - lower) * fraction) * binScale;
+        }
+    };
+
+    const RowPointers<T> pixelRows(image);
+    const int bandHeight = 32;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    blockingMapVariant(bands, [&](int band) {
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            const TileWeight &row = rows[y];
+            T *pixels = pixelRows[y];
+            for (int x = 0; x < width; ++x) {
+                const TileWeight &column = columns[x];
+                T *pixel = pixels + x * L::Channels;
+                for (int c = 0; c < colorChannels; ++c) {
+                    const int value = luma ? lumaValue<L>(pixel) : pixel[channelIndex[c]];
+                    const float top = level(lut(column.first, row.first, c), value) * (1.0f - column.weight)
+                                      + level(lut(column.second, row.first, c), value) * column.weight;
+                    const float bottom = level(lut(column.first, row.second, c), value) * (1.0f - column.weight)
+                                         + level(lut(column.second, row.second, c), value) * column.weight;
+                    const float mapped = top + (bottom - top) * row.weight;
+
+                    if (!luma) {
+                        pixel[channelIndex[c]] = clampChannel<L>(mapped + 0.5f);
+                    } else if (value == 0) {
+                        for (int k = 0; k < 3; ++k)
+                            pixel[channelIndex[k]] = clampChannel<L>(mapped + 0.5f);
+                    } else {
+                        // Scaling all channels by the luma gain keeps the hue
+                        const float gain = mapped / value;
+                        for (int k = 0; k < 3; ++k)
+                            pixel[channelIndex[k]] = clampChannel<L>(pixel[channelIndex[k]] * gain + 0.5f);
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Colors are binned on a 32 x 32 x 32 grid of the top five bits of each channel,
+// gray values on the top 15 bits of their only channel. The same grid then maps
+// every cell to its nearest palette entry, so assigning a pixel is one lookup
+// whatever the palette size.
+constexpr int GridBits = 5;
+constexpr int GridCells = 1 << (3 * GridBits);
+
+using PaletteColor = std::array<float, 3>;
+
+struct ColorCell
+{
+    quint32 count = 0;
+    PaletteColor mean = {};
+};
+
+template <typename L>
+inline int gridIndex(const typename L::Channel *pixel)
+{
+    constexpr int bits = int(sizeof(typename L::Channel)) * 8;
+    if (L::Channels == 1)
+        return pixel[0] >> std::max(0, bits - 3 * GridBits);
+    constexpr int shift = bits - GridBits;
+    return (pixel[L::Red] >> shift) << (2 * GridBits) | (pixel[L::Green] >> shift) << GridBits | (pixel[L::Blue] >> shift);
+}
+
+template <typename L>
+std::vector<ColorCell> colorCells(const QImage &image)
+{
+    using T = typename L::Channel;
+    const int width = image.width();
+    const int height = image.height();
+    std::vector<quint32> counts(GridCells, 0);
+    std::vector<quint64> sums(std::size_t(GridCells) * 3, 0);
+    QMutex mutex;
+
+    const int bandHeight = 256;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    blockingMapVariant(bands, [&](int band) {
+        std::vector<quint32> bandCounts(GridCells, 0);
+        std::vector<quint64> bandSums(std::size_t(GridCells) * 3, 0);
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            const T *pixels = line<L>(image, y);
+            for (int x = 0; x < width; ++x) {
+                const T *pixel = pixels + x * L::Channels;
+                const int cell = gridIndex<L>(pixel);
+                ++bandCounts[cell];
+                bandSums[cell * 3] += pixel[L::Red];
+                bandSums[cell * 3 + 1] += pixel[L::Green];
+                bandSums[cell * 3 + 2] += pixel[L::Blue];
+            }
+        }
+
+        QMutexLocker locker(&mutex);
+        for (int cell = 0; cell < GridCells; ++cell) {
+            if (!bandCounts[cell])
+                continue;
+            counts[cell] += bandCounts[cell];
+            for (int c = 0; c < 3; ++c)
+                sums[cell * 3 + c] += bandSums[cell * 3 + c];
+        }
+    });
+
+    std::vector<ColorCell> cells(GridCells);
+    for (int cell = 0; cell < GridCells; ++cell) {
+        cells[cell].count = counts[cell];
+        for (int c = 0; c < 3 && counts[cell]; ++c)
+            cells[cell].mean[c] = float(double(sums[cell * 3 + c]) / counts[cell]);
+    }
+    return cells;
+}
+
+struct ColorBox
+{
+    int begin;
+    int end;
+    int axis;
+    double error;
+    PaletteColor mean;
+};
+
+ColorBox colorBox(const std::vector<ColorCell> &cells, const std::vector<int> &order, int begin, int end)
+{
+    double count = 0;
+    double sum[3] = {};
+    double squares[3] = {};
+    for (int i = begin; i < end; ++i) {
+        const ColorCell &cell = cells[order[i]];
+        count += cell.count;
+        for (int c = 0; c < 3; ++c) {
+            sum[c] += double(cell.count) * cell.mean[c];
+            squares[c] += double(cell.count) * cell.mean[c] * cell.mean[c];
+        }
+    }
+
+    ColorBox box{begin, end, 0, 0.0, {}};
+    double widest = -1.0;
+    for (int c = 0; c < 3; ++c) {
+        box.mean[c] = float(sum[c] / count);
+        const double error = squares[c] - sum[c] * sum[c] / count;
+        box.error += error;
+        if (error > widest) {
+            widest = error;
+            box.axis = c;
+        }
+    }
+    return box;
+}
+
+// Heckbert's median cut over the occupied grid cells, always splitting the box
+// with the largest squared error at the weighted median of its widest channel
+std::vector<PaletteColor> medianCut(const std::vector<ColorCell> &cells, const std::vector<int> &occupied, int colors)
+{
+    std::vector<int> order = occupied;
+    std::vector<ColorBox> boxes = {colorBox(cells, order, 0, int(order.size()))};
+    while (int(boxes.size()) < colors) {
+        auto box = std::max_element(boxes.begin(), boxes.end(), [](const ColorBox &a, const ColorBox &b) {
+            return (a.end - a.begin > 1 ? a.error : -1.0) < (b.end - b.begin > 1 ? b.error : -1.0);
+        });
+        if (box->end - box->begin < 2 || box->error <= 0.0)
+            break;
+
+        const int axis = box->axis;
+        std::sort(order.begin() + box->begin, order.begin() + box->end,
+                  [&](int a, int b) { return cells[a].mean[axis] < cells[b].mean[axis]; });
+        quint64 total = 0;
+        for (int i = box->begin; i < box->end; ++i)
+            total += cells[order[i]].count;
+        int split = box->begin;
+        for (quint64 below = 0; split < box->end - 1 && 2 * (below + cells[order[split]].count) <= total; ++split)
+            below += cells[order[split]].count;
+        split = std::max(split, box->begin + 1);
+
+        const int begin = box->begin;
+        const int end = box->end;
+        *box = colorBox(cells, order, begin, split);
+        boxes.push_back(colorBox(cells, order, split, end));
+    }
+
+    std::vector<PaletteColor> palette;
+    for (const ColorBox &box : boxes)
+        palette.push_back(box.mean);
+    return palette;
+}
+
+// Points every occupied cell at the palette entry nearest to its mean color
+void assignCells(const std::vector<ColorCell> &cells, const std::vector<int> &occupied,
+                 const std::vector<PaletteColor> &palette, std::vector<quint8> &grid)
+{
+    const int chunk = 1024;
+    std::vector<int> chunks((int(occupied.size()) + chunk - 1) / chunk);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    blockingMapVariant(chunks, [&](int index) {
+        const int end = std::min(int(occupied.size()), (index + 1) * chunk);
+        for (int i = index * chunk; i < end; ++i) {
+            const PaletteColor &color = cells[occupied[i]].mean;
+            float best = std::numeric_limits<float>::max();
+            for (int entry = 0; entry < int(palette.size()); ++entry) {
+                const float dr = color[0] - palette[entry][0];
+                const float dg = color[1] - palette[entry][1];
+                const float db = color[2] - palette[entry][2];
+                const float distance = dr * dr + dg * dg + db * db;
+                if (distance < best) {
+                    best = distance;
+                    grid[occupied[i]] = quint8(entry);
+                }
+            }
+        }
+    });
+}
+
+// Lloyd iterations on a strided sample of at most 2^18 pixels, starting from the
+// median cut palette. Each chunk of the sample accumulates its own cluster sums.
+template <typename L>
+void kMeans(const QImage &image, const std::vector<ColorCell> &cells, const std::vector<int> &occupied,
+            std::vector<PaletteColor> &palette, std::vector<quint8> &grid)
+{
+    struct Sample
+    {
+        int cell;
+        PaletteColor color;
+    };
+
+    const qint64 pixelCount = qint64(image.width()) * image.height();
+    const qint64 step = std::max<qint64>(1, pixelCount >> 18);
+    std::vector<Sample> samples;
+    samples.reserve(std::size_t(pixelCount / step + 1));
+    for (qint64 index = 0; index < pixelCount; index += step) {
+        const typename L::Channel *pixel = line<L>(image, int(index / image.width())) + index % image.width() * L::Channels;
+        samples.push_back({gridIndex<L>(pixel), {float(pixel[L::Red]), float(pixel[L::Green]), float(pixel[L::Blue])}});
+    }
+
+    const int entries = int(palette.size());
+    const int chunk = 16384;
+    std::vector<int> chunks((int(samples.size()) + chunk - 1) / chunk);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    for (int iteration = 0; iteration < 10; ++iteration) {
+        assignCells(cells, occupied, palette, grid);
+
+        std::vector<double> sums(std::size_t(entries) * 4, 0.0);
+        QMutex mutex;
+        blockingMapVariant(chunks, [&](int index) {
+            std::vector<double> chunkSums(std::size_t(entries) * 4, 0.0);
+            const int end = std::min(int(samples.size()), (index + 1) * chunk);
+            for (int i = index * chunk; i < end; ++i) {
+                double *sum = chunkSums.data() + grid[samples[i].cell] * 4;
+                for (int c = 0; c < 3; ++c)
+                    sum[c] += samples[i].color[c];
+                sum[3] += 1.0;
+            }
+            QMutexLocker locker(&mutex);
+            for (std::size_t i = 0; i < sums.size(); ++i)
+                sums[i] += chunkSums[i];
+        });
+
+        // Empty clusters keep their color; stop once no entry moves by half a level
+        float moved = 0.0f;
+        for (int entry = 0; entry < entries; ++entry) {
+            const double *sum = sums.data() + entry * 4;
+            if (sum[3] == 0.0)
+                continue;
+            for (int c = 0; c < 3; ++c) {
+                const float value = float(sum[c] / sum[3]);
+                moved = std::max(moved, std::abs(value - palette[entry][c]));
+                palette[entry][c] = value;
+            }
+        }
+        if (moved < 0.5f * L::Scale)
+            break;
+    }
+}
+
+template <typename L>
+int quantizeColorRows(QImage &image, int colors, ImageOps::ColorQuantizer method)
+{
+    using T = typename L::Channel;
+    const std::vector<ColorCell> cells = colorCells<L>(image);
+    std::vector<int> occupied;
+    for (int cell = 0; cell < GridCells; ++cell) {
+        if (cells[cell].count)
+            occupied.push_back(cell);
+    }
+    if (occupied.empty())
+        return 0;
+
+    std::vector<PaletteColor> palette = medianCut(cells, occupied, std::clamp(colors, 1, 256));
+    std::vector<quint8> grid(GridCells, 0);
+    if (method == ImageOps::ColorQuantizer::KMeans)
+        kMeans<L>(image, cells, occupied, palette, grid);
+    assignCells(cells, occupied, palette, grid);
+
+    std::vector<std::array<T, 3>> entries(palette.size());
+    for (std::size_t entry = 0; entry < palette.size(); ++entry) {
+        for (int c = 0; c < 3; ++c)
+            entries[entry][c] = clampChannel<L>(palette[entry][c] + 0.5f);
+    }
+
+    const int width = image.width();
+    const int height = image.height();
+    const int bandHeight = 32;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    const RowPointers<T> pixelRows(image);
+    blockingMapVariant(bands, [&](int band) {
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            T *pixels = pixelRows[y];
+            for (int x = 0; x < width; ++x) {
+                T *pixel = pixels + x * L::Channels;
+                const std::array<T, 3> &entry = entries[grid[gridIndex<L>(pixel)]];
+                pixel[L::Red] = entry[0];
+                pixel[L::Green] = entry[1];
+                pixel[L::Blue] = entry[2];
+            }
+        }
+    });
+    return int(palette.size());
+}
+
+inline int clampIndex(int value, int size)
+{
+    return value < 0 ? 0 : (value >= size ? size - 1 : value);
+}
+
+// Rank filter for 8-bit channels after Perreault and Hebert. Every column keeps
+// a histogram of its 2r + 1 pixels that slides down one row at a time, and the
+// kernel histogram is the sum of 2r + 1 columns that slides across. Histograms
+// have 16 coarse and 256 fine bins; the fine kernel bins of a coarse bin are
+// only brought up to date when the search lands in it, so each pixel costs a
+// constant number of operations whatever the radius.
+template <typename L>
+void rankBand8(const QImage &source, const RowPointers<quint8> &target, int radius, int rank, int y0, int y1)
+{
+    const int width = source.width();
+    const int height = source.height();
+    const int diameter = 2 * radius + 1;
+    const int colorChannels = L::Channels == 1 ? 1 : 3;
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+
+    std::vector<quint16> columnCoarse(std::size_t(width) * 16);
+    std::vector<quint16> columnFine(std::size_t(width) * 256);
+
+    for (int c = 0; c < colorChannels; ++c) {
+        const int channel = channelIndex[c];
+        auto add = [&](int x, int y, int sign) {
+            const quint8 value = line<L>(source, clampIndex(y, height))[x * L::Channels + channel];
+            columnCoarse[x * 16 + (value >> 4)] += sign;
+            columnFine[x * 256 + value] += sign;
+        };
+
+        std::fill(columnCoarse.begin(), columnCoarse.end(), 0);
+        std::fill(columnFine.begin(), columnFine.end(), 0);
+        for (int x = 0; x < width; ++x) {
+            for (int dy = -radius; dy <= radius; ++dy)
+                add(x, y0 + dy, 1);
+        }
+
+        for (int y = y0; y < y1; ++y) {
+            if (y > y0) {
+                for (int x = 0; x < width; ++x) {
+                    add(x, y - radius - 1, -1);
+                    add(x, y + radius, 1);
+                }
+            }
+
+            quint16 kernelCoarse[16] = {};
+            quint16 kernelFine[256] = {};
+            int fineX[16];
+            std::fill(fineX, fineX + 16, -2 * diameter);
+            for (int dx = -radius; dx <= radius; ++dx) {
+                const quint16 *column = columnCoarse.data() + clampIndex(dx, width) * 16;
+                for (int b = 0; b < 16; ++b)
+                    kernelCoarse[b] += column[b];
+            }
+
+            quint8 *out = target[y];
+            for (int x = 0; x < width; ++x) {
+                int count = 0;
+                int bucket = 0;
+                while (count + kernelCoarse[bucket] <= rank)
+                    count += kernelCoarse[bucket++];
+
+                // Catch the fine bins of this bucket up with the kernel position
+                quint16 *fine = kernelFine + bucket * 16;
+                if (x - fineX[bucket] >= diameter) {
+                    std::fill(fine, fine + 16, 0);
+                    for (int dx = -radius; dx <= radius; ++dx) {
+                        const quint16 *column = columnFine.data() + clampIndex(x + dx, width) * 256 + bucket * 16;
+                        for (int i = 0; i < 16; ++i)
+                            fine[i] += column[i];
+                    }
+                } else {
+                    for (int position = fineX[bucket] + 1; position <= x; ++position) {
+                        const quint16 *added = columnFine.data() + clampIndex(position + radius, width) * 256 + bucket * 16;
+                        const quint16 *removed = columnFine.data() + clampIndex(position - radius - 1, width) * 256 + bucket * 16;
+                        for (int i = 0; i < 16; ++i)
+                            fine[i] += added[i] - removed[i];
+                    }
+                }
+                fineX[bucket] = x;
+
+                int value = 0;
+                while (count + fine[value] <= rank)
+                    count += fine[value++];
+                out[x * L::Channels + channel] = quint8(bucket * 16 + value);
+
+                const quint16 *added = columnCoarse.data() + clampIndex(x + radius + 1, width) * 16;
+                const quint16 *removed = columnCoarse.data() + clampIndex(x - radius, width) * 16;
+                for (int b = 0; b < 16; ++b)
+                    kernelCoarse[b] += added[b] - removed[b];
+            }
+        }
+    }
+}
+
+// 16-bit channels have too many levels for per-column histograms, so the kernel
+// histogram is updated column by column as it slides (cost grows with the radius)
+// and searched through 256 coarse bins.
+template <typename L>
+void rankBand16(const QImage &source, const RowPointers<quint16> &target, int radius, int rank, int y0, int y1)
+{
+    const int width = source.width();
+    const int height = source.height();
+    const int colorChannels = L::Channels == 1 ? 1 : 3;
+    const int channelIndex[3] = {L::Red, L::Green, L::Blue};
+
+    std::vector<quint16> coarse(256);
+    std::vector<quint16> fine(65536);
+
+    for (int c = 0; c < colorChannels; ++c) {
+        const int channel = channelIndex[c];
+        auto addColumn = [&](int x, int y, int sign) {
+            x = clampIndex(x, width);
+            for (int dy = -radius; dy <= radius; ++dy) {
+                const quint16 value = line<L>(source, clampIndex(y + dy, height))[x * L::Channels + channel];
+                coarse[value >> 8] += sign;
+                fine[value] += sign;
+            }
+        };
+
+        for (int y = y0; y < y1; ++y) {
+            std::fill(coarse.begin(), coarse.end(), 0);
+            std::fill(fine.begin(), fine.end(), 0);
+            for (int dx = -radius; dx <= radius; ++dx)
+                addColumn(dx, y, 1);
+
+            quint16 *out = target[y];
+            for (int x = 0; x < width; ++x) {
+                int count = 0;
+                int bucket = 0;
+                while (count + coarse[bucket] <= rank)
+                    count += coarse[bucket++];
+                int value = bucket * 256;
+                while (count + fine[value] <= rank)
+                    count += fine[value++];
+                out[x * L::Channels + channel] = quint16(value);
+
+                addColumn(x + radius + 1, y, 1);
+                addColumn(x - radius, y, -1);
+            }
+        }
+    }
+}
+
+template <typename L>
+void rankRows(const QImage &source, QImage &target, int radius, int percentile)
+{
+    const int height = source.height();
+    const int diameter = 2 * radius + 1;
+    const int rank = int(qint64(percentile) * (diameter * diameter - 1) / 100);
+
+    // Bands are tall enough that filling the column histograms stays a small share of the work
+    const int bandCount = std::max(1, std::min(QThread::idealThreadCount() * 2, height / (4 * diameter)));
+    std::vector<int> bands(bandCount);
+    std::iota(bands.begin(), bands.end(), 0);
+    const RowPointers<typename L::Channel> targetRows(target);
+    blockingMapVariant(bands, [&](int band) {
+        const int y0 = int(qint64(band) * height / bandCount);
+        const int y1 = int(qint64(band + 1) * height / bandCount);
+        if constexpr (sizeof(typename L::Channel) == 1)
+            rankBand8<L>(source, targetRows, radius, rank, y0, y1);
+        else
+            rankBand16<L>(source, targetRows, radius, rank, y0, y1);
+
+        if (L::Alpha >= 0) {
+            for (int y = y0; y < y1; ++y) {
+                const typename L::Channel *in = line<L>(source, y);
+                typename L::Channel *out = targetRows[y];
+                for (int x = 0; x < source.width(); ++x)
+                    out[x * L::Channels + L::Alpha] = in[x * L::Channels + L::Alpha];
+            }
+        }
+    });
+}
+
+// Box filter along one interleaved row with running sums per channel; the
+// pixels past either end repeat the border pixel
+template <typename L>
+void boxRow(const typename L::Channel *in, typename L::Channel *out, int width, int radius)
+{
+    using T = typename L::Channel;
+    const int channels = L::Channels;
+    const float scale = 1.0f / (2 * radius + 1);
+    int sum[channels];
+    for (int c = 0; c < channels; ++c) {
+        sum[c] = (radius + 1) * in[c];
+        for (int x = 1; x <= radius; ++x)
+            sum[c] += in[std::min(x, width - 1) * channels + c];
+    }
+
+    // The interior needs no clamping; all channels advance together
+    const int interiorBegin = std::min(radius, width);
+    const int interiorEnd = std::max(interiorBegin, width - radius - 1);
+    auto step = [&](int x, const T *added, const T *removed) {
+        for (int c = 0; c < channels; ++c) {
+            out[x * channels + c] = T(sum[c] * scale + 0.5f);
+            sum[c] += added[c] - removed[c];
+        }
+    };
+    for (int x = 0; x < interiorBegin; ++x)
+        step(x, in + std::min(x + radius + 1, width - 1) * channels, in);
+    for (int x = interiorBegin; x < interiorEnd; ++x)
+        step(x, in + (x + radius + 1) * channels, in + (x - radius) * channels);
+    for (int x = interiorEnd; x < width; ++x)
+        step(x, in + (width - 1) * channels, in + std::max(x - radius, 0) * channels);
+}
+
+// Box filter down a strip of columns. The sums for a whole row are updated
+// together, so the inner loops run over contiguous memory and vectorise.
+template <typename T, typename InRow, typename OutRow>
+void boxColumns(InRow inRow, OutRow outRow, int count, int height, int radius, std::vector<int> &sums)
+{
+    const float scale = 1.0f / (2 * radius + 1);
+    const T *first = inRow(0);
+    for (int i = 0; i < count; ++i)
+        sums[i] = (radius + 1) * first[i];
+    for (int y = 1; y <= radius; ++y) {
+        const T *row = inRow(std::min(y, height - 1));
+        for (int i = 0; i < count; ++i)
+            sums[i] += row[i];
+    }
+
+    for (int y = 0; y < height; ++y) {
+        T *out = outRow(y);
+        for (int i = 0; i < count; ++i)
+            out[i] = T(sums[i] * scale + 0.5f);
+        const T *added = inRow(std::min(y + radius + 1, height - 1));
+        const T *removed = inRow(std::max(y - radius, 0));
+        for (int i = 0; i < count; ++i)
+            sums[i] += added[i] - removed[i];
+    }
+}
+
+// Applies successive box filters of the given radii, rows first and then columns.
+// Rows are split between threads in bands and columns in strips.
+template <typename L>
+void blurRows(const QImage &source, QImage &target, const std::vector<int> &radii)
+{
+    using T = typename L::Channel;
+    const int width = source.width();
+    const int height = source.height();
+    const int elements = width * L::Channels;
+    const RowPointers<T> targetRows(target);
+
+    const int bandHeight = 16;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    blockingMapVariant(bands, [&](int band) {
+        std::vector<T> current(elements);
+        std::vector<T> next(elements);
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            std::memcpy(current.data(), line<L>(source, y), elements * sizeof(T));
+            for (int radius : radii) {
+                boxRow<L>(current.data(), next.data(), width, radius);
+                current.swap(next);
+            }
+            std::memcpy(targetRows[y], current.data(), elements * sizeof(T));
+        }
+    });
+
+    const int stripWidth = 512;
+    std::vector<int> strips((elements + stripWidth - 1) / stripWidth);
+    std::iota(strips.begin(), strips.end(), 0);
+    blockingMapVariant(strips, [&](int strip) {
+        const int offset = strip * stripWidth;
+        const int count = std::min(stripWidth, elements - offset);
+        std::vector<int> sums(count);
+        std::vector<T> current(std::size_t(count) * height);
+        std::vector<T> next(std::size_t(count) * height);
+
+        auto targetRow = [&](int y) { return targetRows[y] + offset; };
+        for (int y = 0; y < height; ++y)
+            std::memcpy(current.data() + std::size_t(y) * count, targetRow(y), count * sizeof(T));
+        for (int radius : radii) {
+            boxColumns<T>([&](int y) { return static_cast<const T *>(current.data() + std::size_t(y) * count); },
+                          [&](int y) { return next.data() + std::size_t(y) * count; },
+                          count, height, radius, sums);
+            current.swap(next);
+        }
+        for (int y = 0; y < height; ++y)
+            std::memcpy(targetRow(y), current.data() + std::size_t(y) * count, count * sizeof(T));
+    });
+
+    if (L::Alpha >= 0) {
+        for (int y = 0; y < height; ++y) {
+            const T *in = line<L>(source, y);
+            T *out = line<L>(target, y);
+            for (int x = 0; x < width; ++x)
+                out[x * L::Channels + L::Alpha] = in[x * L::Channels + L::Alpha];
+        }
+    }
+}
+
+template <bool Dilate, typename T>
+inline T extremum(T a, T b)
+{
+    return Dilate ? std::max(a, b) : std::min(a, b);
+}
+
+// Running minimum or maximum over windows of 2 radius + 1 steps by van Herk and
+// Gil-Werman. The line, padded by repeating its ends, is cut into blocks of the
+// window length, with the extremum so far from the start of each block kept in
+// prefix and the one from its end in suffix. Every window spans the end of one block
+// and the start of the next, so window i is the extremum of suffix[i] and
+// prefix[i + 2 radius]: three comparisons per value whatever the radius. The suffixes
+// are made from the end backwards and each window is finished as soon as its suffix
+// is known, so output may be the input; step i is only written once no later step
+// reads it. Each step is count contiguous values, a pixel along a row or a strip of a
+// row down the columns, where the inner loops vectorise.
+template <bool Dilate, typename T, typename InRow, typename OutRow>
+void herkGilWerman(InRow inRow, OutRow outRow, int count, int length, int radius, std::vector<T> &prefix,
+                   std::vector<T> &suffix)
+{
+    const int window = 2 * radius + 1;
+    const int padded = length + 2 * radius;
+    prefix.resize(std::size_t(padded) * count);
+    suffix.resize(count);
+    auto input = [&](int p) { return inRow(clampIndex(p - radius, length)); };
+    auto prefixAt = [&](int p) { return prefix.data() + std::size_t(p) * count; };
+
+    for (int start = 0; start < padded; start += window) {
+        std::memcpy(prefixAt(start), input(start), count * sizeof(T));
+        for (int p = start + 1; p < std::min(start + window, padded); ++p) {
+            const T *in = input(p);
+            const T *previous = prefixAt(p - 1);
+            T *out = prefixAt(p);
+            for (int i = 0; i < count; ++i)
+                out[i] = extremum<Dilate>(previous[i], in[i]);
+        }
+    }
+
+    T *extreme = suffix.data();
+    for (int start = (padded - 1) / window * window; start >= 0; start -= window) {
+        const int end = std::min(start + window, padded);
+        for (int p = end - 1; p >= start; --p) {
+            const T *in = input(p);
+            if (p == end - 1) {
+                std::memcpy(extreme, in, count * sizeof(T));
+            } else {
+                for (int i = 0; i < count; ++i)
+                    extreme[i] = extremum<Dilate>(extreme[i], in[i]);
+            }
+            if (p < length) {
+                const T *right = prefixAt(p + 2 * radius);
+                T *out = outRow(p);
+                for (int i = 0; i < count; ++i)
+                    out[i] = extremum<Dilate>(extreme[i], right[i]);
+            }
+        }
+    }
+}
+
+// Erosion or dilation by a rectangle as a line along the rows and then one down the
+// columns. Rows are split between threads in bands and columns in strips.
+template <typename L, bool Dilate>
+void morphologyPass(const QImage &source, QImage &target, int radiusX, int radiusY)
+{
+    using T = typename L::Channel;
+    const int width = source.width();
+    const int height = source.height();
+    const int elements = width * L::Channels;
+
+    const int bandHeight = 16;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    const RowPointers<T> targetRows(target);
+    blockingMapVariant(bands, [&](int band) {
+        std::vector<T> prefix;
+        std::vector<T> suffix;
+        const int yEnd = std::min(height, (band + 1) * bandHeight);
+        for (int y = band * bandHeight; y < yEnd; ++y) {
+            const T *in = line<L>(source, y);
+            T *out = targetRows[y];
+            if (radiusX == 0) {
+                std::memcpy(out, in, elements * sizeof(T));
+                continue;
+            }
+            herkGilWerman<Dilate, T>([in](int x) { return in + x * L::Channels; }, [out](int x) { return out + x * L::Channels; },
+                                     L::Channels, width, radiusX, prefix, suffix);
+        }
+    });
+    if (radiusY == 0)
+        return;
+
+    const int stripWidth = 512;
+    std::vector<int> strips((elements + stripWidth - 1) / stripWidth);
+    std::iota(strips.begin(), strips.end(), 0);
+    blockingMapVariant(strips, [&](int strip) {
+        const int offset = strip * stripWidth;
+        const int count = std::min(stripWidth, elements - offset);
+        std::vector<T> prefix;
+        std::vector<T> suffix;
+        auto targetRow = [&](int y) { return targetRows[y] + offset; };
+        herkGilWerman<Dilate, T>([&](int y) { return static_cast<const T *>(targetRow(y)); }, targetRow, count, height, radiusY,
+                                 prefix, suffix);
+    });
+}
+
+template <typename L>
+void morphologyRows(const QImage &source, QImage &target, ImageOps::MorphologyOperation operation, int radiusX, int radiusY)
+{
+    using T = typename L::Channel;
+    using Operation = ImageOps::MorphologyOperation;
+    switch (operation) {
+    case Operation::Erode:
+        morphologyPass<L, false>(source, target, radiusX, radiusY);
+        break;
+    case Operation::Dilate:
+        morphologyPass<L, true>(source, target, radiusX, radiusY);
+        break;
+    case Operation::Open:
+    case Operation::TopHat: {
+        QImage eroded = ImageBufferPool::instance().acquire(source.width(), source.height(), source.format());
+        morphologyPass<L, false>(source, eroded, radiusX, radiusY);
+        morphologyPass<L, true>(eroded, target, radiusX, radiusY);
+        break;
+    }
+    case Operation::Close:
+    case Operation::BlackHat: {
+        QImage dilated = ImageBufferPool::instance().acquire(source.width(), source.height(), source.format());
+        morphologyPass<L, true>(source, dilated, radiusX, radiusY);
+        morphologyPass<L, false>(dilated, target, radiusX, radiusY);
+        break;
+    }
+    }
+
+    // An opening never exceeds the source and a closing never falls below it
+    const bool topHat = operation == Operation::TopHat;
+    const bool hat = topHat || operation == Operation::BlackHat;
+    if (!hat && L::Alpha < 0)
+        return;
+    const int elements = source.width() * L::Channels;
+    for (int y = 0; y < source.height(); ++y) {
+        const T *in = line<L>(source, y);
+        T *out = line<L>(target, y);
+        if (hat) {
+            for (int i = 0; i < elements; ++i)
+                out[i] = T(topHat ? in[i] - out[i] : out[i] - in[i]);
+        }
+        if (L::Alpha >= 0) {
+            for (int x = 0; x < source.width(); ++x)
+                out[x * L::Channels + L::Alpha] = in[x * L::Channels + L::Alpha];
+        }
+    }
+}
+
+// Radii of passes box filters whose succession approximates a Gaussian of the given sigma
+std::vector<int> gaussianBoxRadii(float sigma, int passes)
+{
+    const double variance = 12.0 * sigma * sigma;
+    int lower = int(std::floor(std::sqrt(variance / passes + 1.0)));
+    if (lower % 2 == 0)
+        --lower;
+    const int upper = lower + 2;
+    const int lowerPasses = int(std::lround((variance - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes)
+                                            / (-4.0 * lower - 4.0)));
+
+    std::vector<int> radii(passes);
+    for (int i = 0; i < passes; ++i)
+        radii[i] = ((i < lowerPasses ? lower : upper) - 1) / 2;
+    return radii;
+}
+
+// Luma of one row into out[1..width], with the border pixel repeated at out[0] and out[width + 1]
+template <typename L>
+void lumaRow(const QImage &image, int y, int *out)
+{
+    const int width = image.width();
+    const typename L::Channel *pixels = line<L>(image, clampIndex(y, image.height()));
+    for (int x = 0; x < width; ++x)
+        out[x + 1] = L::Channels == 1 ? int(pixels[x]) : lumaValue<L>(pixels + x * L::Channels);
+    out[0] = out[1];
+    out[width + 1] = out[width];
+}
+
+// Both derivatives of a 3x3 Sobel or Prewitt pair in one pass over the luma, with
+// the magnitude and the orientation bin written from the same registers
+template <typename L>
+void gradientRows(const QImage &source, QImage &magnitude, QImage *orientation, int centreWeight, bool euclidean)
+{
+    using T = typename L::Channel;
+    const int width = source.width();
+    const int height = source.height();
+    const RowPointers<T> magnitudeRows(magnitude);
+    RowPointers<quint8> orientationRows;
+    if (orientation)
+        orientationRows = RowPointers<quint8>(*orientation);
+
+    const int bandHeight = 32;
+    std::vector<int> bands((height + bandHeight - 1) / bandHeight);
+    std::iota(bands.begin(), bands.end(), 0);
+    blockingMapVariant(bands, [&](int band) {
+        std::vector<int> rows(3 * std::size_t(width + 2));
+        int *above = rows.data();
+        int *centre = above + width + 2;
+        int *below = centre + width + 2;
+        std::vector<int> gx(width);
+        std::vector<int> gy(width);
+
+        const int y0 = band * bandHeight;
+        const int y1 = std::min(height, y0 + bandHeight);
+        lumaRow<L>(source, y0 - 1, above);
+        lumaRow<L>(source, y0, centre);
+        for (int y = y0; y < y1; ++y) {
+            lumaRow<L>(source, y + 1, below);
+
+            // Integer and branch free so the compiler vectorises it
+            for (int x = 0; x < width; ++x) {
+                gx[x] = (above[x + 2] - above[x]) + centreWeight * (centre[x + 2] - centre[x]) + (below[x + 2] - below[x]);
+                gy[x] = (below[x] + centreWeight * below[x + 1] + below[x + 2]) - (above[x] + centreWeight * above[x + 1] + above[x + 2]);
+            }
+
+            T *out = magnitudeRows[y];
+            if (euclidean) {
+                for (int x = 0; x < width; ++x)
+                    out[x] = clampChannel<L>(std::sqrt(float(gx[x]) * gx[x] + float(gy[x]) * gy[x]));
+            } else {
+                for (int x = 0; x < width; ++x)
+                    out[x] = clampChannel<L>(std::abs(gx[x]) + std::abs(gy[x]));
+            }
+
+            // Bin k is the direction k * 45 degrees counter-clockwise from +x, with y pointing up;
+            // 0.4142 is tan(22.5 degrees)
+            if (orientation) {
+                quint8 *bins = orientationRows[y];
+                for (int x = 0; x < width; ++x) {
+                    const int dx = gx[x];
+                    const int dy = -gy[x];
+                    const qint64 ax = std::abs(dx);
+                    const qint64 ay = std::abs(dy);
+                    int bin;
+                    if (ay * 10000 <= ax * 4142)
+                        bin = dx >= 0 ? 0 : 4;
+                    else if (ax * 10000 <= ay * 4142)
+                        bin = dy >= 0 ? 2 : 6;
+                    else
+                        bin = dx >= 0 ? (dy >= 0 ? 1 : 7) : (dy >= 0 ? 3 : 5);
+                    bins[x] = quint8(bin);
+                }
+            }
+
+            std::swap(above, centre);
+            std::swap(centre, below);
+        }
+    });
+}
+
+template <typename L>
+void convolveRows(const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset)
+{
+    using T = typename L::Channel;
+    const int width = source.width();
+    const int height = source.height();
+    const int kernelRadius = int(kernel.size()) / 2;
+    const int channels = L::Channels;
+
+    struct Tap
+    {
+        int dx;
+        int dy;
+        float weight;
+    };
+    // kernel[k][l] weighs the pixel at (x + k, y + l)
+    std::vector<Tap> taps;
+    for (int k = -kernelRadius; k <= kernelRadius; k++) {
+        for (int l = -kernelRadius; l <= kernelRadius; l++) {
+            const float weight = kernel[k + kernelRadius][l + kernelRadius];
+            if (weight != 0.0f)
+                taps.push_back({k, l, weight});
+        }
+    }
+
+    const int begin = kernelRadius * channels;
+    const int end = (width - kernelRadius) * channels;
+    std::vector<float> sums(std::max(0, end));
+
+    for (int y = 0; y < height; ++y) {
+        const T *in = line<L>(source, y);
+        T *out = reinterpret_cast<T *>(target.scanLine(y));
+
+        // The border the kernel does not reach keeps its original pixels
+        if (y < kernelRadius || y >= height - kernelRadius || begin >= end) {
+            std::memcpy(out, in, width * channels * sizeof(T));
+            continue;
+        }
+        std::memcpy(out, in, begin * sizeof(T));
+        std::memcpy(out + end, in + end, (width * channels - end) * sizeof(T));
+
+        // One multiply-add pass over the row per tap keeps the inner loop contiguous
+        std::fill(sums.begin() + begin, sums.begin() + end, offset);
+        for (const Tap &tap : taps) {
+            const T *row = line<L>(source, y + tap.dy) + tap.dx * channels;
+            const float weight = tap.weight;
+            float *sum = sums.data();
+            for (int i = begin; i < end; ++i)
+                sum[i] += weight * row[i];
+        }
+
+        for (int i = begin; i < end; ++i)
+            out[i] = clampChannel<L>(sums[i]);
+        if (L::Alpha >= 0) {
+            for (int i = begin + L::Alpha; i < end; i += channels)
+                out[i] = in[i];
+        }
+    }
+}
+
+// Same as convolveRows for an N x N kernel known at compile time. Each source row
+// is converted to float once into a ring of N rows, and the N * N taps of a block
+// of outputs are summed in registers, so every output is written once instead of
+// round-tripping through a row of running sums per tap.
+template <typename L, int N>
+void convolveFixedRows(const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset)
+{
+    using T = typename L::Channel;
+    constexpr int radius = N / 2;
+    constexpr int channels = L::Channels;
+    // Sixteen floats fill one AVX-512 register or two AVX2 ones
+    constexpr int block = 16;
+    const int width = source.width();
+    const int height = source.height();
+
+    float weights[N][N];
+    for (int k = 0; k < N; ++k) {
+        for (int l = 0; l < N; ++l)
+            weights[l][k] = kernel[k][l];
+    }
+
+    const int begin = radius * channels;
+    const int end = (width - radius) * channels;
+    const int elements = width * channels;
+    std::vector<float> ring(N * std::size_t(elements));
+    int converted = 0;
+    for (int y = 0; y < height; ++y) {
+        const T *in = line<L>(source, y);
+        T *out = reinterpret_cast<T *>(target.scanLine(y));
+
+        // The border the kernel does not reach keeps its original pixels
+        if (y < radius || y >= height - radius || begin >= end) {
+            std::memcpy(out, in, width * channels * sizeof(T));
+            continue;
+        }
+        std::memcpy(out, in, begin * sizeof(T));
+        std::memcpy(out + end, in + end, (width * channels - end) * sizeof(T));
+
+        // After the first row only row y + radius is missing from the ring
+        for (converted = std::max(converted, y - radius); converted <= y + radius; ++converted) {
+            const T *row = line<L>(source, converted);
+            float *slot = ring.data() + std::size_t(converted % N) * elements;
+            for (int i = 0; i < elements; ++i)
+                slot[i] = row[i];
+        }
+        const float *rows[N];
+        for (int l = 0; l < N; ++l)
+            rows[l] = ring.data() + std::size_t((y + l - radius) % N) * elements;
+
+        int i = begin;
+        for (; i + block <= end; i += block) {
+            float values[block];
+            for (int j = 0; j < block; ++j)
+                values[j] = offset;
+            for (int l = 0; l < N; ++l) {
+                for (int k = 0; k < N; ++k) {
+                    const float weight = weights[l][k];
+                    const float *tap = rows[l] + i + (k - radius) * channels;
+                    for (int j = 0; j < block; ++j)
+                        values[j] += weight * tap[j];
+                }
+            }
+            for (int j = 0; j < block; ++j)
+                out[i + j] = clampChannel<L>(values[j]);
+        }
+        for (; i < end; ++i) {
+            float value = offset;
+            for (int l = 0; l < N; ++l) {
+                for (int k = 0; k < N; ++k)
+                    value += weights[l][k] * rows[l][i + (k - radius) * channels];
+            }
+            out[i] = clampChannel<L>(value);
+        }
+
+        if (L::Alpha >= 0) {
+            for (int i = begin + L::Alpha; i < end; i += channels)
+                out[i] = in[i];
+        }
+    }
+}
+
+template <typename L>
+void zoomInRows(const QImage &source, QImage &target)
+{
+    using T = typename L::Channel;
+    const int channels = L::Channels;
+    const int width = source.width();
+    const int height = source.height();
+    const int newWidth = width * 2;
+    const int newHeight = height * 2;
+
+    // Even rows hold the source pixels with each horizontal pair averaged between them
+    for (int y = 0; y < height; ++y) {
+        const T *in = line<L>(source, y);
+        T *out = line<L>(target, 2 * y);
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                out[2 * x * channels + c] = in[x * channels + c];
+                out[(2 * x + 1) * channels + c] = x + 1 < width
+                    ? T((in[x * channels + c] + in[(x + 1) * channels + c]) / 2) : T(L::Max);
+            }
+        }
+    }
+
+    // Odd rows average the rows around them; the diagonal pixels average four source pixels
+    for (int y = 1; y < newHeight; y += 2) {
+        T *out = line<L>(target, y);
+        if (y + 1 >= newHeight) {
+            std::fill(out, out + newWidth * channels, T(L::Max));
+            continue;
+        }
+        const T *above = line<L>(static_cast<const QImage &>(target), y - 1);
+        const T *below = line<L>(static_cast<const QImage &>(target), y + 1);
+        for (int x = 0; x < newWidth; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                if (x % 2 == 1 && x + 1 < newWidth) {
+                    out[x * channels + c] = T((above[(x - 1) * channels + c] + above[(x + 1) * channels + c]
+                                               + below[(x - 1) * channels + c] + below[(x + 1) * channels + c]) / 4);
+                } else {
+                    out[x * channels + c] = T((above[x * channels + c] + below[x * channels + c]) / 2);
+                }
+            }
+        }
+    }
+}
+
+template <typename L>
+void zoomOutRows(const QImage &source, QImage &target)
+{
+    using T = typename L::Channel;
+    const int channels = L::Channels;
+    for (int y = 0; y < target.height(); ++y) {
+        const T *top = line<L>(source, 2 * y);
+        const T *bottom = line<L>(source, 2 * y + 1);
+        T *out = line<L>(target, y);
+        for (int x = 0; x < target.width(); ++x) {
+            for (int c = 0; c < channels; ++c) {
+                const int sum = top[2 * x * channels + c] + top[(2 * x + 1) * channels + c]
+                                + bottom[2 * x * channels + c] + bottom[(2 * x + 1) * channels + c];
+                out[x * channels + c] = T(sum / 4);
+            }
+        }
+    }
+}
+
+// Rotates in square tiles so both the reads and the writes stay within a few cache lines
+template <typename Pixel, bool Left>
+void rotatePixels(const QImage &source, QImage &target)
+{
+    const int width = source.width();
+    const int height = source.height();
+    const int tile = 64;
+    for (int ty = 0; ty < height; ty += tile) {
+        for (int tx = 0; tx < width; tx += tile) {
+            const int yEnd = std::min(ty + tile, height);
+            const int xEnd = std::min(tx + tile, width);
+            for (int y = ty; y < yEnd; ++y) {
+                const Pixel *in = reinterpret_cast<const Pixel *>(source.constScanLine(y));
+                for (int x = tx; x < xEnd; ++x) {
+                    if (Left)
+                        reinterpret_cast<Pixel *>(target.scanLine(width - 1 - x))[y] = in[x];
+                    else
+                        reinterpret_cast<Pixel *>(target.scanLine(x))[height - 1 - y] = in[x];
+                }
+            }
+        }
+    }
+}
+
+template <bool Left>
+void rotate(const QImage &source, QImage &target)
+{
+    switch (source.depth()) {
+    case 8:
+        rotatePixels<quint8, Left>(source, target);
+        break;
+    case 16:
+        rotatePixels<quint16, Left>(source, target);
+        break;
+    case 32:
+        rotatePixels<quint32, Left>(source, target);
+        break;
+    case 64:
+        rotatePixels<quint64, Left>(source, target);
+        break;
+    default:
+        Q_ASSERT(!"ImageOps: unsupported depth");
+        break;
+    }
+}
+
+
+// Side of the SSIM window; its local sums come from integral images
+constexpr int SsimRadius = 3;
+
+// Black through red and yellow to white
+QRgb heatColor(int index)
+{
+    const int r = std::min(255, index * 3);
+    const int g = std::clamp(index * 3 - 255, 0, 255);
+    const int b = std::clamp(index * 3 - 510, 0, 255);
+    return qRgb(r, g, b);
+}
+
+// Summed area tables of x, y, x², y² and xy over the luma of two images, for one
+// band of rows. Only the rows a window can span are kept, in a ring, so memory
+// follows the width instead of the band height.
+struct SsimIntegrals
+{
+    static constexpr int Rows = 2 * SsimRadius + 2;
+
+    explicit SsimIntegrals(int width) : stride(width + 1), sums(size_t(Rows) * 5 * stride, 0) {}
+
+    qint64 *row(int k, int quantity) { return sums.data() + (size_t(k % Rows) * 5 + quantity) * stride; }
+
+    int stride;
+    std::vector<qint64> sums;
+};
+
+template <typename L>
+ImageOps::Comparison compareRows(const QImage &a, const QImage &b, QImage *heatmap)
+{
+    using T = typename L::Channel;
+    const int width = a.width();
+    const int height = a.height();
+    const double c1 = std::pow(0.01 * L::Max, 2);
+    const double c2 = std::pow(0.03 * L::Max, 2);
+    const LumaTone<L> luma;
+
+    // Bands are tall enough that the rows re-read around each band stay a small share
+    const int bandCount = std::max(1, std::min(QThread::idealThreadCount() * 2, height / 64));
+    std::vector<int> bands(bandCount);
+    std::iota(bands.begin(), bands.end(), 0);
+    std::vector<qint64> squaredErrors(bandCount, 0);
+    std::vector<double> ssimSums(bandCount, 0.0);
+    RowPointers<QRgb> heatRows;
+    if (heatmap)
+        heatRows = RowPointers<QRgb>(*heatmap);
+
+    blockingMapVariant(bands, [&](int band) {
+        const int y0 = int(qint64(band) * height / bandCount);
+        const int y1 = int(qint64(band + 1) * height / bandCount);
+
+        qint64 squaredError = 0;
+        for (int y = y0; y < y1; ++y) {
+            const T *p = line<L>(a, y);
+            const T *q = line<L>(b, y);
+            QRgb *heat = heatmap ? heatRows[y] : nullptr;
+            for (int x = 0; x < width; ++x) {
+                int largest = 0;
+                for (int c = 0; c < L::Channels; ++c) {
+                    if (c == L::Alpha)
+                        continue;
+                    const int d = int(p[x * L::Channels + c]) - int(q[x * L::Channels + c]);
+                    squaredError += qint64(d) * d;
+                    largest = std::max(largest, std::abs(d));
+                }
+                // The square root spreads small differences over more of the colors
+                if (heat)
+                    heat[x] = heatColor(int(std::sqrt(double(largest) / L::Max) * 255.0 + 0.5));
+            }
+        }
+        squaredErrors[band] = squaredError;
+
+        // Integral rows k cover image rows top .. top + k - 1, with row 0 all zero
+        const int top = std::max(0, y0 - SsimRadius);
+        const int last = std::min(height, y1 + SsimRadius);
+        SsimIntegrals integrals(width);
+        std::vector<int> lumaA(width);
+        std::vector<int> lumaB(width);
+        int built = 0;
+        auto buildRow = [&]() {
+            const int y = top + built;
+            const T *p = line<L>(a, y);
+            const T *q = line<L>(b, y);
+            for (int x = 0; x < width; ++x) {
+                lumaA[x] = luma.index(p + x * L::Channels);
+                lumaB[x] = luma.index(q + x * L::Channels);
+            }
+            ++built;
+            qint64 *previous[5];
+            qint64 *current[5];
+            for (int i = 0; i < 5; ++i) {
+                previous[i] = integrals.row(built - 1, i);
+                current[i] = integrals.row(built, i);
+                current[i][0] = 0;
+            }
+            qint64 running[5] = {0, 0, 0, 0, 0};
+            for (int x = 0; x < width; ++x) {
+                const qint64 u = lumaA[x];
+                const qint64 v = lumaB[x];
+                running[0] += u;
+                running[1] += v;
+                running[2] += u * u;
+                running[3] += v * v;
+                running[4] += u * v;
+                for (int i = 0; i < 5; ++i)
+                    current[i][x + 1] = running[i];
+            }
+            // Adding the row above is independent per column and vectorises
+            for (int i = 0; i < 5; ++i) {
+                for (int x = 1; x <= width; ++x)
+                    current[i][x] += previous[i][x];
+            }
+        };
+
+        // Window bounds per column, clipped at the image edges
+        std::vector<int> lefts(width);
+        std::vector<int> rights(width);
+        std::vector<double> columns(width);
+        for (int x = 0; x < width; ++x) {
+            lefts[x] = std::max(0, x - SsimRadius);
+            rights[x] = std::min(width, x + SsimRadius + 1);
+            columns[x] = rights[x] - lefts[x];
+        }
+
+        // Summed per column so the loop over x has no dependency between lanes
+        std::vector<double> ssimColumns(width, 0.0);
+        std::vector<double> windowSums[5];
+        for (std::vector<double> &sums : windowSums)
+            sums.resize(width);
+        for (int y = y0; y < y1; ++y) {
+            const int windowTop = std::max(0, y - SsimRadius) - top;
+            const int windowBottom = std::min(last, y + SsimRadius + 1) - top;
+            while (built < windowBottom)
+                buildRow();
+
+            const int rows = windowBottom - windowTop;
+            for (int i = 0; i < 5; ++i) {
+                const qint64 *upper = integrals.row(windowTop, i);
+                const qint64 *lower = integrals.row(windowBottom, i);
+                double *sums = windowSums[i].data();
+                for (int x = 0; x < width; ++x)
+                    sums[x] = double(lower[rights[x]] - lower[lefts[x]] - upper[rights[x]] + upper[lefts[x]]);
+            }
+
+            for (int x = 0; x < width; ++x) {
+                const double n = rows * columns[x];
+                const double meanA = windowSums[0][x] / n;
+                const double meanB = windowSums[1][x] / n;
+                const double varianceA = windowSums[2][x] / n - meanA * meanA;
+                const double varianceB = windowSums[3][x] / n - meanB * meanB;
+                const double covariance = windowSums[4][x] / n - meanA * meanB;
+                ssimColumns[x] += ((2.0 * meanA * meanB + c1) * (2.0 * covariance + c2))
+                                  / ((meanA * meanA + meanB * meanB + c1) * (varianceA + varianceB + c2));
+            }
+        }
+        ssimSums[band] = std::accumulate(ssimColumns.begin(), ssimColumns.end(), 0.0);
+    });
+
+    const int colorChannels = L::Channels == 1 ? 1 : 3;
+    const qint64 pixels = qint64(width) * height;
+    ImageOps::Comparison result;
+    result.mse = double(std::accumulate(squaredErrors.begin(), squaredErrors.end(), qint64(0))) / (pixels * colorChannels);
+    result.psnr = result.mse > 0.0 ? 10.0 * std::log10(double(L::Max) * L::Max / result.mse)
+                                   : std::numeric_limits<double>::infinity();
+    result.ssim = std::accumulate(ssimSums.begin(), ssimSums.end(), 0.0) / pixels;
+    return result;
+}
+
+void rotateLeftKernel(const QImage &source, QImage &target)
+{
+    rotate<true>(source, target);
+}
+
+void rotateRightKernel(const QImage &source, QImage &target)
+{
+    rotate<false>(source, target);
+}
+
+void zoomInKernel(const QImage &source, QImage &target)
+{
+    withLayout(source.format(), [&](auto layout) { zoomInRows<decltype(layout)>(source, target); });
+}
+
+void zoomOutKernel(const QImage &source, QImage &target)
+{
+    withLayout(source.format(), [&](auto layout) { zoomOutRows<decltype(layout)>(source, target); });
+}
+
+void toGrayscaleKernel(const QImage &source, QImage &target)
+{
+    withLayout(source.format(), [&](auto layout) { grayRows<decltype(layout)>(source, target); });
+}
+
+void brightnessKernel(QImage &image, int value)
+{
+    withLayout(image.format(), [&](auto layout) {
+        using L = decltype(layout);
+        const int offset = value * L::Scale;
+        mapColorChannels<L>(image, [offset](typename L::Channel channel) {
+            return clampChannel<L>(int(channel) + offset);
+        });
+    });
+}
+
+void contrastKernel(QImage &image, float factor)
+{
+    withLayout(image.format(), [&](auto layout) {
+        using L = decltype(layout);
+        mapColorChannels<L>(image, [factor](typename L::Channel channel) {
+            return clampChannel<L>(channel * factor);
+        });
+    });
+}
+
+void negativeKernel(QImage &image)
+{
+    withLayout(image.format(), [&](auto layout) {
+        using L = decltype(layout);
+        mapColorChannels<L>(image, [](typename L::Channel channel) {
+            return typename L::Channel(L::Max - channel);
+        });
+    });
+}
+
+bool quantizeKernel(QImage &image, int levels)
+{
+    bool changed = false;
+    if (image.format() == QImage::Format_Grayscale8)
+        changed = quantizeRows<Gray8>(image, levels);
+    else if (image.format() == QImage::Format_Grayscale16)
+        changed = quantizeRows<Gray16>(image, levels);
+    return changed;
+}
+
+std::vector<std::vector<quint32>> histogramsKernel(const QImage &image)
+{
+    std::vector<std::vector<quint32>> result;
+    withLayout(image.format(), [&](auto layout) { result = histogramRows<decltype(layout)>(image); });
+    return result;
+}
+
+void convolveKernel(const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset)
+{
+    // Common sizes get an unrolled instantiation; anything else takes the generic path
+    withLayout(source.format(), [&](auto layout) {
+        using L = decltype(layout);
+        switch (kernel.size()) {
+        case 3:
+            convolveFixedRows<L, 3>(source, target, kernel, offset * L::Scale);
+            break;
+        case 5:
+            convolveFixedRows<L, 5>(source, target, kernel, offset * L::Scale);
+            break;
+        case 7:
+            convolveFixedRows<L, 7>(source, target, kernel, offset * L::Scale);
+            break;
+        default:
+            convolveRows<L>(source, target, kernel, offset * L::Scale);
+            break;
+        }
+    });
+}
+
+void equalizeKernel(QImage &image, ImageOps::ColorMode mode)
+{
+    withLayout(image.format(), [&](auto layout) {
+        using L = decltype(layout);
+        if (L::Channels == 1 || mode == ImageOps::ColorMode::PerChannel)
+            equalizeRows<L>(image);
+        else if (mode == ImageOps::ColorMode::Luma)
+            equalizeTone<L>(image, LumaTone<L>());
+        else
+            equalizeTone<L>(image, LightnessTone<L>());
+    });
+}
+
+// The reference is already in the format of the image
+void matchHistogramKernel(QImage &image, const QImage &reference, ImageOps::ColorMode mode)
+{
+    withLayout(image.format(), [&](auto layout) {
+        using L = decltype(layout);
+        if (L::Channels == 1 || mode == ImageOps::ColorMode::PerChannel)
+            matchChannels<L>(image, reference);
+        else if (mode == ImageOps::ColorMode::Luma)
+            matchTone<L>(image, reference, LumaTone<L>());
+        else
+            matchTone<L>(image, reference, LightnessTone<L>());
+    });
+}
+
+// Serial kernels get whole variants of their entry point, which flatten reaches
+#ifdef SIMD_VARIANTS
+#ifdef __i386__
+#define SSE2_KERNEL_VARIANT(Return, name, Params, Args) TARGET_SSE2 Return name##Sse2 Params { return name##Kernel Args; }
+#define SSE2_VARIANT(name) name##Sse2
+#else
+#define SSE2_KERNEL_VARIANT(Return, name, Params, Args)
+#define SSE2_VARIANT(name) name##Kernel
+#endif
+#define KERNEL_VARIANTS(Return, name, Params, Args) \
+    TARGET_AVX512 Return name##Avx512 Params { return name##Kernel Args; } \
+    TARGET_AVX2 Return name##Avx2 Params { return name##Kernel Args; } \
+    SSE2_KERNEL_VARIANT(Return, name, Params, Args)
+#define KERNEL_VARIANT(name) selectVariant(name##Kernel, SSE2_VARIANT(name), name##Avx2, name##Avx512)
+#else
+#define KERNEL_VARIANTS(Return, name, Params, Args)
+#define KERNEL_VARIANT(name) name##Kernel
+#endif
+
+KERNEL_VARIANTS(void, rotateLeft, (const QImage &source, QImage &target), (source, target))
+KERNEL_VARIANTS(void, rotateRight, (const QImage &source, QImage &target), (source, target))
+KERNEL_VARIANTS(void, zoomIn, (const QImage &source, QImage &target), (source, target))
+KERNEL_VARIANTS(void, zoomOut, (const QImage &source, QImage &target), (source, target))
+KERNEL_VARIANTS(void, toGrayscale, (const QImage &source, QImage &target), (source, target))
+KERNEL_VARIANTS(void, brightness, (QImage &image, int value), (image, value))
+KERNEL_VARIANTS(void, contrast, (QImage &image, float factor), (image, factor))
+KERNEL_VARIANTS(void, negative, (QImage &image), (image))
+KERNEL_VARIANTS(bool, quantize, (QImage &image, int levels), (image, levels))
+KERNEL_VARIANTS(std::vector<std::vector<quint32>>, histograms, (const QImage &image), (image))
+KERNEL_VARIANTS(void, equalize, (QImage &image, ImageOps::ColorMode mode), (image, mode))
+KERNEL_VARIANTS(void, matchHistogram, (QImage &image, const QImage &reference, ImageOps::ColorMode mode), (image, reference, mode))
+KERNEL_VARIANTS(void, convolve, (const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset), (source, target, kernel, offset))
+
+}
+
+namespace ImageOps {
+
+QImage::Format workingFormat(const QImage &image, bool highBitDepth)
+{
+    const QImage::Format format = image.format();
+    const bool gray = format == QImage::Format_Grayscale8 || format == QImage::Format_Grayscale16
+                      || (image.depth() <= 8 && format != QImage::Format_Alpha8 && image.isGrayscale());
+    const bool alpha = image.hasAlphaChannel();
+    if (highBitDepth)
+        return gray ? QImage::Format_Grayscale16 : (alpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64);
+    return gray ? QImage::Format_Grayscale8 : (alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+}
+
+QImage toWorkingFormat(QImage image, bool highBitDepth)
+{
+    const QImage::Format format = workingFormat(image, highBitDepth);
+    if (image.isNull() || image.format() == format)
+        return image;
+    return std::move(image).convertToFormat(format);
+}
+
+QImage toDisplayFormat(QImage image)
+{
+    if (!isHighBitDepth(image))
+        return image;
+    return toWorkingFormat(std::move(image), false);
+}
+
+bool isGrayscale(const QImage &image)
+{
+    return image.format() == QImage::Format_Grayscale8 || image.format() == QImage::Format_Grayscale16;
+}
+
+bool isHighBitDepth(const QImage &image)
+{
+    return image.format() == QImage::Format_Grayscale16 || image.depth() > 32;
+}
+
+int maxValue(const QImage &image)
+{
+    return isHighBitDepth(image) ? 65535 : 255;
+}
+
+QImage region(QImage &image, const QRect &rect)
+{
+    const QRect area = rect & image.rect();
+    if (area.isEmpty())
+        return QImage();
+    uchar *pixels = image.scanLine(area.y()) + qsizetype(area.x()) * image.depth() / 8;
+    return QImage(pixels, area.width(), area.height(), image.bytesPerLine(), image.format());
+}
+
+QImage region(const QImage &image, const QRect &rect)
+{
+    const QRect area = rect & image.rect();
+    if (area.isEmpty())
+        return QImage();
+    const uchar *pixels = image.constScanLine(area.y()) + qsizetype(area.x()) * image.depth() / 8;
+    return QImage(pixels, area.width(), area.height(), image.bytesPerLine(), image.format());
+}
+
+void copyRegion(const QImage &source, const QRect &rect, QImage &target, const QPoint &position)
+{
+    QImage pixels = region(source, rect);
+    if (pixels.isNull())
+        return;
+    if (pixels.format() != target.format())
+        pixels = pixels.convertToFormat(target.format());
+
+    const QRect area = QRect(position, pixels.size()) & target.rect();
+    const qsizetype offset = qsizetype(area.x() - position.x()) * target.depth() / 8;
+    const qsizetype rowBytes = qsizetype(area.width()) * target.depth() / 8;
+    for (int y = area.top(); y <= area.bottom(); ++y)
+        std::memcpy(target.scanLine(y) + qsizetype(area.x()) * target.depth() / 8,
+                    pixels.constScanLine(y - position.y()) + offset, rowBytes);
+}
+
+void flipHorizontally(QImage &image)
+{
+    const int width = image.width();
+    const int bytesPerPixel = image.depth() / 8;
+
+    // Swaps pixel pairs from both ends of each row
+    for (int y = 0; y < image.height(); y++) {
+        uchar *pixels = image.scanLine(y);
+        switch (bytesPerPixel) {
+        case 1:
+            std::reverse(pixels, pixels + width);
+            break;
+        case 2:
+            std::reverse(reinterpret_cast<quint16 *>(pixels), reinterpret_cast<quint16 *>(pixels) + width);
+            break;
+        case 4:
+            std::reverse(reinterpret_cast<quint32 *>(pixels), reinterpret_cast<quint32 *>(pixels) + width);
+            break;
+        case 8:
+            std::reverse(reinterpret_cast<quint64 *>(pixels), reinterpret_cast<quint64 *>(pixels) + width);
+            break;
+        default:
+            for (int left = 0, right = width - 1; left < right; left++, right--) {
+                std::swap_ranges(pixels + left * bytesPerPixel, pixels + (left + 1) * bytesPerPixel,
+                                 pixels + right * bytesPerPixel);
+            }
+            break;
+        }
+    }
+}
+
+void flipVertically(QImage &image)
+{
+    // Swaps row pairs from the top and bottom; only the pixels, so region views keep their surroundings
+    const int height = image.height();
+    const qsizetype rowBytes = qsizetype(image.width()) * image.depth() / 8;
+    for (int y = 0; y < height / 2; ++y) {
+        uchar *top = image.scanLine(y);
+        uchar *bottom = image.scanLine(height - 1 - y);
+        std::swap_ranges(top, top + rowBytes, bottom);
+    }
+}
+
+void rotateLeft(const QImage &source, QImage &target)
+{
+    static const auto variant = KERNEL_VARIANT(rotateLeft);
+    variant(source, target);
+}
+
+void rotateRight(const QImage &source, QImage &target)
+{
+    static const auto variant = KERNEL_VARIANT(rotateRight);
+    variant(source, target);
+}
+
+void zoomIn(const QImage &source, QImage &target)
+{
+    static const auto variant = KERNEL_VARIANT(zoomIn);
+    variant(source, target);
+}
+
+void zoomOut(const QImage &source, QImage &target)
+{
+    static const auto variant = KERNEL_VARIANT(zoomOut);
+    variant(source, target);
+}
+
+void toGrayscale(const QImage &source, QImage &target)
+{
+    static const auto variant = KERNEL_VARIANT(toGrayscale);
+    variant(source, target);
+}
+
+void brightness(QImage &image, int value)
+{
+    static const auto variant = KERNEL_VARIANT(brightness);
+    variant(image, value);
+}
+
+void contrast(QImage &image, float factor)
+{
+    static const auto variant = KERNEL_VARIANT(contrast);
+    variant(image, factor);
+}
+
+void negative(QImage &image)
+{
+    static const auto variant = KERNEL_VARIANT(negative);
+    variant(image);
+}
+
+bool quantize(QImage &image, int levels)
+{
+    static const auto variant = KERNEL_VARIANT(quantize);
+    return variant(image, levels);
+}
+
+std::vector<std::vector<quint32>> histograms(const QImage &image)
+{
+    static const auto variant = KERNEL_VARIANT(histograms);
+    return variant(image);
+}
+
+std::vector<quint32> lumaHistogram(const QImage &image)
+{
+    std::vector<quint32> result;
+    withLayout(image.format(), [&](auto layout) { result = toneHistogram<decltype(layout)>(image, LumaTone<decltype(layout)>()); });
+    return result;
+}
+
+void equalizationLut(const quint32 *histogram, int bins, qint64 pixelCount, quint16 *lut)
+{
+    // Cumulative histogram scaled to the value range
+    const double alpha = double(bins - 1) / pixelCount;
+    qint64 cumulative = 0;
+    for (int i = 0; i < bins; i++) {
+        cumulative += histogram[i];
+        lut[i] = quint16(std::min<qint64>(bins - 1, std::llround(alpha * cumulative)));
+    }
+}
+
+void equalize(QImage &image, ColorMode mode)
+{
+    static const auto variant = KERNEL_VARIANT(equalize);
+    variant(image, mode);
+}
+
+void matchHistogram(QImage &image, const QImage &reference, ColorMode mode)
+{
+    static const auto variant = KERNEL_VARIANT(matchHistogram);
+    variant(image, ImageBufferPool::instance().adopt(reference.convertToFormat(image.format())), mode);
+}
+
+void clahe(QImage &image, int tilesX, int tilesY, float clipLimit, bool luminance)
+{
+    withLayout(image.format(), [&](auto layout) { claheRows<decltype(layout)>(image, tilesX, tilesY, clipLimit, luminance); });
+}
+
+void rankFilter(const QImage &source, QImage &target, int radius, int percentile)
+{
+    withLayout(source.format(), [&](auto layout) { rankRows<decltype(layout)>(source, target, radius, percentile); });
+}
+
+void boxBlur(const QImage &source, QImage &target, int radius)
+{
+    withLayout(source.format(), [&](auto layout) { blurRows<decltype(layout)>(source, target, {std::max(0, radius)}); });
+}
+
+void gaussianBlur(const QImage &source, QImage &target, float sigma)
+{
+    const std::vector<int> radii = gaussianBoxRadii(std::max(0.0f, sigma), 3);
+    withLayout(source.format(), [&](auto layout) { blurRows<decltype(layout)>(source, target, radii); });
+}
+
+void morphology(const QImage &source, QImage &target, MorphologyOperation operation, int radiusX, int radiusY)
+{
+    radiusX = std::max(0, radiusX);
+    radiusY = std::max(0, radiusY);
+    withLayout(source.format(), [&](auto layout) { morphologyRows<decltype(layout)>(source, target, operation, radiusX, radiusY); });
+}
+
+int quantizeColors(QImage &image, int colors, ColorQuantizer method)
+{
+    int entries = 0;
+    withLayout(image.format(), [&](auto layout) { entries = quantizeColorRows<decltype(layout)>(image, colors, method); });
+    return entries;
+}
+
+void gradient(const QImage &source, QImage &magnitude, QImage *orientation, GradientOperator op, GradientNorm norm)
+{
+    const int centreWeight = op == GradientOperator::Sobel ? 2 : 1;
+    const bool euclidean = norm == GradientNorm::L2;
+    withLayout(source.format(), [&](auto layout) {
+        gradientRows<decltype(layout)>(source, magnitude, orientation, centreWeight, euclidean);
+    });
+}
+
+void colorizeOrientation(const QImage &magnitude, const QImage &orientation, QImage &target)
+{
+    // One hue per 45 degree bin, darkened by the edge strength
+    static const QRgb colors[8] = {qRgb(255, 0, 0), qRgb(255, 160, 0), qRgb(255, 255, 0), qRgb(0, 255, 0),
+                                   qRgb(0, 255, 255), qRgb(0, 96, 255), qRgb(160, 0, 255), qRgb(255, 0, 160)};
+    for (int y = 0; y < magnitude.height(); ++y) {
+        const quint8 *bins = orientation.constScanLine(y);
+        QRgb *out = reinterpret_cast<QRgb *>(target.scanLine(y));
+        for (int x = 0; x < magnitude.width(); ++x) {
+            const int strength = magnitude.format() == QImage::Format_Grayscale16
+                                     ? reinterpret_cast<const quint16 *>(magnitude.constScanLine(y))[x] >> 8
+                                     : magnitude.constScanLine(y)[x];
+            const QRgb color = colors[bins[x] & 7];
+            out[x] = qRgb(qRed(color) * strength / 255, qGreen(color) * strength / 255, qBlue(color) * strength / 255);
+        }
+    }
+}
+
+void convolve(const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset)
+{
+    static const auto variant = KERNEL_VARIANT(convolve);
+    variant(source, target, kernel, offset);
+}
+
+Comparison compare(const QImage &a, const QImage &b, QImage *heatmap)
+{
+    Q_ASSERT(a.size() == b.size());
+    // Both sides go to one working format: 16 bits when either has them, gray only when both are
+    const bool highBitDepth = isHighBitDepth(a) || isHighBitDepth(b);
+    const bool gray = isGrayscale(a) && isGrayscale(b);
+    const QImage::Format format = gray ? (highBitDepth ? QImage::Format_Grayscale16 : QImage::Format_Grayscale8)
+                                       : (highBitDepth ? QImage::Format_RGBX64 : QImage::Format_RGB32);
+    auto converted = [format](const QImage &image) {
+        return image.format() == format || (format == QImage::Format_RGB32 && image.format() == QImage::Format_ARGB32)
+                       || (format == QImage::Format_RGBX64 && image.format() == QImage::Format_RGBA64)
+                   ? image
+                   : ImageBufferPool::instance().adopt(image.convertToFormat(format));
+    };
+
+    if (heatmap && (heatmap->size() != a.size() || heatmap->format() != QImage::Format_RGB32))
+        *heatmap = ImageBufferPool::instance().acquire(a.width(), a.height(), QImage::Format_RGB32);
+    const QImage first = converted(a);
+    const QImage second = converted(b);
+    Comparison result;
+    withLayout(first.format(), [&](auto layout) { result = compareRows<decltype(layout)>(first, second, heatmap); });
+    return result;
+}
+
+}
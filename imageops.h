@@ -0,0 +1,91 @@
+#ifndef IMAGEOPS_H
+#define IMAGEOPS_H
+
+#include <QImage>
+#include <vector>
+
+// Pixel kernels behind the editor operations. They work on the working formats
+// only: Grayscale8, RGB32 and ARGB32 for 8-bit editing, and Grayscale16, RGBX64
+// and RGBA64 when editing at high bit depth. Values such as brightness offsets
+// are given in 8-bit steps and scaled to the image depth.
+namespace ImageOps {
+
+enum class GradientOperator { Sobel, Prewitt };
+enum class GradientNorm { L1, L2 };
+enum class ColorQuantizer { MedianCut, KMeans };
+// Color images are equalized or matched per R, G and B channel, which shifts hues, or only
+// on the luma of YCbCr or the lightness of CIE Lab. Gray images always use their one channel.
+enum class ColorMode { PerChannel, Luma, Lightness };
+// The top hat is the source less its opening, which keeps small bright details, and the
+// black hat the closing less the source, which keeps small dark ones
+enum class MorphologyOperation { Erode, Dilate, Open, Close, TopHat, BlackHat };
+
+struct Comparison
+{
+    double mse = 0.0;
+    double psnr = 0.0;   // dB, infinite for identical images
+    double ssim = 1.0;
+};
+
+QImage::Format workingFormat(const QImage &image, bool highBitDepth);
+QImage toWorkingFormat(QImage image, bool highBitDepth);
+QImage toDisplayFormat(QImage image);
+bool isGrayscale(const QImage &image);
+bool isHighBitDepth(const QImage &image);
+int maxValue(const QImage &image);
+
+// A view of the part of image inside rect that shares its pixels, so kernels run on a
+// region without copying it; writes through the first overload change image
+QImage region(QImage &image, const QRect &rect);
+QImage region(const QImage &image, const QRect &rect);
+// Copies rect of source into target at position, converting to the target format if needed
+void copyRegion(const QImage &source, const QRect &rect, QImage &target, const QPoint &position);
+
+void flipHorizontally(QImage &image);
+void flipVertically(QImage &image);
+void rotateLeft(const QImage &source, QImage &target);
+void rotateRight(const QImage &source, QImage &target);
+void zoomIn(const QImage &source, QImage &target);
+void zoomOut(const QImage &source, QImage &target);
+
+void toGrayscale(const QImage &source, QImage &target);
+void brightness(QImage &image, int value);
+void contrast(QImage &image, float factor);
+void negative(QImage &image);
+bool quantize(QImage &image, int levels);
+
+// One histogram per channel in R, G, B order, or a single one for gray images
+std::vector<std::vector<quint32>> histograms(const QImage &image);
+std::vector<quint32> lumaHistogram(const QImage &image);
+void equalizationLut(const quint32 *histogram, int bins, qint64 pixelCount, quint16 *lut);
+void equalize(QImage &image, ColorMode mode = ColorMode::PerChannel);
+void matchHistogram(QImage &image, const QImage &reference, ColorMode mode = ColorMode::PerChannel);
+// Contrast limited adaptive equalization; clipLimit is a multiple of the mean bin count
+void clahe(QImage &image, int tilesX, int tilesY, float clipLimit, bool luminance);
+// Reduces the colors to a palette of at most 256 entries found by median cut, optionally
+// refined by k-means; alpha is kept. Returns the number of palette entries used.
+int quantizeColors(QImage &image, int colors, ColorQuantizer method);
+
+// Percentile of the (2 radius + 1)^2 neighbourhood per channel; 50 is the median
+void rankFilter(const QImage &source, QImage &target, int radius, int percentile);
+// Cost per pixel does not depend on the radius; the Gaussian is three box passes
+void boxBlur(const QImage &source, QImage &target, int radius);
+void gaussianBlur(const QImage &source, QImage &target, float sigma);
+// Gray-level morphology per color channel with a (2 radiusX + 1) x (2 radiusY + 1)
+// rectangle, which is a line when one radius is 0; on masks of only 0 and the maximum
+// it is binary morphology. Cost per pixel does not depend on the radii.
+void morphology(const QImage &source, QImage &target, MorphologyOperation operation, int radiusX, int radiusY);
+// Magnitude of the luma gradient into a Grayscale8 or Grayscale16 image matching the
+// source depth, and optionally its direction in eight 45 degree bins into a Grayscale8 image
+void gradient(const QImage &source, QImage &magnitude, QImage *orientation, GradientOperator op, GradientNorm norm);
+void colorizeOrientation(const QImage &magnitude, const QImage &orientation, QImage &target);
+void convolve(const QImage &source, QImage &target, const std::vector<std::vector<float>> &kernel, float offset);
+
+// MSE and PSNR over the color channels and the mean SSIM of the luma in 7x7 windows, in
+// the value range of the deeper image; a and b must have the same size. The optional
+// heatmap becomes an RGB32 image of the largest channel difference per pixel.
+Comparison compare(const QImage &a, const QImage &b, QImage *heatmap = nullptr);
+
+}
+
+#endif // IMAGEOPS_H
@@ -1,17 +1,33 @@
 #include "imageviewer.h"
+#include "adjustmentdialog.h"
 #include "convolutionwindow.h"
+#include "cpufeatures.h"
+#include "bufferpool.h"
+#include "exportqueue.h"
+#include "histogramdock.h"
+#include "imagecache.h"
+#include "imageloader.h"
+#include "imageops.h"
+#include "rawimage.h"
+#include "tracer.h"
 #include <QApplication>
 #include <QClipboard>
 #include <QColorSpace>
 #include <QDir>
+#include <QEventLoop>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QImageReader>
 #include <QImageWriter>
 #include <QLabel>
 #include <QMenuBar>
 #include <QMessageBox>
 #include <QMimeData>
+#include <QMouseEvent>
 #include <QPainter>
+#include <QProgressBar>
+#include <QPushButton>
+#include <QRubberBand>
 #include <QScreen>
 #include <QScrollArea>
 #include <QScrollBar>
@@ -19,6 +35,8 @@
 #include <QStatusBar>
 #include <QHBoxLayout>
 #include <QGroupBox>
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 
 
@@ -32,8 +50,15 @@
 
 ImageViewer::ImageViewer(QWidget *parent)
     : QMainWindow(parent), imageLabel(new QLabel), resultLabel(new QLabel)
-    , scrollArea(new QScrollArea), scrollAreaResult(new QScrollArea)
+    , scrollArea(new QScrollArea), scrollAreaResult(new QScrollArea), memoryLabel(new QLabel)
+    , imageCache(new ImageCache(this)), exportQueue(new ExportQueue(this)), exportProgressBar(new QProgressBar)
 {
+    connect(imageCache, &ImageCache::loaded, this, &ImageViewer::imageLoaded);
+    connect(exportQueue, &ExportQueue::progress, this, &ImageViewer::exportProgress);
+    connect(exportQueue, &ExportQueue::failed, this, &ImageViewer::exportFailed);
+    connect(exportQueue, &ExportQueue::exported, this, [this](const QString &fileName) {
+        statusBar()->showMessage(tr("Wrote \"%1\"").arg(QDir::toNativeSeparators(fileName)));
+    });
 
     imageLabel->setBackgroundRole(QPalette::Base);
     imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
@@ -76,59 +101,242 @@ ImageViewer::ImageViewer(QWidget *parent)
     centralWidget->setLayout(mainLayout);
     setCentralWidget(centralWidget);
 
+    exportProgressBar->setMaximumWidth(150);
+    exportProgressBar->setFormat(tr("Export %v/%m"));
+    exportProgressBar->hide();
+    statusBar()->addPermanentWidget(exportProgressBar);
+    statusBar()->addPermanentWidget(memoryLabel);
+    updateMemoryStatus();
+
+    // Dragging on the processed image selects the region the next operations work on
+    selectionBand = new QRubberBand(QRubberBand::Rectangle, resultLabel);
+    resultLabel->installEventFilter(this);
+
+    histogramDock = new HistogramDock(this);
+    histogramDock->setSources(&image, &resultImage);
+    histogramDock->hide();
+    addDockWidget(Qt::RightDockWidgetArea, histogramDock);
+
     createActions();
     resize(QGuiApplication::primaryScreen()->availableSize() * 3 / 5);
 }
 
+// Largest size the original and processed images are shown at
+static QSize maximumDisplaySize()
+{
+    return QGuiApplication::primaryScreen()->availableSize() * 3 / 7 + QSize(40, 40);
+}
+
+// Image in the working format; a converted copy is adopted by the pool, so it is counted
+static QImage workingImage(QImage image, bool highBitDepth)
+{
+    return ImageBufferPool::instance().adopt(ImageOps::toWorkingFormat(std::move(image), highBitDepth));
+}
+
+// Replaces a color image with its luminance at the same depth. It is a step inside
+// other operations, which trace and finish themselves.
+static void toGrayscale(QImage &image)
+{
+    if (ImageOps::isGrayscale(image)) {
+        return;
+    }
+    const QImage::Format grayFormat = ImageOps::isHighBitDepth(image) ? QImage::Format_Grayscale16 : QImage::Format_Grayscale8;
+    QImage grayImage = ImageBufferPool::instance().acquire(image.width(), image.height(), grayFormat);
+    ImageOps::toGrayscale(image, grayImage);
+    image = grayImage;
+}
+
+// Runs op on the part of image inside rect without copying it. An op that replaces
+// the image, e.g. with a gray version, has its result copied back into the region.
+static void applyToRegion(QImage &image, const QRect &rect, const std::function<void(QImage &)> &op)
+{
+    if (rect.isEmpty() || rect == image.rect()) {
+        op(image);
+        return;
+    }
+    QImage view = ImageOps::region(image, rect);
+    const uchar *pixels = view.constBits();
+    op(view);
+    if (view.constBits() != pixels) {
+        ImageOps::copyRegion(view, view.rect(), image, rect.topLeft());
+    }
+}
+
 bool ImageViewer::loadFile(const QString &fileName)
 {
-    QImageReader reader(fileName);
-    reader.setAutoTransform(true);
-    const QImage newImage = reader.read();
-    if (newImage.isNull()) {
+    TraceScope trace("open", "io");
+    const QString filePath = QFileInfo(fileName).absoluteFilePath();
+    const QSize boundingSize = maximumDisplaySize();
+
+    DecodedImage decoded;
+    if (imageCache->find(filePath, &decoded)) {
+        currentFile = filePath;
+        updateDirectoryListing(filePath);
+        imageLoaded(filePath, decoded);
+        return true;
+    }
+
+    QImageReader reader(filePath);
+    if (!RawImage::isRawFile(filePath) && !reader.canRead()) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot load %1: %2")
-                                     .arg(QDir::toNativeSeparators(fileName), reader.errorString()));
+                                     .arg(QDir::toNativeSeparators(filePath), reader.errorString()));
         return false;
     }
 
+    // Show a reduced resolution decode right away when the decoder can produce one cheaply
+    if (ImageLoader::canReadPreview(filePath, boundingSize)) {
+        QString errorString;
+        const QImage preview = ImageLoader::readPreview(filePath, boundingSize, &errorString);
+        if (preview.isNull()) {
+            QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                     tr("Cannot load %1: %2")
+                                         .arg(QDir::toNativeSeparators(filePath), errorString));
+            return false;
+        }
+        showPreview(preview);
+    } else {
+        // The previous image is no longer editable, since the new one replaces it
+        clearImage();
+    }
+    trace.finish();
+
+    // The full resolution decode and its display downscale run in the background. It is
+    // started before the neighbours are prefetched, so it goes to the shared pool rather
+    // than behind them on the smaller prefetch pool.
+    currentFile = filePath;
+    imageCache->load(filePath, boundingSize);
+    updateDirectoryListing(filePath);
+
+    setWindowFilePath(filePath);
+    statusBar()->showMessage(tr("Loading \"%1\"... (first pixels after %2 ms)")
+                                 .arg(QDir::toNativeSeparators(filePath))
+                                 .arg(trace.elapsed() / 1e6, 0, 'f', 1));
+    return true;
+}
 
-    setImage(newImage);
+void ImageViewer::imageLoaded(const QString &fileName, const DecodedImage &decoded)
+{
+    if (fileName != currentFile) {
+        return;
+    }
 
+    if (decoded.image.isNull()) {
+        // Nothing of the file stays on screen, neither its preview nor the image before it
+        clearImage();
+        currentFile.clear();
+        setWindowFilePath(QString());
+        statusBar()->clearMessage();
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("Cannot load %1: %2")
+                                     .arg(QDir::toNativeSeparators(fileName), decoded.errorString));
+        return;
+    }
+    setImage(decoded.image, decoded.display);
     setWindowFilePath(fileName);
 
     const QString message = tr("Opened \"%1\", %2x%3, Depth: %4")
                                 .arg(QDir::toNativeSeparators(fileName)).arg(image.width()).arg(image.height()).arg(image.depth());
     statusBar()->showMessage(message);
-    return true;
 }
 
-void ImageViewer::setImage(const QImage &newImage)
+// For the command line, whose exit code depends on whether the full decode succeeds
+bool ImageViewer::loadFileAndWait(const QString &fileName)
 {
-    image = newImage;
-    resultImage = newImage;
-    if (image.colorSpace().isValid())
-        image.convertToColorSpace(QColorSpace::SRgb);
+    if (!loadFile(fileName)) {
+        return false;
+    }
+    if (!image.isNull()) {
+        return true;
+    }
 
-    // Defines the maximum size for the images
-    const QSize maxSize = QGuiApplication::primaryScreen()->availableSize() * 3 / 7 + QSize(40, 40);
-    const QSize imageSize = image.size();
+    // The decode reports back through the event loop, so it cannot finish before this waits
+    const QString filePath = currentFile;
+    bool loaded = false;
+    QEventLoop loop;
+    connect(imageCache, &ImageCache::loaded, &loop, [&](const QString &name, const DecodedImage &decoded) {
+        if (name == filePath) {
+            loaded = !decoded.image.isNull();
+            loop.quit();
+        }
+    });
+    loop.exec();
+    return loaded;
+}
 
-    QImage scaledImage = image;
-    if (imageSize.width() > maxSize.width() || imageSize.height() > maxSize.height()) {
-        scaledImage = image.scaled(maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+// Lists the images next to the opened file and decodes its neighbours ahead of time
+void ImageViewer::updateDirectoryListing(const QString &filePath)
+{
+    const QFileInfo fileInfo(filePath);
+    if (fileInfo.absolutePath() != directoryPath) {
+        directoryPath = fileInfo.absolutePath();
+        directoryFiles.clear();
+
+        const QDir directory(directoryPath);
+        const QStringList entries = directory.entryList(ImageLoader::nameFilters(), QDir::Files, QDir::Name | QDir::IgnoreCase | QDir::LocaleAware);
+        for (const QString &entry : entries)
+            directoryFiles.append(directory.absoluteFilePath(entry));
+    }
+    directoryIndex = directoryFiles.indexOf(filePath);
+
+    // The opened file stays in the list so a decode of it that is already under way is not cancelled
+    QStringList neighbours;
+    for (int offset : {0, 1, -1, 2}) {
+        const int index = directoryIndex + offset;
+        if (directoryIndex >= 0 && index >= 0 && index < directoryFiles.size())
+            neighbours.append(directoryFiles.at(index));
     }
+    imageCache->prefetch(neighbours, maximumDisplaySize());
+    updateActions();
+}
 
-    imageLabel->setPixmap(QPixmap::fromImage(scaledImage));
-    imageLabel->adjustSize();
+void ImageViewer::nextImage()
+{
+    if (directoryIndex >= 0 && directoryIndex + 1 < directoryFiles.size())
+        loadFile(directoryFiles.at(directoryIndex + 1));
+}
 
-    resultLabel->setPixmap(QPixmap::fromImage(scaledImage));
+void ImageViewer::previousImage()
+{
+    if (directoryIndex > 0)
+        loadFile(directoryFiles.at(directoryIndex - 1));
+}
+
+// Empties both panes and disables editing until an image is set
+void ImageViewer::clearImage()
+{
+    image = QImage();
+    resultImage = QImage();
+    scratchImage = QImage();
+    clearSelection();
+    imageLabel->clear();
+    resultLabel->clear();
+    updateActions();
+    updateMemoryStatus();
+}
+
+// Shows the preview in both panes while the full image is loading; editing stays disabled until then
+void ImageViewer::showPreview(const QImage &preview)
+{
+    clearImage();
+    showDisplayImage(preview);
+}
+
+void ImageViewer::showDisplayImage(const QImage &displayImage)
+{
+    {
+        TraceScope trace("upload", "display", qint64(displayImage.width()) * displayImage.height());
+        const QPixmap pixmap = QPixmap::fromImage(displayImage);
+        imageLabel->setPixmap(pixmap);
+        resultLabel->setPixmap(pixmap);
+    }
+    imageLabel->adjustSize();
     resultLabel->adjustSize();
 
     //scrollArea->setWidgetResizable(true);
     //scrollAreaResult->setWidgetResizable(true);
 
-    QSize newWindowSize = QSize(scaledImage.width() * 2 + 150, scaledImage.height() + 150); // Largura das duas imagens + espaço extra
+    QSize newWindowSize = QSize(displayImage.width() * 2 + 150, displayImage.height() + 150); // Largura das duas imagens + espaço extra
     this->resize(newWindowSize);
 
     // Center the window on the screen
@@ -136,43 +344,101 @@ void ImageViewer::setImage(const QImage &newImage)
     int x = (screenGeometry.width() - this->width()) / 2;
     int y = (screenGeometry.height() - this->height()) / 2;
     this->move(x, y); 
+}
+
+void ImageViewer::setImage(QImage newImage, QImage displayImage)
+{
+    image = ImageBufferPool::instance().adopt(std::move(newImage));
+    if (image.colorSpace().isValid())
+        image.convertToColorSpace(QColorSpace::SRgb);
+    // Shared until the first edit detaches it, unless the working format differs
+    resultImage = workingImage(image, highBitDepth);
+    scratchImage = QImage();
+    clearSelection();
+
+    if (displayImage.isNull())
+        displayImage = ImageLoader::scaledForDisplay(image, maximumDisplaySize());
+    showDisplayImage(displayImage);
 
     flipHorizontallyAct->setEnabled(true);
     flipVerticallyAct->setEnabled(true);
     convertToGrayScaleAct->setEnabled(true);
     grayScaleQuantizationAct->setEnabled(true);
     resetImageAct->setEnabled(true);
-    histogramAct->setEnabled(true);
     brightnessAct->setEnabled(true);
     contrastAct->setEnabled(true);
     negativeAct->setEnabled(true);
     rotateLeftAct->setEnabled(true);
     rotateRightAct->setEnabled(true);
     histogramEqualizationAct->setEnabled(true);
+    adaptiveEqualizationAct->setEnabled(true);
     grayScaleHistogramMatchingAct->setEnabled(true);
     showConvWindowAct->setEnabled(true);
+    compareAct->setEnabled(true);
     
     scaleFactor = 1.0;
 
     updateActions();
+    updateMemoryStatus();
 }
 
 
 bool ImageViewer::saveFile(const QString &fileName)
 {
-    QImageWriter writer(fileName);
-
-    if (!writer.write(resultImage)) {
+    ExportTarget target;
+    target.fileName = fileName;
+    target.format = QFileInfo(fileName).suffix().toLower().toLatin1();
+    if (!ExportQueue::isWritable(target.format)) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot write %1: %2")
-                                     .arg(QDir::toNativeSeparators(fileName)), writer.errorString());
+                                     .arg(QDir::toNativeSeparators(fileName), tr("Unsupported image format")));
         return false;
     }
-    const QString message = tr("Wrote \"%1\"").arg(QDir::toNativeSeparators(fileName));
-    statusBar()->showMessage(message);
+
+    exportQueue->enqueue(resultImage, {target});
     return true;
 }
 
+void ImageViewer::exportResult()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Export"), windowFilePath().isEmpty() ? QDir::homePath() : windowFilePath());
+    if (fileName.isEmpty()) {
+        return;
+    }
+    const QFileInfo fileInfo(fileName);
+    const QString baseName = fileInfo.dir().filePath(fileInfo.completeBaseName());
+
+    bool ok;
+    QString specification = QInputDialog::getText(this, tr("Export"),
+                                                  tr("Targets (format[:quality][@max size], ...):"), QLineEdit::Normal,
+                                                  exportSpecification, &ok);
+    if (!ok || specification.isEmpty()) {
+        return;
+    }
+
+    QString errorString;
+    const QList<ExportTarget> targets = ExportQueue::parseTargets(specification, baseName, &errorString);
+    if (targets.isEmpty()) {
+        QMessageBox::warning(this, tr("Error"), errorString);
+        return;
+    }
+    exportSpecification = specification;
+    exportQueue->enqueue(resultImage, targets);
+}
+
+void ImageViewer::exportProgress(int done, int total)
+{
+    exportProgressBar->setRange(0, total);
+    exportProgressBar->setValue(done);
+    exportProgressBar->setVisible(done < total);
+}
+
+void ImageViewer::exportFailed(const QString &fileName, const QString &errorString)
+{
+    QMessageBox::warning(this, QGuiApplication::applicationDisplayName(),
+                         tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(fileName), errorString));
+}
+
 
 static void initializeImageFileDialog(QFileDialog &dialog, QFileDialog::AcceptMode acceptMode)
 {
@@ -191,6 +457,8 @@ static void initializeImageFileDialog(QFileDialog &dialog, QFileDialog::AcceptMo
         mimeTypeFilters.append(mimeTypeName);
     mimeTypeFilters.sort();
     dialog.setMimeTypeFilters(mimeTypeFilters);
+    // The raw intermediate format has no MIME type
+    dialog.setNameFilters(dialog.nameFilters() << QObject::tr("Photochopp raw image (*.%1)").arg(QString::fromLatin1(RawImage::formatName())));
     dialog.selectMimeTypeFilter("image/jpeg");
     dialog.setAcceptMode(acceptMode);
     if (acceptMode == QFileDialog::AcceptSave)
@@ -204,9 +472,7 @@ void ImageViewer::open()
 
     if (dialog.exec() == QDialog::Accepted) {
         QString fileName = dialog.selectedFiles().constFirst();
-        if (loadFile(fileName)) {
-            setImage(image); 
-        } else {
+        if (!loadFile(fileName)) {
             QMessageBox::information(this, tr("Error"), tr("Failed to load image"));
         }
     }
@@ -219,7 +485,24 @@ void ImageViewer::saveAs()
     QFileDialog dialog(this, tr("Save File As"));
     initializeImageFileDialog(dialog, QFileDialog::AcceptSave);
 
-    while (dialog.exec() == QDialog::Accepted && !saveFile(dialog.selectedFiles().constFirst())) {}
+    if (dialog.exec() == QDialog::Accepted) {
+        saveFile(dialog.selectedFiles().constFirst());
+    }
+}
+
+void ImageViewer::exportTrace()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Export Trace"), QDir::homePath(), tr("Chrome Trace (*.json)"));
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    QString errorString;
+    if (!Tracer::instance().exportChromeTrace(fileName, &errorString)) {
+        QMessageBox::warning(this, tr("Error"), tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(fileName), errorString));
+        return;
+    }
+    statusBar()->showMessage(tr("Wrote trace \"%1\"").arg(QDir::toNativeSeparators(fileName)));
 }
 
 void ImageViewer::copy()
@@ -246,14 +529,19 @@ static QImage clipboardImage()
 void ImageViewer::paste()
 {
 #ifndef QT_NO_CLIPBOARD
-    const QImage newImage = clipboardImage();
+    QImage newImage = clipboardImage();
     if (newImage.isNull()) {
         statusBar()->showMessage(tr("No image in clipboard"));
     } else {
-        setImage(newImage);
+        // Drops a load that is still decoding in the background
+        currentFile.clear();
+        directoryPath.clear();
+        directoryFiles.clear();
+        directoryIndex = -1;
+        setImage(std::move(newImage));
         setWindowFilePath(QString());
         const QString message = tr("Obtained image from clipboard, %1x%2, Depth: %3")
-                                    .arg(newImage.width()).arg(newImage.height()).arg(newImage.depth());
+                                    .arg(image.width()).arg(image.height()).arg(image.depth());
         statusBar()->showMessage(message);
     }
 #endif // !QT_NO_CLIPBOARD
@@ -261,78 +549,21 @@ void ImageViewer::paste()
 
 void ImageViewer::zoomIn() {
 
-    int originalWidth = resultImage.width();
-    int originalHeight = resultImage.height();
-    
-    int newWidth = originalWidth * 2;
-    int newHeight = originalHeight * 2;
-
-    QImage enlargedImage(newWidth, newHeight, QImage::Format_RGB32);
-    
-    for (int y = 0; y < originalHeight; ++y) {
-        for (int x = 0; x < originalWidth; ++x) {
-            QColor color = resultImage.pixelColor(x, y);
-            
+    clearSelection();
+    TraceScope trace("zoomIn", "op", qint64(resultImage.width()) * resultImage.height());
 
-            enlargedImage.setPixelColor(2 * x, 2 * y, color);
-
-            // Set the pixel color in the other positions as white
-            enlargedImage.setPixelColor(2 * x + 1, 2 * y, QColor(255, 255, 255)); // direita
-            enlargedImage.setPixelColor(2 * x, 2 * y + 1, QColor(255, 255, 255)); // abaixo
-            enlargedImage.setPixelColor(2 * x + 1, 2 * y + 1, QColor(255, 255, 255)); // diagonal
-        }
-    }
+    QImage &enlargedImage = scratchBuffer(resultImage.width() * 2, resultImage.height() * 2, resultImage.format());
+    ImageOps::zoomIn(resultImage, enlargedImage);
 
-    // Rows interpolation
-    for (int y = 0; y < newHeight; y += 2) {
-        for (int x = 1; x < newWidth - 1; x += 2) {
-            QColor leftColor = enlargedImage.pixelColor(x - 1, y);
-            QColor rightColor = enlargedImage.pixelColor(x + 1, y);
-            
-            int avgR = (leftColor.red() + rightColor.red()) / 2;
-            int avgG = (leftColor.green() + rightColor.green()) / 2;
-            int avgB = (leftColor.blue() + rightColor.blue()) / 2;
-            
-            enlargedImage.setPixelColor(x, y, QColor(avgR, avgG, avgB));
-        }
-    }
-
-    // Columns interpolation
-    for (int x = 0; x < newWidth; ++x) {
-        for (int y = 1; y < newHeight - 1; y += 2) {
-            QColor topColor = enlargedImage.pixelColor(x, y - 1);
-            QColor bottomColor = enlargedImage.pixelColor(x, y + 1);
-            
-            int avgR = (topColor.red() + bottomColor.red()) / 2;
-            int avgG = (topColor.green() + bottomColor.green()) / 2;
-            int avgB = (topColor.blue() + bottomColor.blue()) / 2;
-            
-            enlargedImage.setPixelColor(x, y, QColor(avgR, avgG, avgB));
-        }
-    }
-
-    // Diagonal pixels
-    for (int y = 1; y < newHeight - 1; y += 2) {
-        for (int x = 1; x < newWidth - 1; x += 2) {
-            QColor topLeftColor = enlargedImage.pixelColor(x - 1, y - 1);
-            QColor topRightColor = enlargedImage.pixelColor(x + 1, y - 1);
-            QColor bottomLeftColor = enlargedImage.pixelColor(x - 1, y + 1);
-            QColor bottomRightColor = enlargedImage.pixelColor(x + 1, y + 1);
-
-            int avgR = (topLeftColor.red() + topRightColor.red() + bottomLeftColor.red() + bottomRightColor.red()) / 4;
-            int avgG = (topLeftColor.green() + topRightColor.green() + bottomLeftColor.green() + bottomRightColor.green()) / 4;
-            int avgB = (topLeftColor.blue() + topRightColor.blue() + bottomLeftColor.blue() + bottomRightColor.blue()) / 4;
-
-            enlargedImage.setPixelColor(x, y, QColor(avgR, avgG, avgB));
-        }
-    }
-
-    resultImage = enlargedImage;
-    scale();
+    commitScratch();
+    finishOperation(trace);
 }
 
 void ImageViewer::zoomOut()
 {
+    clearSelection();
+    TraceScope trace("zoomOut", "op", qint64(resultImage.width()) * resultImage.height());
+
     int sx = 2;
     int sy = 2;
 
@@ -342,59 +573,22 @@ void ImageViewer::zoomOut()
     int newWidth = static_cast<int>(originalWidth / sx);
     int newHeight = static_cast<int>(originalHeight / sy);
 
-    const QSize maxSize = QGuiApplication::primaryScreen()->availableSize() * 3 / 7 + QSize(40, 40);
+    const QSize maxSize = maximumDisplaySize();
 
     if (newWidth > maxSize.width() || newHeight > maxSize.height()) {
-        resultImage = resultImage.scaled(maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        resultImage = workingImage(resultImage.scaled(maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation), highBitDepth);
         originalWidth = resultImage.width();
         originalHeight = resultImage.height();
         newWidth = static_cast<int>(originalWidth / sx);
         newHeight = static_cast<int>(originalHeight / sy);
     }
 
-    QImage reducedImage(newWidth, newHeight, QImage::Format_RGB32);
-    
-
-    for (int newY = 0; newY < newHeight; ++newY) {
-        for (int newX = 0; newX < newWidth; ++newX) {
-
-            int startX = static_cast<int>(newX * sx);
-            int startY = static_cast<int>(newY * sy);
+    // Each pixel of the new image is the average of a 2x2 block
+    QImage &reducedImage = scratchBuffer(newWidth, newHeight, resultImage.format());
+    ImageOps::zoomOut(resultImage, reducedImage);
 
-            int sumR = 0, sumG = 0, sumB = 0;
-            int count = 0;
-
-            for (int y = 0; y < sy; ++y) {
-                for (int x = 0; x < sx; ++x) {
-                    int originalX = startX + x;
-                    int originalY = startY + y;
-
-                    if (originalX < originalWidth && originalY < originalHeight) {
-                        QColor pixelColor(resultImage.pixel(originalX, originalY));
-                        sumR += pixelColor.red();
-                        sumG += pixelColor.green();
-                        sumB += pixelColor.blue();
-                        ++count; // Count the number of valid pixels
-                    }
-                }
-            }
-
-            // Calculate the average color in the corresponding pixel of the new image
-            if (count > 0) {
-                int avgR = sumR / count;
-                int avgG = sumG / count;
-                int avgB = sumB / count;
-                
-                // Set the pixel color in the new image
-                reducedImage.setPixel(newX, newY, qRgb(avgR, avgG, avgB));
-            } else {
-                // If there are no valid pixels, set the pixel color to black
-                reducedImage.setPixel(newX, newY, qRgb(0, 0, 0));
-            }
-        }
-    }
-    resultImage = reducedImage;
-    scale();
+    commitScratch();
+    finishOperation(trace);
 }
 
 void ImageViewer::normalSize()
@@ -410,7 +604,10 @@ void ImageViewer::about()
                        tr("<p> The <b>Photochopp Editor</b> is a simple image editor that allows you to perform basic image processing operations.</p>"
                        "<p>Load an image by clicking on the 'File' menu and selecting 'Open'.</p>"
                        "<p>The editor allows you to flip the image horizontally or vertically, convert it to grayscale, quantize the grayscale, and reset the image to its original state.</p>"
-                       "<p>Developed by: <b>Augusto Mattei Grohmann</b> and <b>Tiago Vier Preto<b> </p>"));
+                       "<p>Developed by: <b>Augusto Mattei Grohmann</b> and <b>Tiago Vier Preto<b> </p>"
+                       "<p>Image kernels: %1 (CPU supports %2)</p>")
+                           .arg(QString::fromLatin1(CpuFeatures::name(CpuFeatures::active())),
+                                QString::fromLatin1(CpuFeatures::name(CpuFeatures::supported()))));
 }
 
 void ImageViewer::createActions()
@@ -420,9 +617,22 @@ void ImageViewer::createActions()
     QAction *openAct = fileMenu->addAction(tr("&Open..."), this, &ImageViewer::open);
     openAct->setShortcut(QKeySequence::Open);
 
+    nextImageAct = fileMenu->addAction(tr("&Next Image"), this, &ImageViewer::nextImage);
+    nextImageAct->setShortcut(QKeySequence(Qt::Key_PageDown));
+    nextImageAct->setEnabled(false);
+
+    previousImageAct = fileMenu->addAction(tr("Pre&vious Image"), this, &ImageViewer::previousImage);
+    previousImageAct->setShortcut(QKeySequence(Qt::Key_PageUp));
+    previousImageAct->setEnabled(false);
+
     saveAsAct = fileMenu->addAction(tr("&Save As..."), this, &ImageViewer::saveAs);
     saveAsAct->setEnabled(false);
 
+    exportAct = fileMenu->addAction(tr("&Export..."), this, &ImageViewer::exportResult);
+    exportAct->setEnabled(false);
+
+    fileMenu->addAction(tr("Export &Trace..."), this, &ImageViewer::exportTrace);
+
     fileMenu->addSeparator();
 
     QAction *exitAct = fileMenu->addAction(tr("E&xit"), this, &QWidget::close);
@@ -437,6 +647,10 @@ void ImageViewer::createActions()
     QAction *pasteAct = editMenu->addAction(tr("&Paste"), this, &ImageViewer::paste);
     pasteAct->setShortcut(QKeySequence::Paste);
 
+    selectNoneAct = editMenu->addAction(tr("Select &None"), this, &ImageViewer::clearSelection);
+    selectNoneAct->setShortcut(tr("Ctrl+Shift+A"));
+    selectNoneAct->setEnabled(false);
+
     editMenu->addSeparator();
 
     flipHorizontallyAct = editMenu->addAction(tr("Flip &Horizontally"), this, &ImageViewer::flipHorizontally);
@@ -451,6 +665,9 @@ void ImageViewer::createActions()
     grayScaleQuantizationAct = editMenu->addAction(tr("Gray Scale &Quantization"), this, &ImageViewer::grayScaleQuantization);
     grayScaleQuantizationAct->setEnabled(false);
 
+    colorQuantizationAct = editMenu->addAction(tr("C&olor Quantization..."), this, &ImageViewer::colorQuantization);
+    colorQuantizationAct->setEnabled(false);
+
     brightnessAct = editMenu->addAction(tr("&Brightness"), this, &ImageViewer::brightness);
     brightnessAct->setEnabled(false);
 
@@ -463,12 +680,20 @@ void ImageViewer::createActions()
     histogramEqualizationAct = editMenu->addAction(tr("&Histogram Equalization"), this, &ImageViewer::histogramEqualization);
     histogramEqualizationAct->setEnabled(false);
 
-    grayScaleHistogramMatchingAct = editMenu->addAction(tr("&Grayscale Histogram Matching"), this, &ImageViewer::grayScaleHistogramMatching);
+    adaptiveEqualizationAct = editMenu->addAction(tr("&Adaptive Equalization (CLAHE)..."), this, &ImageViewer::adaptiveEqualization);
+    adaptiveEqualizationAct->setEnabled(false);
+
+    grayScaleHistogramMatchingAct = editMenu->addAction(tr("Histogram &Matching..."), this, &ImageViewer::grayScaleHistogramMatching);
     grayScaleHistogramMatchingAct->setEnabled(false);
 
     showConvWindowAct = editMenu->addAction(tr("2D &Convolution"), this, &ImageViewer::showConvWindow);
     showConvWindowAct->setEnabled(false);
 
+    editMenu->addSeparator();
+
+    highBitDepthAct = editMenu->addAction(tr("High Bit &Depth (16-bit)"), this, &ImageViewer::setHighBitDepth);
+    highBitDepthAct->setCheckable(true);
+
     resetImageAct = editMenu->addAction(tr("&Reset Image"), this, &ImageViewer::resetImage);
     resetImageAct->setEnabled(false);
 
@@ -494,8 +719,13 @@ void ImageViewer::createActions()
 
     QMenu *analyzeMenu = menuBar()->addMenu(tr("&Analyze"));
 
-    histogramAct = analyzeMenu->addAction(tr("&Grayscale Histogram"), this, &ImageViewer::grayScaleHistogram);
-    histogramAct->setEnabled(false);
+    QAction *histogramAct = histogramDock->toggleViewAction();
+    histogramAct->setText(tr("&Histogram"));
+    histogramAct->setShortcut(tr("Ctrl+H"));
+    analyzeMenu->addAction(histogramAct);
+
+    compareAct = analyzeMenu->addAction(tr("&Compare..."), this, &ImageViewer::compareImages);
+    compareAct->setEnabled(false);
 
     QMenu *helpMenu = menuBar()->addMenu(tr("&Help"));
 
@@ -505,6 +735,7 @@ void ImageViewer::createActions()
 void ImageViewer::updateActions()
 {
     saveAsAct->setEnabled(!image.isNull());
+    exportAct->setEnabled(!image.isNull());
     copyAct->setEnabled(!image.isNull());
     zoomInAct->setEnabled(!image.isNull());
     zoomOutAct->setEnabled(!image.isNull());
@@ -513,16 +744,20 @@ void ImageViewer::updateActions()
     flipVerticallyAct->setEnabled(!image.isNull());
     convertToGrayScaleAct->setEnabled(!image.isNull());
     grayScaleQuantizationAct->setEnabled(!image.isNull());
+    colorQuantizationAct->setEnabled(!image.isNull());
     resetImageAct->setEnabled(!image.isNull());
-    histogramAct->setEnabled(!image.isNull());
     brightnessAct->setEnabled(!image.isNull());
     contrastAct->setEnabled(!image.isNull());
     negativeAct->setEnabled(!image.isNull());
     rotateLeftAct->setEnabled(!image.isNull());
     rotateRightAct->setEnabled(!image.isNull());
     histogramEqualizationAct->setEnabled(!image.isNull());
+    adaptiveEqualizationAct->setEnabled(!image.isNull());
     grayScaleHistogramMatchingAct->setEnabled(!image.isNull());
     showConvWindowAct->setEnabled(!image.isNull());
+    compareAct->setEnabled(!image.isNull());
+    nextImageAct->setEnabled(directoryIndex >= 0 && directoryIndex + 1 < directoryFiles.size());
+    previousImageAct->setEnabled(directoryIndex > 0);
 }
 
 void ImageViewer::scaleImage(double factor)
@@ -542,6 +777,7 @@ void ImageViewer::scaleImage(double factor)
     // Atualizar os estados das ações
     zoomInAct->setEnabled(scaleFactor < 3.0);
     zoomOutAct->setEnabled(scaleFactor > 0.333);
+    updateSelectionBand();
 }
 
 
@@ -553,316 +789,406 @@ void ImageViewer::adjustScrollBar(QScrollBar *scrollBar, double factor)
 
 void ImageViewer::scale()
 {
-    const QSize maxSize = QGuiApplication::primaryScreen()->availableSize() * 3 / 7 + QSize(40, 40);
+    const QSize maxSize = maximumDisplaySize();
     const QSize imageSize = resultImage.size();
 
     QImage scaledImage = resultImage;
     if (imageSize.width() > maxSize.width() || imageSize.height() > maxSize.height()) {
+        TraceScope trace("scale", "display", qint64(imageSize.width()) * imageSize.height());
         scaledImage = resultImage.scaled(maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
     }
+    // High bit depth results only drop to 8 bits for display
+    scaledImage = ImageOps::toDisplayFormat(std::move(scaledImage));
 
-    resultLabel->setPixmap(QPixmap::fromImage(scaledImage));
+    {
+        TraceScope trace("upload", "display", qint64(scaledImage.width()) * scaledImage.height());
+        resultLabel->setPixmap(QPixmap::fromImage(scaledImage));
+    }
     resultLabel->adjustSize();
+    displayedSize = resultImage.size();
+    if (!selection.isEmpty() && !resultImage.rect().contains(selection)) {
+        clearSelection();
+    }
+    updateSelectionBand();
+    histogramDock->invalidate();
+    updateMemoryStatus();
 }
 
-void ImageViewer::flipHorizontally()
+// Re-renders only rect of the processed view while the displayed pixmap still
+// matches the image size, so an edit of a small region costs a small upload
+void ImageViewer::updateResultRegion(const QRect &rect)
 {
-    if (resultImage.isNull()) {
+    QPixmap pixmap = resultLabel->pixmap(Qt::ReturnByValue);
+    if (pixmap.isNull() || displayedSize != resultImage.size()) {
+        scale();
         return;
     }
 
-    QImage tempImage = resultImage.copy();
-    int width = resultImage.width();
-    int height = resultImage.height();
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            resultImage.setPixelColor(i,j,tempImage.pixelColor(width - i - 1, j));
+    // Whole display pixels, one wider on each side so the smoothing blends into the neighbours
+    const double sx = double(pixmap.width()) / resultImage.width();
+    const double sy = double(pixmap.height()) / resultImage.height();
+    const QRect target = QRect(QPoint(int(rect.left() * sx) - 1, int(rect.top() * sy) - 1),
+                               QPoint(int(std::ceil((rect.right() + 1) * sx)), int(std::ceil((rect.bottom() + 1) * sy))))
+                         & pixmap.rect();
+    const QRect source = QRect(QPoint(int(target.left() / sx), int(target.top() / sy)),
+                               QPoint(int(std::ceil((target.right() + 1) / sx)) - 1, int(std::ceil((target.bottom() + 1) / sy)) - 1))
+                         & resultImage.rect();
+
+    {
+        TraceScope trace("scaleRegion", "display", qint64(source.width()) * source.height());
+        QImage patch = ImageOps::region(std::as_const(resultImage), source);
+        if (patch.size() != target.size()) {
+            patch = patch.scaled(target.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
         }
+        QPainter painter(&pixmap);
+        painter.drawImage(target, ImageOps::toDisplayFormat(std::move(patch)));
     }
-    scale();
-
+    resultLabel->setPixmap(pixmap);
+    histogramDock->invalidate();
+    updateMemoryStatus();
 }
 
-void ImageViewer::flipVertically()
+bool ImageViewer::eventFilter(QObject *watched, QEvent *event)
 {
-    if (resultImage.isNull()) {
-        return;
+    if (watched != resultLabel || resultImage.isNull()) {
+        return QMainWindow::eventFilter(watched, event);
     }
 
-    QImage tempImage = resultImage.copy();
-    int height = resultImage.height();
-    for (int i = 0; i < height; ++i) {
-        memcpy(resultImage.scanLine(i), tempImage.scanLine(height - 1 - i), resultImage.bytesPerLine());
+    switch (event->type()) {
+    case QEvent::MouseButtonPress: {
+        const QMouseEvent *mouseEvent = static_cast<QMouseEvent *>(event);
+        if (mouseEvent->button() == Qt::LeftButton) {
+            selectionOrigin = mouseEvent->position().toPoint();
+            selectionBand->setGeometry(QRect(selectionOrigin, QSize()));
+            selectionBand->show();
+            return true;
+        }
+        break;
     }
-    scale();
+    case QEvent::MouseMove: {
+        const QMouseEvent *mouseEvent = static_cast<QMouseEvent *>(event);
+        if (mouseEvent->buttons() & Qt::LeftButton) {
+            selectionBand->setGeometry(QRect(selectionOrigin, mouseEvent->position().toPoint()).normalized());
+            return true;
+        }
+        break;
+    }
+    case QEvent::MouseButtonRelease:
+        if (static_cast<QMouseEvent *>(event)->button() == Qt::LeftButton) {
+            // A click without a drag drops the selection
+            const QSize labelSize = resultLabel->size();
+            const QRect band = selectionBand->geometry();
+            const double sx = double(resultImage.width()) / labelSize.width();
+            const double sy = double(resultImage.height()) / labelSize.height();
+            selection = QRect(QPoint(int(band.left() * sx), int(band.top() * sy)),
+                              QPoint(int(std::ceil((band.right() + 1) * sx)) - 1, int(std::ceil((band.bottom() + 1) * sy)) - 1))
+                        & resultImage.rect();
+            if (band.width() < 3 || band.height() < 3 || selection.isEmpty()) {
+                clearSelection();
+            } else {
+                selectNoneAct->setEnabled(true);
+                updateSelectionBand();
+                statusBar()->showMessage(tr("Selection: %1 x %2 at %3, %4")
+                                             .arg(selection.width()).arg(selection.height())
+                                             .arg(selection.x()).arg(selection.y()));
+            }
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    return QMainWindow::eventFilter(watched, event);
 }
 
-void ImageViewer::convertToGrayScale()
+void ImageViewer::clearSelection()
 {
-    resultImage = resultImage.convertToFormat(QImage::Format_Grayscale8);
-    if (resultImage.isNull()) {
-        return;
+    selection = QRect();
+    selectionBand->hide();
+    if (selectNoneAct) {
+        selectNoneAct->setEnabled(false);
     }
-
-    for (int i = 0; i < resultImage.width(); ++i)
-    {
-        for (int j = 0; j < resultImage.height(); ++j)
-        {
-            QColor pixelColor = resultImage.pixelColor(i,j);
-            double L = 0.299*pixelColor.red() + 0.587*pixelColor.green() + 0.114*pixelColor.blue();
-            QColor gray(L,L,L);
-            resultImage.setPixelColor(i,j,gray);
-        }
-    } 
-    scale();
 }
 
-void ImageViewer::grayScaleQuantization()
+// Keeps the rubber band over the selected pixels when the view is scaled
+void ImageViewer::updateSelectionBand()
 {
-    if (resultImage.isNull()) {
+    if (selection.isEmpty() || resultImage.isNull()) {
+        selectionBand->hide();
         return;
     }
+    const double sx = double(resultLabel->width()) / resultImage.width();
+    const double sy = double(resultLabel->height()) / resultImage.height();
+    selectionBand->setGeometry(QRect(QPoint(int(selection.left() * sx), int(selection.top() * sy)),
+                                     QPoint(int((selection.right() + 1) * sx) - 1, int((selection.bottom() + 1) * sy) - 1)));
+    selectionBand->show();
+}
+
+qint64 ImageViewer::selectedPixels() const
+{
+    const QRect area = selection.isEmpty() ? resultImage.rect() : selection;
+    return qint64(area.width()) * area.height();
+}
 
-    // Ask the user for the number of levels
-    QString input = QInputDialog::getText(this, tr("Quantization"), tr("Enter the number of levels:"));
-    int n = input.toInt();
+void ImageViewer::applyToSelection(const std::function<void(QImage &)> &op)
+{
+    // The first edit after opening detaches the result from the original into a
+    // pooled buffer rather than one Qt allocates, so the copy is counted
+    if (!resultImage.isDetached())
+        resultImage = ImageBufferPool::instance().copy(resultImage);
+    applyToRegion(resultImage, selection, op);
+}
 
-    if (n <= 0) {
-        QMessageBox::warning(this, tr("Error"), tr("Number of levels must be greater than 0."));
+// Runs a neighbourhood filter from the result into a new image of format. With a
+// selection the filter reads the selection grown by halo pixels, so its reads
+// across the selection edge see the real neighbours, and only the selection is
+// written back; the cost follows the selected area.
+void ImageViewer::applyFilter(int halo, QImage::Format format, const std::function<void(const QImage &, QImage &)> &filter)
+{
+    if (selection.isEmpty()) {
+        QImage &targetImage = scratchBuffer(resultImage.width(), resultImage.height(), format);
+        filter(resultImage, targetImage);
+        commitScratch();
         return;
     }
 
-    convertToGrayScale();
+    const QRect area = selection.adjusted(-halo, -halo, halo, halo) & resultImage.rect();
+    QImage targetImage = ImageBufferPool::instance().acquire(area.width(), area.height(), format);
+    filter(ImageOps::region(std::as_const(resultImage), area), targetImage);
+    ImageOps::copyRegion(targetImage, selection.translated(-area.topLeft()), resultImage, selection.topLeft());
+}
 
-    int t1 = INT_MAX;
-    int t2 = INT_MIN;
+// Pooled buffers and the images the pool adopts: decodes, cached images and their
+// display proxies, working copies and conversions
+void ImageViewer::updateMemoryStatus()
+{
+    const ImageBufferPool &pool = ImageBufferPool::instance();
+    memoryLabel->setText(tr("Pixel memory: %1 MB (peak %2 MB, pooled %3 MB)")
+                             .arg(pool.currentBytes() / 1048576.0, 0, 'f', 1)
+                             .arg(pool.peakBytes() / 1048576.0, 0, 'f', 1)
+                             .arg(pool.cachedBytes() / 1048576.0, 0, 'f', 1));
+}
 
-    // Finds the minimum and maximum shades of gray in the image
-    for (int i = 0; i < resultImage.width(); i++) {
-        for (int j = 0; j < resultImage.height(); j++) {
-            QRgb pixel = resultImage.pixel(i, j);
-            int value = qGray(pixel);
-            if (value < t1) {
-                t1 = value;
-            }
-            if (value > t2) {
-                t2 = value;
-            }
-        }
+// Returns the second long-lived buffer, reallocating it only when the shape changes
+QImage &ImageViewer::scratchBuffer(int width, int height, QImage::Format format)
+{
+    if (scratchImage.width() != width || scratchImage.height() != height
+        || scratchImage.format() != format || !scratchImage.isDetached()) {
+        scratchImage = ImageBufferPool::instance().acquire(width, height, format);
     }
+    return scratchImage;
+}
 
-    int tam_int = t2 - t1 + 1;
+void ImageViewer::commitScratch()
+{
+    resultImage.swap(scratchImage);
+    // The previous result may still be shared with the original image
+    if (!scratchImage.isDetached())
+        scratchImage = QImage();
+}
 
-    // if the number of levels is greater than the number of shades of gray, return
-    if (n >= tam_int) return;
+void ImageViewer::finishOperation(TraceScope &trace)
+{
+    trace.finish();
+    if (selection.isEmpty()) {
+        scale();
+    } else {
+        updateResultRegion(selection);
+    }
 
-    // Calculates the size of each bin
-    float tb = (float) tam_int / n;
+    const QString message = tr("%1: %2 ms, %3 MP/s")
+                                .arg(QString::fromLatin1(trace.name()))
+                                .arg(trace.elapsed() / 1e6, 0, 'f', 1)
+                                .arg(trace.megapixelsPerSecond(), 0, 'f', 1);
+    statusBar()->showMessage(message);
+}
 
-    for (int i = 0; i < resultImage.width(); i++) {
-        for (int j = 0; j < resultImage.height(); j++) {
-            QRgb pixel = resultImage.pixel(i, j);
-            int value = qGray(pixel);
+// Runs an adjustment from a slider. While dragging, each frame applies it to a
+// display sized copy of the pre-adjustment image, so the cost per frame does not
+// depend on the image size; releasing the slider applies it at full resolution.
+void ImageViewer::adjust(const char *operation, const QString &title, const QString &label, int minimum, int maximum,
+                         int value, int divisor, const std::function<void(QImage &, int)> &apply)
+{
+    if (resultImage.isNull()) {
+        return;
+    }
 
-            int bin = (value - t1 + 0.5) / tb;
+    const QSize maxSize = maximumDisplaySize();
+    QImage proxy = resultImage;
+    if (resultImage.width() > maxSize.width() || resultImage.height() > maxSize.height()) {
+        proxy = workingImage(resultImage.scaled(maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation), highBitDepth);
+    }
 
-            int new_value = t1 - 0.5 + (bin + 0.5) * tb;
+    // With a selection only its pixels are saved and restored, so a commit costs the selected area
+    const QImage base = selection.isEmpty() ? resultImage : QImage();
+    const QImage saved = selection.isEmpty() ? QImage() : ImageOps::region(std::as_const(resultImage), selection).copy();
+    QRect proxySelection;
+    if (!selection.isEmpty()) {
+        const double sx = double(proxy.width()) / resultImage.width();
+        const double sy = double(proxy.height()) / resultImage.height();
+        proxySelection = QRect(QPoint(int(selection.left() * sx), int(selection.top() * sy)),
+                               QPoint(int((selection.right() + 1) * sx) - 1, int((selection.bottom() + 1) * sy) - 1));
+    }
 
-            resultImage.setPixel(i, j, qRgb(new_value, new_value, new_value));
+    bool committed = false;
+    int committedValue = value;
+    auto commit = [&](int newValue) {
+        TraceScope trace(operation, "op", selectedPixels());
+        if (selection.isEmpty()) {
+            resultImage = ImageBufferPool::instance().copy(base);
+        } else {
+            ImageOps::copyRegion(saved, saved.rect(), resultImage, selection.topLeft());
+        }
+        applyToSelection([&](QImage &image) { apply(image, newValue); });
+        committed = true;
+        committedValue = newValue;
+        finishOperation(trace);
+    };
+
+    AdjustmentDialog dialog(title, label, minimum, maximum, value, divisor, this);
+    connect(&dialog, &AdjustmentDialog::previewRequested, this, [&](int newValue) {
+        TraceScope trace("preview", "display", qint64(proxy.width()) * proxy.height());
+        QImage frame = ImageBufferPool::instance().copy(proxy);
+        applyToRegion(frame, proxySelection, [&](QImage &image) { apply(image, newValue); });
+        resultLabel->setPixmap(QPixmap::fromImage(ImageOps::toDisplayFormat(std::move(frame))));
+    });
+    connect(&dialog, &AdjustmentDialog::commitRequested, this, commit);
+
+    // The initial value leaves the image as it is, so OK at that value, or at the value
+    // committed last, has nothing left to apply beyond dropping the preview
+    if (dialog.exec() == QDialog::Accepted) {
+        if (committedValue != dialog.value()) {
+            commit(dialog.value());
+        } else if (!committed) {
+            scale();
         }
+    } else {
+        if (committed && selection.isEmpty()) {
+            resultImage = base;
+        } else if (committed) {
+            ImageOps::copyRegion(saved, saved.rect(), resultImage, selection.topLeft());
+        }
+        scale();
     }
-    scale();
 }
 
-
-void ImageViewer::resetImage()
+void ImageViewer::flipHorizontally()
 {
-    resultImage = image;
-    scale();
+    if (resultImage.isNull()) {
+        return;
+    }
+
+    TraceScope trace("flipHorizontally", "op", selectedPixels());
+    applyToSelection([](QImage &image) { ImageOps::flipHorizontally(image); });
+    finishOperation(trace);
 }
 
-void ImageViewer::grayScaleHistogram()
+void ImageViewer::flipVertically()
 {
     if (resultImage.isNull()) {
         return;
-    } 
-
-    int histogram[256] = {0};
-
-    QImage resultImageGray = (resultImage.format() == QImage::Format_Grayscale8) ? resultImage : resultImage.convertToFormat(QImage::Format_Grayscale8);
-
-    for (int i = 0; i < resultImageGray.width(); i++) {
-        for (int j = 0; j < resultImageGray.height(); j++) {
-            QRgb pixel = resultImageGray.pixel(i, j);
-            int value = qGray(pixel);
-            histogram[value]++;
-        }
     }
 
-    int max = *std::max_element(histogram, histogram + 256);
-
-    int histWidth = 512;
-    int histHeight = 400;
-    QImage histogramImage(histWidth, histHeight, QImage::Format_RGB32);
-    histogramImage.fill(QColor(230, 230, 230));  // Light gray background
-
-    QPainter painter(&histogramImage);
-    painter.setRenderHint(QPainter::Antialiasing);
-
-    // Set pen and brush for histogram bars
-    QPen pen(Qt::blue);  
-    painter.setPen(pen);
-    painter.setBrush(QColor(0, 120, 215)); 
+    TraceScope trace("flipVertically", "op", selectedPixels());
+    applyToSelection([](QImage &image) { ImageOps::flipVertically(image); });
+    finishOperation(trace);
+}
 
-    // Draw the histogram bars
-    for (int i = 0; i < 256; i++) {
-        int binWidth = histWidth / 256;
-        int binHeight = (histogram[i] * histHeight) / max;
-        painter.drawRect(i * binWidth, histHeight - binHeight, binWidth - 1, binHeight);
+void ImageViewer::convertToGrayScale()
+{
+    if (resultImage.isNull() || ImageOps::isGrayscale(resultImage)) {
+        return;
     }
 
-    // Add x and y axis labels
-    QFont font = painter.font();
-    font.setPointSize(10);
-    painter.setFont(font);
-
-    painter.setPen(Qt::black);
-    painter.drawText(histWidth / 2 - 20, histHeight - 10, "Pixel Value");  // X-axis label
-    painter.rotate(-90);
-    painter.drawText(-histHeight / 2 - 40, 20, "Frequency");  // Y-axis label
-    painter.resetTransform();
-
-    // Create a new window to display the histogram
-    QLabel *histogramLabel = new QLabel;
-    histogramLabel->setPixmap(QPixmap::fromImage(histogramImage));
-    histogramLabel->setAlignment(Qt::AlignCenter);
-
-    QScrollArea *scrollAreaHistogram = new QScrollArea;
-    scrollAreaHistogram->setWidget(histogramLabel);
-    scrollAreaHistogram->setAlignment(Qt::AlignCenter);
-    scrollAreaHistogram->setWidgetResizable(true);
+    TraceScope trace("convertToGrayScale", "op", selectedPixels());
 
-    QVBoxLayout *histogramLayout = new QVBoxLayout;
-    histogramLayout->addWidget(scrollAreaHistogram);
-
-    QWidget *histogramWindow = new QWidget;
-    histogramWindow->setLayout(histogramLayout);
-    histogramWindow->setWindowTitle(tr("Result Image Grayscale Histogram"));
-    histogramWindow->resize(histWidth + 50, histHeight + 50);  // Increase height to accommodate labels
-    histogramWindow->show();
+    // Writes the luminance straight into the second buffer at the current depth; a
+    // selection turns gray inside the color image
+    const QImage::Format grayFormat = ImageOps::isHighBitDepth(resultImage) ? QImage::Format_Grayscale16 : QImage::Format_Grayscale8;
+    applyFilter(0, grayFormat, [](const QImage &source, QImage &target) { ImageOps::toGrayscale(source, target); });
+    finishOperation(trace);
 }
 
-void ImageViewer::brightness()
+void ImageViewer::grayScaleQuantization()
 {
     if (resultImage.isNull()) {
         return;
     }
 
-    QString input = QInputDialog::getText(this, tr("Brightness"), tr("Enter the brightness value:\nValue must be between -255 and 255."));
-    int brightness = input.toInt();
+    const int levels = ImageOps::maxValue(resultImage) + 1;
+    adjust("grayScaleQuantization", tr("Quantization"), tr("Number of levels:"), 1, levels, levels, 1,
+           [](QImage &image, int n) {
+        toGrayscale(image);
+        // if the number of levels is greater than the number of shades of gray, nothing changes
+        ImageOps::quantize(image, n);
+    });
+}
 
-    if (brightness < -255 || brightness > 255) {
-        QMessageBox::warning(this, tr("Error"), tr("Brightness value must be between -255 and 255."));
+void ImageViewer::colorQuantization()
+{
+    if (resultImage.isNull()) {
         return;
     }
 
-    if (resultImage.format() == QImage::Format_Grayscale8) {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int value = qGray(pixel) + brightness;
-                value = std::max(0, std::min(value, 255));
-                resultImage.setPixel(i, j, qRgb(value, value, value));
-            }
-        }
-    } else {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int r = qRed(pixel) + brightness;
-                int g = qGreen(pixel) + brightness;
-                int b = qBlue(pixel) + brightness;
-
-                r = std::max(0, std::min(r, 255));
-                g = std::max(0, std::min(g, 255));
-                b = std::max(0, std::min(b, 255));
-
-                resultImage.setPixel(i, j, qRgb(r, g, b));
-            }
-        }
+    bool ok;
+    const int colors = QInputDialog::getInt(this, tr("Color Quantization"), tr("Number of colors:"), 16, 1, 256, 1, &ok);
+    if (!ok) {
+        return;
     }
-    scale();
+    const QStringList methods = {tr("Median cut"), tr("K-means")};
+    const QString method = QInputDialog::getItem(this, tr("Color Quantization"), tr("Method:"), methods, 0, false, &ok);
+    if (!ok) {
+        return;
+    }
+
+    const ImageOps::ColorQuantizer quantizer = method == methods.first() ? ImageOps::ColorQuantizer::MedianCut
+                                                                         : ImageOps::ColorQuantizer::KMeans;
+    TraceScope trace("colorQuantization", "op", selectedPixels());
+    applyToSelection([&](QImage &image) { ImageOps::quantizeColors(image, colors, quantizer); });
+    finishOperation(trace);
 }
 
-void ImageViewer::contrast()
+void ImageViewer::setHighBitDepth(bool enabled)
 {
+    highBitDepth = enabled;
     if (resultImage.isNull()) {
         return;
     }
 
-    QString input = QInputDialog::getText(this, tr("Contrast"), tr("Enter the contrast value:\nValue must be greater than 0 and less than or equal to 255."));
-    float contrast = input.toFloat();
-
-    if (contrast <= 0 || contrast > 255) {
-        QMessageBox::warning(this, tr("Error"), tr("Contrast value must be greater than 0 and less than or equal to 255."));
-        return;
-    }
+    // Switching down keeps the current edits at 8 bits; switching up only widens them
+    resultImage = workingImage(std::move(resultImage), highBitDepth);
+    scratchImage = QImage();
+    scale();
+}
 
-    if (resultImage.format() == QImage::Format_Grayscale8) {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int value = qGray(pixel) * contrast;
-                value = std::max(0, std::min(value, 255));
-                resultImage.setPixel(i, j, qRgb(value, value, value));
-            }
-        }
-    } else {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int r = qRed(pixel) * contrast;
-                int g = qGreen(pixel) * contrast;
-                int b = qBlue(pixel) * contrast;
-
-                r = std::max(0, std::min(r, 255));
-                g = std::max(0, std::min(g, 255));
-                b = std::max(0, std::min(b, 255));
-
-                resultImage.setPixel(i, j, qRgb(r, g, b));
-            }
-        }
-    }
+void ImageViewer::resetImage()
+{
+    resultImage = workingImage(image, highBitDepth);
     scale();
 }
 
+void ImageViewer::brightness()
+{
+    adjust("brightness", tr("Brightness"), tr("Brightness value:"), -255, 255, 0, 1,
+           [](QImage &image, int value) { ImageOps::brightness(image, value); });
+}
+
+void ImageViewer::contrast()
+{
+    // In hundredths, from 0.01 to 10
+    adjust("contrast", tr("Contrast"), tr("Contrast factor:"), 1, 1000, 100, 100,
+           [](QImage &image, int value) { ImageOps::contrast(image, value / 100.0f); });
+}
+
 void ImageViewer::negative() 
 {
     if (resultImage.isNull()) {
         return;
     }
 
-    if (resultImage.format() == QImage::Format_Grayscale8) {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int value = 255 - qGray(pixel);
-                resultImage.setPixel(i, j, qRgb(value, value, value));
-            }
-        }
-    } else {
-        for (int i = 0; i < resultImage.width(); i++) {
-            for (int j = 0; j < resultImage.height(); j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int r = 255 - qRed(pixel);
-                int g = 255 - qGreen(pixel);
-                int b = 255 - qBlue(pixel);
-
-                resultImage.setPixel(i, j, qRgb(r, g, b));
-            }
-        }
-    }
-    scale();
+    TraceScope trace("negative", "op", selectedPixels());
+    applyToSelection([](QImage &image) { ImageOps::negative(image); });
+    finishOperation(trace);
 }
 
 void ImageViewer::rotateLeft() 
@@ -871,21 +1197,14 @@ void ImageViewer::rotateLeft()
         return;
     }
 
-    int originalWidth = resultImage.width();
-    int originalHeight = resultImage.height();
-
-    QImage rotatedImage(originalHeight, originalWidth, resultImage.format());
-
-    for (int y = 0; y < originalHeight; ++y) {
-        for (int x = 0; x < originalWidth; ++x) {
-            QColor color = resultImage.pixelColor(x, y);
+    clearSelection();
+    TraceScope trace("rotateLeft", "op", qint64(resultImage.width()) * resultImage.height());
 
-            rotatedImage.setPixelColor(y, originalWidth - 1 - x, color);
-        }
-    }
+    QImage &rotatedImage = scratchBuffer(resultImage.height(), resultImage.width(), resultImage.format());
+    ImageOps::rotateLeft(resultImage, rotatedImage);
 
-    resultImage = rotatedImage;
-    scale();
+    commitScratch();
+    finishOperation(trace);
 }
 
 
@@ -896,21 +1215,44 @@ void ImageViewer::rotateRight()
         return;
     }
 
-    int originalWidth = resultImage.width();
-    int originalHeight = resultImage.height();
+    clearSelection();
+    TraceScope trace("rotateRight", "op", qint64(resultImage.width()) * resultImage.height());
+
+    QImage &rotatedImage = scratchBuffer(resultImage.height(), resultImage.width(), resultImage.format());
+    ImageOps::rotateRight(resultImage, rotatedImage);
 
-    QImage rotatedImage(originalHeight, originalWidth, resultImage.format());
+    commitScratch();
+    finishOperation(trace);
+}
 
-    for (int y = 0; y < originalHeight; ++y) {
-        for (int x = 0; x < originalWidth; ++x) {
-            QColor color = resultImage.pixelColor(x, y);
+void ImageViewer::adaptiveEqualization()
+{
+    if (resultImage.isNull()) {
+        return;
+    }
 
-            rotatedImage.setPixelColor(originalHeight - 1 - y, x, color);
+    bool ok;
+    const int tiles = QInputDialog::getInt(this, tr("CLAHE"), tr("Tiles per side:"), 8, 1, 64, 1, &ok);
+    if (!ok) {
+        return;
+    }
+    const double clipLimit = QInputDialog::getDouble(this, tr("CLAHE"), tr("Clip limit:"), 2.0, 1.0, 100.0, 1, &ok);
+    if (!ok) {
+        return;
+    }
+    bool luminance = false;
+    if (!ImageOps::isGrayscale(resultImage)) {
+        const QStringList modes = {tr("Luminance"), tr("Per channel")};
+        const QString mode = QInputDialog::getItem(this, tr("CLAHE"), tr("Mode:"), modes, 0, false, &ok);
+        if (!ok) {
+            return;
         }
+        luminance = mode == modes.first();
     }
 
-    resultImage = rotatedImage;
-    scale();
+    TraceScope trace("adaptiveEqualization", "op", selectedPixels());
+    applyToSelection([&](QImage &image) { ImageOps::clahe(image, tiles, tiles, float(clipLimit), luminance); });
+    finishOperation(trace);
 }
 
 void ImageViewer::histogramEqualization() {
@@ -918,220 +1260,240 @@ void ImageViewer::histogramEqualization() {
         return;
     }
 
-    int width = resultImage.width();
-    int height = resultImage.height();
-    int numPixels = width * height;
-
-    if (resultImage.format() == QImage::Format_Grayscale8) {
-        int histogram[256] = {0};
-        int cdf[256] = {0};
-        float alpha = 255.0f / numPixels;
-
-        // Histogram calculation
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                int value = qGray(resultImage.pixel(i, j));
-                histogram[value]++;
-            }
+    // Equalizing R, G and B separately shifts hues, so color images default to luma
+    ImageOps::ColorMode mode = ImageOps::ColorMode::PerChannel;
+    if (!ImageOps::isGrayscale(resultImage)) {
+        bool ok;
+        const QStringList modes = {tr("Luma (YCbCr)"), tr("Lightness (Lab)"), tr("Per channel")};
+        const QString choice = QInputDialog::getItem(this, tr("Histogram Equalization"), tr("Mode:"), modes, 0, false, &ok);
+        if (!ok) {
+            return;
         }
+        mode = choice == modes.at(0) ? ImageOps::ColorMode::Luma
+               : choice == modes.at(1) ? ImageOps::ColorMode::Lightness
+                                       : ImageOps::ColorMode::PerChannel;
+    }
 
-        // Cumulative histogram calculation (CDF)
-        cdf[0] = static_cast<int>(std::round(alpha * histogram[0]));
-        for (int i = 1; i < 256; i++) {
-            cdf[i] = cdf[i - 1] + static_cast<int>(std::round(alpha * histogram[i]));
-            cdf[i] = std::min(255, cdf[i]); // Limitando o valor entre 0 e 255
-        }
+    // With a selection the mapping comes from the statistics of the selected pixels only
+    TraceScope trace("histogramEqualization", "op", selectedPixels());
+    applyToSelection([mode](QImage &image) { ImageOps::equalize(image, mode); });
 
-        // Applying the cumulative histogram to the image
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                int value = qGray(resultImage.pixel(i, j));
-                int equalizedGray = cdf[value];
-                resultImage.setPixel(i, j, qRgb(equalizedGray, equalizedGray, equalizedGray));
-            }
-        }
+    finishOperation(trace);
+}
 
-        int histogramOriginal[256] = {0};
+void ImageViewer::grayScaleHistogramMatching()
+{
+    if (resultImage.isNull()) {
+        return;
+    }
 
-        QImage resultImageGray = image.convertToFormat(QImage::Format_Grayscale8);
+    // Ask the user for the image to be used as reference
+    const QString fileName = QFileDialog::getOpenFileName(this, tr("Open Image"), directoryPath.isEmpty() ? QDir::homePath() : directoryPath,
+                                                          tr("Images (%1)").arg(ImageLoader::nameFilters().join(QLatin1Char(' '))));
+    if (fileName.isEmpty()) {
+        return;
+    }
 
-        for (int i = 0; i < resultImageGray.width(); i++) {
-            for (int j = 0; j < resultImageGray.height(); j++) {
-                QRgb pixel = resultImageGray.pixel(i, j);
-                int value = qGray(pixel);
-                histogramOriginal[value]++;
-            }
-        }
+    QString errorString;
+    QImage referenceImage = ImageLoader::readImage(fileName, &errorString);
+    if (referenceImage.isNull()) {
+        QMessageBox::warning(this, tr("Error"), tr("Cannot load %1: %2").arg(QDir::toNativeSeparators(fileName), errorString));
+        return;
+    }
 
-        int max = *std::max_element(histogramOriginal, histogramOriginal + 256);
+    // Color images can keep their color and match only luma, lightness or each channel
+    int mode = 0;
+    if (!ImageOps::isGrayscale(resultImage)) {
+        bool ok;
+        const QStringList modes = {tr("Grayscale"), tr("Luma (YCbCr)"), tr("Lightness (Lab)"), tr("Per channel")};
+        mode = modes.indexOf(QInputDialog::getItem(this, tr("Histogram Matching"), tr("Mode:"), modes, 0, false, &ok));
+        if (!ok) {
+            return;
+        }
+    }
 
-        int histWidth = 512;
-        int histHeight = 400;
-        QImage histogramImage(histWidth, histHeight, QImage::Format_RGB32);
-        histogramImage.fill(QColor(230, 230, 230));  // Light gray background
+    // In grayscale mode both sides are matched as gray, so a selection copied back into
+    // a color image stays gray
+    referenceImage = ImageOps::toWorkingFormat(std::move(referenceImage), highBitDepth);
+    if (mode == 0) {
+        toGrayscale(referenceImage);
+    }
 
-        QPainter painter(&histogramImage);
-        painter.setRenderHint(QPainter::Antialiasing);
+    TraceScope trace("grayScaleHistogramMatching", "op", selectedPixels());
+    const ImageOps::ColorMode colorModes[] = {ImageOps::ColorMode::PerChannel, ImageOps::ColorMode::Luma,
+                                              ImageOps::ColorMode::Lightness, ImageOps::ColorMode::PerChannel};
+    applyToSelection([&](QImage &image) {
+        if (mode == 0) {
+            toGrayscale(image);
+        }
+        ImageOps::matchHistogram(image, referenceImage, colorModes[mode]);
+    });
+    finishOperation(trace);
+}
 
-        // Set pen and brush for histogram bars
-        QPen pen(Qt::blue);  
-        painter.setPen(pen);
-        painter.setBrush(QColor(0, 120, 215)); 
+void ImageViewer::compareImages()
+{
+    if (resultImage.isNull()) {
+        return;
+    }
 
-        // Draw the histogram bars
-        for (int i = 0; i < 256; i++) {
-            int binWidth = histWidth / 256;
-            int binHeight = (histogramOriginal[i] * histHeight) / max;
-            painter.drawRect(i * binWidth, histHeight - binHeight, binWidth - 1, binHeight);
-        }
+    bool ok;
+    const QStringList references = {tr("Original image"), tr("Image file...")};
+    const int choice = references.indexOf(QInputDialog::getItem(this, tr("Compare"), tr("Compare the result with:"),
+                                                                references, 0, false, &ok));
+    if (!ok) {
+        return;
+    }
 
-        // Add x and y axis labels
-        QFont font = painter.font();
-        font.setPointSize(10);
-        painter.setFont(font);
-
-        painter.setPen(Qt::black);
-        painter.drawText(histWidth / 2 - 20, histHeight - 10, "Pixel Value");  // X-axis label
-        painter.rotate(-90);
-        painter.drawText(-histHeight / 2 - 40, 20, "Frequency");  // Y-axis label
-        painter.resetTransform();
-
-        // Create a new window to display the histogram
-        QLabel *histogramLabel = new QLabel;
-        histogramLabel->setPixmap(QPixmap::fromImage(histogramImage));
-        histogramLabel->setAlignment(Qt::AlignCenter);
-
-        QScrollArea *scrollAreaHistogram = new QScrollArea;
-        scrollAreaHistogram->setWidget(histogramLabel);
-        scrollAreaHistogram->setAlignment(Qt::AlignCenter);
-        scrollAreaHistogram->setWidgetResizable(true);
-
-        QVBoxLayout *histogramLayout = new QVBoxLayout;
-        histogramLayout->addWidget(scrollAreaHistogram);
-
-        QWidget *histogramWindow = new QWidget;
-        histogramWindow->setLayout(histogramLayout);
-        histogramWindow->setWindowTitle(tr("Original Image Grayscale Histogram"));
-        histogramWindow->resize(histWidth + 50, histHeight + 50);  // Increase height to accommodate labels
-        histogramWindow->show();
-
-        grayScaleHistogram();
-
-    } else { // Color image
-        int histogramR[256] = {0};
-        int histogramG[256] = {0};
-        int histogramB[256] = {0};
-        int cdfR[256] = {0};
-        int cdfG[256] = {0};
-        int cdfB[256] = {0};
-        float alpha = 255.0f / numPixels;
-
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                histogramR[qRed(pixel)]++;
-                histogramG[qGreen(pixel)]++;
-                histogramB[qBlue(pixel)]++;
-            }
+    QImage referenceImage = image;
+    if (choice == 1) {
+        const QString fileName = QFileDialog::getOpenFileName(this, tr("Open Image"), directoryPath.isEmpty() ? QDir::homePath() : directoryPath);
+        if (fileName.isEmpty()) {
+            return;
         }
-
-        cdfR[0] = static_cast<int>(std::round(alpha * histogramR[0]));
-        cdfG[0] = static_cast<int>(std::round(alpha * histogramG[0]));
-        cdfB[0] = static_cast<int>(std::round(alpha * histogramB[0]));
-        for (int i = 1; i < 256; i++) {
-            cdfR[i] = std::min(255, cdfR[i - 1] + static_cast<int>(std::round(alpha * histogramR[i])));
-            cdfG[i] = std::min(255, cdfG[i - 1] + static_cast<int>(std::round(alpha * histogramG[i])));
-            cdfB[i] = std::min(255, cdfB[i - 1] + static_cast<int>(std::round(alpha * histogramB[i])));
+        QString errorString;
+        referenceImage = ImageLoader::readImage(fileName, &errorString);
+        if (referenceImage.isNull()) {
+            QMessageBox::warning(this, tr("Error"), tr("Cannot load %1: %2").arg(QDir::toNativeSeparators(fileName), errorString));
+            return;
         }
+    }
+    if (referenceImage.size() != resultImage.size()) {
+        QMessageBox::warning(this, tr("Compare"), tr("The images differ in size (%1x%2 and %3x%4).")
+                                                      .arg(referenceImage.width()).arg(referenceImage.height())
+                                                      .arg(resultImage.width()).arg(resultImage.height()));
+        return;
+    }
 
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                QRgb pixel = resultImage.pixel(i, j);
-                int r = cdfR[qRed(pixel)];
-                int g = cdfG[qGreen(pixel)];
-                int b = cdfB[qBlue(pixel)];
-                resultImage.setPixel(i, j, qRgb(r, g, b));
-            }
-        }
+    QImage heatmap;
+    ImageOps::Comparison comparison;
+    {
+        TraceScope trace("compare", "op", qint64(resultImage.width()) * resultImage.height());
+        comparison = ImageOps::compare(referenceImage, resultImage, &heatmap);
     }
-    scale(); 
-}
 
-void ImageViewer::grayScaleHistogramMatching()
-{
-    if (resultImage.isNull()) {
+    const QString psnr = std::isinf(comparison.psnr) ? tr("identical") : tr("%1 dB").arg(comparison.psnr, 0, 'f', 2);
+    QMessageBox box(QMessageBox::Information, tr("Compare"),
+                    tr("MSE: %1\nPSNR: %2\nSSIM: %3").arg(comparison.mse, 0, 'g', 6).arg(psnr).arg(comparison.ssim, 0, 'f', 5),
+                    QMessageBox::Close, this);
+    QPushButton *saveButton = box.addButton(tr("Save Heatmap..."), QMessageBox::ActionRole);
+    box.exec();
+    if (box.clickedButton() != saveButton) {
         return;
     }
 
-    // Ask the user for the image to be used as reference
-    QString fileName = QFileDialog::getOpenFileName(this, tr("Open Image"), QDir::homePath(), tr("Images (*.png *.jpg *.bmp)"));
+    const QString fileName = QFileDialog::getSaveFileName(this, tr("Save Heatmap"), QDir::homePath(), tr("Images (*.png *.bmp *.tif)"));
     if (fileName.isEmpty()) {
         return;
     }
+    QImageWriter writer(fileName);
+    if (!writer.write(heatmap)) {
+        QMessageBox::warning(this, tr("Error"), tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(fileName), writer.errorString()));
+    }
+}
+
+void ImageViewer::showConvWindow()
+{
+    convolutionwindow *convWindow = new convolutionwindow(this); 
+    convWindow->show();
 
-    QImage referenceImage;
-    if (!referenceImage.load(fileName)) {
-        QMessageBox::warning(this, tr("Error"), tr("Failed to load reference image."));
+    connect(convWindow, &convolutionwindow::convolution, this, &ImageViewer::convolution);
+    connect(convWindow, &convolutionwindow::rankFilter, this, &ImageViewer::rankFilter);
+    connect(convWindow, &convolutionwindow::boxBlur, this, &ImageViewer::boxBlur);
+    connect(convWindow, &convolutionwindow::gaussianBlur, this, &ImageViewer::gaussianBlur);
+    connect(convWindow, &convolutionwindow::gradient, this, &ImageViewer::gradient);
+    connect(convWindow, &convolutionwindow::morphology, this, &ImageViewer::morphology);
+}
+
+void ImageViewer::rankFilter(int radius, int percentile)
+{
+    if (resultImage.isNull()) {
         return;
     }
 
-    if (referenceImage.format() != QImage::Format_Grayscale8) {
-        referenceImage = referenceImage.convertToFormat(QImage::Format_Grayscale8);
+    TraceScope trace(percentile == 50 ? "median" : "rankFilter", "op", selectedPixels());
+
+    applyFilter(radius, resultImage.format(), [&](const QImage &source, QImage &target) {
+        ImageOps::rankFilter(source, target, radius, percentile);
+    });
+    finishOperation(trace);
+}
+
+void ImageViewer::boxBlur(int radius)
+{
+    if (resultImage.isNull()) {
+        return;
     }
 
-    int hist_src[256] = {0}, hist_target[256] = {0}, hist_src_cum[256] = {0}, hist_target_cum[256] = {0};
-    int HM[256] = {0};
+    TraceScope trace("boxBlur", "op", selectedPixels());
 
-    float alpha_target = 255.0f / (referenceImage.width() * referenceImage.height());
-    float alpha_src = 255.0f / (resultImage.width() * resultImage.height());
+    applyFilter(radius, resultImage.format(), [&](const QImage &source, QImage &target) {
+        ImageOps::boxBlur(source, target, radius);
+    });
+    finishOperation(trace);
+}
 
-    // histogram calculation 
-    for (int i = 0; i < referenceImage.width(); i++) {
-        for (int j = 0; j < referenceImage.height(); j++) {
-            int value = qGray(referenceImage.pixel(i, j));
-            hist_target[value]++;
-        }
+void ImageViewer::gaussianBlur(double sigma)
+{
+    if (resultImage.isNull()) {
+        return;
     }
 
-    for (int i = 0; i < resultImage.width(); i++) {
-        for (int j = 0; j < resultImage.height(); j++) {
-            int value = qGray(resultImage.pixel(i, j));
-            hist_src[value]++;
-        }
-    }
+    TraceScope trace("gaussianBlur", "op", selectedPixels());
 
-    // Cumulative histogram calculation
-    hist_src_cum[0] = static_cast<int>(std::round(alpha_src * hist_src[0]));
-    hist_target_cum[0] = static_cast<int>(std::round(alpha_target * hist_target[0]));
+    // The three box passes reach at most about three sigma
+    applyFilter(int(std::ceil(3 * sigma)) + 3, resultImage.format(), [&](const QImage &source, QImage &target) {
+        ImageOps::gaussianBlur(source, target, float(sigma));
+    });
+    finishOperation(trace);
+}
 
-    for (int i = 1; i < 256; i++) {
-        hist_src_cum[i] = hist_src_cum[i - 1] + static_cast<int>(std::round(alpha_src * hist_src[i]));
-        hist_target_cum[i] = hist_target_cum[i - 1] + static_cast<int>(std::round(alpha_target * hist_target[i]));
+void ImageViewer::gradient(bool sobel, bool euclidean, bool orientation)
+{
+    if (resultImage.isNull()) {
+        return;
     }
 
-    for (int i = 0; i < 256; i++) {
-        int j = 0;
-        do {
-            HM[i] = j;
-            j++;
-        } while (hist_src_cum[i] > hist_target_cum[j]);
-    }
+    TraceScope trace("gradient", "op", selectedPixels());
 
-    for (int i = 0; i < resultImage.width(); i++) {
-        for (int j = 0; j < resultImage.height(); j++) {
-            int value = qGray(resultImage.pixel(i, j));
-            resultImage.setPixel(i, j, qRgb(HM[value], HM[value], HM[value]));
-        }
+    const ImageOps::GradientOperator op = sobel ? ImageOps::GradientOperator::Sobel : ImageOps::GradientOperator::Prewitt;
+    const ImageOps::GradientNorm norm = euclidean ? ImageOps::GradientNorm::L2 : ImageOps::GradientNorm::L1;
+    const QImage::Format grayFormat = ImageOps::isHighBitDepth(resultImage) ? QImage::Format_Grayscale16 : QImage::Format_Grayscale8;
+
+    if (!orientation) {
+        applyFilter(1, grayFormat, [&](const QImage &source, QImage &target) {
+            ImageOps::gradient(source, target, nullptr, op, norm);
+        });
+    } else {
+        // Shows the direction bins as hues, darkened by the magnitude
+        applyFilter(1, QImage::Format_RGB32, [&](const QImage &source, QImage &target) {
+            ImageBufferPool &pool = ImageBufferPool::instance();
+            QImage magnitudeImage = pool.acquire(source.width(), source.height(), grayFormat);
+            QImage orientationImage = pool.acquire(source.width(), source.height(), QImage::Format_Grayscale8);
+            ImageOps::gradient(source, magnitudeImage, &orientationImage, op, norm);
+            ImageOps::colorizeOrientation(magnitudeImage, orientationImage, target);
+        });
+        resultImage = workingImage(std::move(resultImage), highBitDepth);
     }
-    scale();
+    finishOperation(trace);
 }
 
-void ImageViewer::showConvWindow() 
+void ImageViewer::morphology(ImageOps::MorphologyOperation operation, int radiusX, int radiusY)
 {
-    convolutionwindow *convWindow = new convolutionwindow(this); 
-    convWindow->show();
+    if (resultImage.isNull()) {
+        return;
+    }
 
-    connect(convWindow, &convolutionwindow::convolution, this, &ImageViewer::convolution);
+    static const char *const names[] = {"erode", "dilate", "open", "close", "topHat", "blackHat"};
+    TraceScope trace(names[int(operation)], "op", selectedPixels());
+
+    // Openings, closings and the hats read through two passes
+    const bool composite = operation != ImageOps::MorphologyOperation::Erode && operation != ImageOps::MorphologyOperation::Dilate;
+    const int halo = std::max(radiusX, radiusY) * (composite ? 2 : 1);
+    applyFilter(halo, resultImage.format(), [&](const QImage &source, QImage &target) {
+        ImageOps::morphology(source, target, operation, radiusX, radiusY);
+    });
+    finishOperation(trace);
 }
 
 void ImageViewer::convolution(const std::vector<std::vector<float>> &kernel)
@@ -1140,10 +1502,7 @@ void ImageViewer::convolution(const std::vector<std::vector<float>> &kernel)
         return;
     }
 
-    int width = resultImage.width();
-    int height = resultImage.height();
-
-    QImage tempImage = resultImage.copy();
+    TraceScope trace("convolution", "op", selectedPixels());
 
     std::vector<std::vector<float>> gaussianFilter = {
         {0.0625, 0.125, 0.0625},
@@ -1159,50 +1518,10 @@ void ImageViewer::convolution(const std::vector<std::vector<float>> &kernel)
 
     bool flag = kernel != highPassFilter && kernel != gaussianFilter;
 
-    int kernelSize = kernel.size();
-    int kernelRadius = kernelSize / 2;
-
-    if (resultImage.format() == QImage::Format_Grayscale8) {
-        for (int i = kernelRadius; i < width - kernelRadius; i++) {
-            for (int j = kernelRadius; j < height - kernelRadius; j++) {
-                float sum = 0.0f;
-                for (int k = -kernelRadius; k <= kernelRadius; k++) {
-                    for (int l = -kernelRadius; l <= kernelRadius; l++) {
-                        QRgb pixel = tempImage.pixel(i + k, j + l);
-                        sum += qGray(pixel) * kernel[k + kernelRadius][l + kernelRadius];
-                    }
-                }
-                if (flag) {
-                    sum += 127;
-                }
-                sum = std::max(0.0f, std::min(sum, 255.0f));
-                resultImage.setPixel(i, j, qRgb(sum, sum, sum));
-            }
-        }
-    } else {
-        for (int i = kernelRadius; i < width - kernelRadius; i++) {
-            for (int j = kernelRadius; j < height - kernelRadius; j++) {
-                float sumR = 0.0f, sumG = 0.0f, sumB = 0.0f;
-                for (int k = -kernelRadius; k <= kernelRadius; k++) {
-                    for (int l = -kernelRadius; l <= kernelRadius; l++) {
-                        QRgb pixel = tempImage.pixel(i + k, j + l);
-                        sumR += qRed(pixel) * kernel[k + kernelRadius][l + kernelRadius];
-                        sumG += qGreen(pixel) * kernel[k + kernelRadius][l + kernelRadius];
-                        sumB += qBlue(pixel) * kernel[k + kernelRadius][l + kernelRadius];
-                    }
-                }
-                if (flag) {
-                    sumR += 127;
-                    sumG += 127;
-                    sumB += 127;
-                }
-                sumR = std::max(0.0f, std::min(sumR, 255.0f));
-                sumG = std::max(0.0f, std::min(sumG, 255.0f));
-                sumB = std::max(0.0f, std::min(sumB, 255.0f));
-                resultImage.setPixel(i, j, qRgb(sumR, sumG, sumB));
-            }
-        }
-    }
-    scale();
+    // Reads from the current result and writes into the second buffer
+    applyFilter(int(kernel.size()) / 2, resultImage.format(), [&](const QImage &source, QImage &target) {
+        ImageOps::convolve(source, target, kernel, flag ? 127.0f : 0.0f);
+    });
+    finishOperation(trace);
 }
     
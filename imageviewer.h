@@ -1,9 +1,11 @@
 #ifndef IMAGEVIEWER_H
 #define IMAGEVIEWER_H
 
+#include "imageops.h"
 #include <QMainWindow>
 #include <QImage>
 #include <QInputDialog>
+#include <functional>
 #if defined(QT_PRINTSUPPORT_LIB)
 #  include <QtPrintSupport/qtprintsupportglobal.h>
 
@@ -16,10 +18,18 @@ QT_BEGIN_NAMESPACE
 class QAction;
 class QLabel;
 class QMenu;
+class QProgressBar;
+class QRubberBand;
 class QScrollArea;
 class QScrollBar;
 QT_END_NAMESPACE
 
+class ExportQueue;
+class HistogramDock;
+class ImageCache;
+class TraceScope;
+struct DecodedImage;
+
 //! [0]
 class ImageViewer : public QMainWindow
 {
@@ -28,13 +38,26 @@ class ImageViewer : public QMainWindow
 public:
     ImageViewer(QWidget *parent = nullptr);
     bool loadFile(const QString &);
+    bool loadFileAndWait(const QString &fileName);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
 
 public slots:
     void convolution(const  std::vector<std::vector<float>> &kernel);
+    void rankFilter(int radius, int percentile);
+    void boxBlur(int radius);
+    void gaussianBlur(double sigma);
+    void gradient(bool sobel, bool euclidean, bool orientation);
+    void morphology(ImageOps::MorphologyOperation operation, int radiusX, int radiusY);
 
 private slots:
     void open();
+    void nextImage();
+    void previousImage();
     void saveAs();
+    void exportResult();
+    void exportTrace();
     void copy();
     void paste();
     void zoomIn();
@@ -47,14 +70,34 @@ private:
     void createMenus();
     void updateActions();
     bool saveFile(const QString &fileName);
-    void setImage(const QImage &newImage);
+    void setImage(QImage newImage, QImage displayImage = QImage());
+    void clearImage();
+    void showPreview(const QImage &preview);
+    void showDisplayImage(const QImage &displayImage);
+    void exportProgress(int done, int total);
+    void exportFailed(const QString &fileName, const QString &errorString);
+    void imageLoaded(const QString &fileName, const DecodedImage &decoded);
+    void updateDirectoryListing(const QString &filePath);
     void scale();
+    QImage &scratchBuffer(int width, int height, QImage::Format format);
+    void commitScratch();
+    void finishOperation(TraceScope &trace);
+    void updateResultRegion(const QRect &rect);
+    void clearSelection();
+    void updateSelectionBand();
+    qint64 selectedPixels() const;
+    void applyToSelection(const std::function<void(QImage &)> &op);
+    void applyFilter(int halo, QImage::Format format, const std::function<void(const QImage &, QImage &)> &filter);
+    void adjust(const char *operation, const QString &title, const QString &label, int minimum, int maximum,
+                int value, int divisor, const std::function<void(QImage &, int)> &apply);
+    void updateMemoryStatus();
     void flipHorizontally();
     void flipVertically();
     void convertToGrayScale();
     void grayScaleQuantization();
-    void grayScaleHistogram();
+    void colorQuantization();
     void resetImage();
+    void setHighBitDepth(bool enabled);
     void scaleImage(double factor);
     void adjustScrollBar(QScrollBar *scrollBar, double factor);
     void brightness();
@@ -63,41 +106,66 @@ private:
     void rotateLeft();
     void rotateRight();
     void histogramEqualization();
+    void adaptiveEqualization();
     void grayScaleHistogramMatching();
     void showConvWindow();
+    void compareImages();
 
     QImage image;
     QImage resultImage;
+    QImage scratchImage;
     QLabel *imageLabel;
     QLabel *resultLabel;
     QScrollArea *scrollArea;
     QScrollArea *scrollAreaResult;
+    QLabel *memoryLabel;
+    QRubberBand *selectionBand;
+    QPoint selectionOrigin;
+    QRect selection;
+    QSize displayedSize;
     double scaleFactor = 1;
+    ImageCache *imageCache;
+    QString currentFile;
+    QString directoryPath;
+    QStringList directoryFiles;
+    int directoryIndex = -1;
+    ExportQueue *exportQueue;
+    HistogramDock *histogramDock;
+    QProgressBar *exportProgressBar;
+    QString exportSpecification = QStringLiteral("png, jpg:85, webp:80@1024");
+    bool highBitDepth = false;
 
 #if defined(QT_PRINTSUPPORT_LIB) && QT_CONFIG(printer)
     QPrinter printer;
 #endif
 
+    QAction *nextImageAct;
+    QAction *previousImageAct;
     QAction *saveAsAct;
+    QAction *exportAct;
     QAction *copyAct;
+    QAction *selectNoneAct = nullptr;
     QAction *flipHorizontallyAct;
     QAction *flipVerticallyAct;
     QAction *convertToGrayScaleAct;
     QAction *grayScaleQuantizationAct;
+    QAction *colorQuantizationAct;
     QAction *resetImageAct;
+    QAction *highBitDepthAct;
     QAction *zoomInAct;
     QAction *zoomOutAct;
     QAction *normalSizeAct;
-    QAction *histogramAct;
     QAction *brightnessAct;
     QAction *contrastAct;
     QAction *negativeAct;
     QAction *rotateLeftAct;
     QAction *rotateRightAct;
     QAction *histogramEqualizationAct;
+    QAction *adaptiveEqualizationAct;
     QAction *grayScaleHistogramMatchingAct;
     QAction *conv2dAct;
     QAction *showConvWindowAct;
+    QAction *compareAct;
 
 };
 
@@ -2,22 +2,263 @@
 
 #include <QApplication>
 #include <QCommandLineParser>
+#include <QDir>
+#include <QRegularExpression>
+#include <QScopedPointer>
+#include <QThread>
+#include <algorithm>
+#include <initializer_list>
+#include <memory>
 
+#include "batchcomparison.h"
+#include "contactsheet.h"
+#include "framesequence.h"
 #include "imageviewer.h"
+#include "operationchain.h"
+#include "processingclient.h"
+#include "processingserver.h"
+#include "resultcache.h"
+#include "tracer.h"
+
+static bool hasOption(int argc, char *argv[], std::initializer_list<const char *> options)
+{
+    for (const char *option : options) {
+        const size_t length = qstrlen(option);
+        for (int i = 1; i < argc; ++i) {
+            if (!qstrncmp(argv[i], option, length) && (argv[i][length] == '\0' || argv[i][length] == '='))
+                return true;
+        }
+    }
+    return false;
+}
+
+static int runSequence(const QCommandLineParser &commandLineParser, const QCommandLineOption &sequenceOption,
+                       const QCommandLineOption &frameSizeOption, ResultCache *resultCache)
+{
+    const QStringList arguments = commandLineParser.positionalArguments();
+    if (arguments.size() != 2) {
+        qWarning("--sequence needs an input and an output, e.g. in_%%04d.png out_%%04d.png or in.y4m out.y4m");
+        return -1;
+    }
+
+    QString errorString;
+    const OperationChain chain = OperationChain::parse(commandLineParser.value(sequenceOption), &errorString);
+    if (chain.isEmpty()) {
+        qWarning("%s. Operations: %s", qPrintable(errorString), qPrintable(OperationChain::syntax()));
+        return -1;
+    }
+
+    QSize frameSize;
+    if (commandLineParser.isSet(frameSizeOption)) {
+        static const QRegularExpression sizePattern(QStringLiteral("^(\\d+)x(\\d+)$"));
+        const QRegularExpressionMatch match = sizePattern.match(commandLineParser.value(frameSizeOption));
+        if (!match.hasMatch()) {
+            qWarning("Invalid frame size; use <width>x<height>");
+            return -1;
+        }
+        frameSize = QSize(match.captured(1).toInt(), match.captured(2).toInt());
+    }
+
+    SequenceStatistics statistics;
+    const bool ok = FrameSequence::run(arguments.at(0), arguments.at(1), chain, frameSize, resultCache, &statistics, &errorString,
+                                       [](int frames, double framesPerSecond) {
+        qInfo("%d frames, %.1f fps", frames, framesPerSecond);
+    });
+    if (!ok) {
+        qWarning("%s", qPrintable(errorString));
+        return -1;
+    }
+
+    // The busiest stage bounds the throughput
+    qInfo("%d frames in %.2f s: %.1f fps", statistics.frames, statistics.elapsed / 1e9, statistics.framesPerSecond());
+    qInfo("Busy time per frame: decode %.1f ms, process %.1f ms, encode %.1f ms",
+          statistics.decodeTime / 1e6 / statistics.frames, statistics.processTime / 1e6 / statistics.frames,
+          statistics.encodeTime / 1e6 / statistics.frames);
+    if (resultCache)
+        qInfo("%d of %d frames from the result cache", statistics.cachedFrames, statistics.frames);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-    QApplication app(argc, argv);
-    QGuiApplication::setApplicationDisplayName(ImageViewer::tr("Photochopp"));
+    // Sequence, comparison, server and client modes have no window, so they only need a core
+    // application; contact sheets draw file names, which needs fonts but no display
+    QScopedPointer<QCoreApplication> app;
+    if (hasOption(argc, argv, {"--contact-sheet"})) {
+        if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        app.reset(new QGuiApplication(argc, argv));
+    } else if (hasOption(argc, argv, {"--sequence", "--compare", "--serve", "--client", "--server-stats"})) {
+        app.reset(new QCoreApplication(argc, argv));
+    } else {
+        app.reset(new QApplication(argc, argv));
+    }
     QCommandLineParser commandLineParser;
     commandLineParser.addHelpOption();
-    commandLineParser.addPositionalArgument(ImageViewer::tr("[file]"), ImageViewer::tr("Image file to open."));
+    QCommandLineOption traceOption(QStringLiteral("trace"),
+                                   ImageViewer::tr("Write a Chrome/Perfetto trace of the session to <file> on exit."),
+                                   ImageViewer::tr("file"));
+    commandLineParser.addOption(traceOption);
+    QCommandLineOption sequenceOption(QStringLiteral("sequence"),
+                                      ImageViewer::tr("Apply <operations> to every frame of the input and write them to "
+                                                      "the output, without a window. Operations: %1.")
+                                          .arg(OperationChain::syntax()),
+                                      ImageViewer::tr("operations"));
+    commandLineParser.addOption(sequenceOption);
+    QCommandLineOption frameSizeOption(QStringLiteral("frame-size"),
+                                       ImageViewer::tr("Frame size of raw .yuv input, e.g. 1920x1080."),
+                                       ImageViewer::tr("size"));
+    commandLineParser.addOption(frameSizeOption);
+    QCommandLineOption compareOption(QStringLiteral("compare"),
+                                     ImageViewer::tr("Print MSE, PSNR and SSIM of the result images against the reference "
+                                                     "images, given as two files or two directories, without a window."));
+    commandLineParser.addOption(compareOption);
+    QCommandLineOption heatmapsOption(QStringLiteral("heatmaps"),
+                                      ImageViewer::tr("Write difference heatmaps of --compare to <directory>."),
+                                      ImageViewer::tr("directory"));
+    commandLineParser.addOption(heatmapsOption);
+    QCommandLineOption minimumPsnrOption(QStringLiteral("min-psnr"),
+                                         ImageViewer::tr("Fail --compare for pairs below <dB> PSNR."), ImageViewer::tr("dB"),
+                                         QStringLiteral("0"));
+    commandLineParser.addOption(minimumPsnrOption);
+    QCommandLineOption minimumSsimOption(QStringLiteral("min-ssim"),
+                                         ImageViewer::tr("Fail --compare for pairs below <value> SSIM."),
+                                         ImageViewer::tr("value"), QStringLiteral("-1"));
+    commandLineParser.addOption(minimumSsimOption);
+    QCommandLineOption contactSheetOption(QStringLiteral("contact-sheet"),
+                                          ImageViewer::tr("Write contact sheets of the images in the directory to <file>, "
+                                                          "numbered when there are several, without a window."),
+                                          ImageViewer::tr("file"));
+    commandLineParser.addOption(contactSheetOption);
+    QCommandLineOption thumbnailSizeOption(QStringLiteral("thumbnail-size"),
+                                           ImageViewer::tr("Largest side of the contact sheet thumbnails (default: 256)."),
+                                           ImageViewer::tr("pixels"), QStringLiteral("256"));
+    commandLineParser.addOption(thumbnailSizeOption);
+    QCommandLineOption columnsOption(QStringLiteral("columns"), ImageViewer::tr("Thumbnails per contact sheet row (default: 6)."),
+                                     ImageViewer::tr("count"), QStringLiteral("6"));
+    commandLineParser.addOption(columnsOption);
+    QCommandLineOption rowsOption(QStringLiteral("rows"), ImageViewer::tr("Rows per contact sheet (default: 5)."),
+                                  ImageViewer::tr("count"), QStringLiteral("5"));
+    commandLineParser.addOption(rowsOption);
+    QCommandLineOption thumbnailCacheOption(QStringLiteral("thumbnail-cache"),
+                                            ImageViewer::tr("Directory of the thumbnail cache, or none (default: %1).")
+                                                .arg(QDir::toNativeSeparators(ContactSheet::defaultCacheDirectory())),
+                                            ImageViewer::tr("directory"), ContactSheet::defaultCacheDirectory());
+    commandLineParser.addOption(thumbnailCacheOption);
+    QCommandLineOption thumbnailCacheSizeOption(QStringLiteral("thumbnail-cache-size"),
+                                                ImageViewer::tr("Keep up to <size> MiB of cached thumbnails (default: 256)."),
+                                                ImageViewer::tr("size"), QStringLiteral("256"));
+    commandLineParser.addOption(thumbnailCacheSizeOption);
+    QCommandLineOption serveOption(QStringLiteral("serve"),
+                                   ImageViewer::tr("Run without a window and process requests from other processes on a local socket."));
+    commandLineParser.addOption(serveOption);
+    QCommandLineOption jobsOption(QStringLiteral("jobs"),
+                                  ImageViewer::tr("Requests the server processes at once (default: half the cores)."),
+                                  ImageViewer::tr("count"));
+    commandLineParser.addOption(jobsOption);
+    QCommandLineOption socketOption(QStringLiteral("socket"),
+                                    ImageViewer::tr("Name of the server socket (default: %1).").arg(ProcessingServer::defaultName()),
+                                    ImageViewer::tr("name"), ProcessingServer::defaultName());
+    commandLineParser.addOption(socketOption);
+    QCommandLineOption clientOption(QStringLiteral("client"),
+                                    ImageViewer::tr("Send <operations> on the input to a running server and write the result to the output."),
+                                    ImageViewer::tr("operations"));
+    commandLineParser.addOption(clientOption);
+    QCommandLineOption sharedMemoryOption(QStringLiteral("shm"),
+                                          ImageViewer::tr("Pass the pixels to the server in shared memory instead of a path."));
+    commandLineParser.addOption(sharedMemoryOption);
+    QCommandLineOption repeatOption(QStringLiteral("repeat"), ImageViewer::tr("Send the client request <count> times."),
+                                    ImageViewer::tr("count"), QStringLiteral("1"));
+    commandLineParser.addOption(repeatOption);
+    QCommandLineOption serverStatsOption(QStringLiteral("server-stats"),
+                                         ImageViewer::tr("Print the queue and latency statistics of a running server."));
+    commandLineParser.addOption(serverStatsOption);
+    QCommandLineOption resultCacheOption(QStringLiteral("result-cache"),
+                                         ImageViewer::tr("Keep up to <size> MiB of --sequence and --serve results on disk and reuse "
+                                                         "them for the same source and operations."),
+                                         ImageViewer::tr("size"));
+    commandLineParser.addOption(resultCacheOption);
+    QCommandLineOption resultCacheDirectoryOption(QStringLiteral("result-cache-dir"),
+                                                  ImageViewer::tr("Directory of the result cache (default: %1).")
+                                                      .arg(QDir::toNativeSeparators(ResultCache::defaultDirectory())),
+                                                  ImageViewer::tr("directory"), ResultCache::defaultDirectory());
+    commandLineParser.addOption(resultCacheDirectoryOption);
+    commandLineParser.addPositionalArgument(ImageViewer::tr("[file]"),
+                                            ImageViewer::tr("Image file to open, the input and output of --sequence and --client, "
+                                                            "the reference and result of --compare, or the directory of --contact-sheet."));
     commandLineParser.process(QCoreApplication::arguments());
-    ImageViewer imageViewer;
-    if (!commandLineParser.positionalArguments().isEmpty()
-        && !imageViewer.loadFile(commandLineParser.positionalArguments().constFirst())) {
-        return -1;
+
+    std::unique_ptr<ResultCache> resultCache;
+    if (commandLineParser.isSet(resultCacheOption)) {
+        resultCache = std::make_unique<ResultCache>(commandLineParser.value(resultCacheDirectoryOption),
+                                                    commandLineParser.value(resultCacheOption).toLongLong() << 20);
+    }
+
+    int result = 0;
+    if (commandLineParser.isSet(sequenceOption)) {
+        result = runSequence(commandLineParser, sequenceOption, frameSizeOption, resultCache.get());
+    } else if (commandLineParser.isSet(compareOption)) {
+        const QStringList arguments = commandLineParser.positionalArguments();
+        if (arguments.size() != 2) {
+            qWarning("--compare needs a reference and a result, both files or both directories");
+            return -1;
+        }
+        result = BatchComparison::run(arguments.at(0), arguments.at(1), commandLineParser.value(heatmapsOption),
+                                      commandLineParser.value(minimumPsnrOption).toDouble(),
+                                      commandLineParser.value(minimumSsimOption).toDouble());
+    } else if (commandLineParser.isSet(contactSheetOption)) {
+        const QStringList arguments = commandLineParser.positionalArguments();
+        if (arguments.size() != 1) {
+            qWarning("--contact-sheet needs the directory of the images");
+            return -1;
+        }
+        ContactSheetOptions options;
+        options.thumbnailSize = commandLineParser.value(thumbnailSizeOption).toInt();
+        options.columns = commandLineParser.value(columnsOption).toInt();
+        options.rows = commandLineParser.value(rowsOption).toInt();
+        if (commandLineParser.value(thumbnailCacheOption) != QLatin1String("none"))
+            options.cacheDirectory = commandLineParser.value(thumbnailCacheOption);
+        options.cacheMaxBytes = commandLineParser.value(thumbnailCacheSizeOption).toLongLong() << 20;
+        result = ContactSheet::run(arguments.at(0), commandLineParser.value(contactSheetOption), options);
+    } else if (commandLineParser.isSet(serveOption)) {
+        const int jobs = commandLineParser.isSet(jobsOption) ? commandLineParser.value(jobsOption).toInt()
+                                                             : std::max(1, QThread::idealThreadCount() / 2);
+        ProcessingServer server(jobs);
+        server.setResultCache(resultCache.get());
+        QString errorString;
+        if (!server.listen(commandLineParser.value(socketOption), &errorString)) {
+            qWarning("Cannot listen on %s: %s", qPrintable(commandLineParser.value(socketOption)), qPrintable(errorString));
+            return -1;
+        }
+        result = app->exec();
+    } else if (commandLineParser.isSet(clientOption)) {
+        const QStringList arguments = commandLineParser.positionalArguments();
+        if (arguments.isEmpty() || arguments.size() > 2) {
+            qWarning("--client needs an input and optionally an output");
+            return -1;
+        }
+        result = ProcessingClient::process(commandLineParser.value(socketOption), commandLineParser.value(clientOption),
+                                           arguments.at(0), arguments.value(1), commandLineParser.isSet(sharedMemoryOption),
+                                           commandLineParser.value(repeatOption).toInt());
+    } else if (commandLineParser.isSet(serverStatsOption)) {
+        result = ProcessingClient::printStatistics(commandLineParser.value(socketOption));
+    } else {
+        QGuiApplication::setApplicationDisplayName(ImageViewer::tr("Photochopp"));
+        ImageViewer imageViewer;
+        if (!commandLineParser.positionalArguments().isEmpty()
+            && !imageViewer.loadFileAndWait(commandLineParser.positionalArguments().constFirst())) {
+            return -1;
+        }
+        imageViewer.show();
+        result = app->exec();
+    }
+
+    if (commandLineParser.isSet(traceOption)) {
+        const QString traceFile = commandLineParser.value(traceOption);
+        QString errorString;
+        if (!Tracer::instance().exportChromeTrace(traceFile, &errorString)) {
+            qWarning("Cannot write %s: %s", qPrintable(QDir::toNativeSeparators(traceFile)), qPrintable(errorString));
+        }
     }
-    imageViewer.show();
-    return app.exec();
+    return result;
 }
@@ -0,0 +1,235 @@
+#include "operationchain.h"
+#include "bufferpool.h"
+#include "imageops.h"
+#include "tracer.h"
+#include <QObject>
+#include <QStringList>
+#include <algorithm>
+#include <cmath>
+
+// Runs a kernel that writes into a second image and replaces image with the result
+static void intoTarget(QImage &image, int width, int height, QImage::Format format,
+                       const std::function<void(const QImage &, QImage &)> &op)
+{
+    QImage target = ImageBufferPool::instance().acquire(width, height, format);
+    op(image, target);
+    image = target;
+}
+
+static void intoTarget(QImage &image, const std::function<void(const QImage &, QImage &)> &op)
+{
+    intoTarget(image, image.width(), image.height(), image.format(), op);
+}
+
+static QImage::Format grayFormat(const QImage &image)
+{
+    return ImageOps::isHighBitDepth(image) ? QImage::Format_Grayscale16 : QImage::Format_Grayscale8;
+}
+
+static void toGrayscale(QImage &image)
+{
+    if (!ImageOps::isGrayscale(image))
+        intoTarget(image, image.width(), image.height(), grayFormat(image), ImageOps::toGrayscale);
+}
+
+// Arguments as the kernels get them, with floats printed exactly
+static QString canonical(const std::vector<double> &values)
+{
+    QStringList parts;
+    for (double value : values)
+        parts.append(QString::number(value, 'g', 17));
+    return parts.join('/');
+}
+
+template <typename... Values>
+static QString canonical(Values... values)
+{
+    return canonical(std::vector<double>{double(values)...});
+}
+
+QString OperationChain::syntax()
+{
+    return QStringLiteral("gray, brightness:<-255..255>, contrast:<factor>, negative, quantize:<levels>, "
+                          "colors:<2..256>[:kmeans], equalize[:luma|lightness], "
+                          "clahe[:<tiles>[:<clip limit>[:luma]]], fliph, flipv, rotl, rotr, box:<radius>, "
+                          "gaussian:<sigma>, median:<radius>, rank:<radius>:<percentile>, "
+                          "gradient[:sobel|prewitt[:l1|l2]], erode|dilate|open|close|tophat|blackhat:<radius>[:<radius y>], "
+                          "convolve:<v1/v2/...>[:<offset>]");
+}
+
+OperationChain OperationChain::parse(const QString &specification, QString *errorString)
+{
+    // In the order of ImageOps::MorphologyOperation
+    static const QStringList morphologyOperations = {QStringLiteral("erode"), QStringLiteral("dilate"), QStringLiteral("open"),
+                                                     QStringLiteral("close"), QStringLiteral("tophat"), QStringLiteral("blackhat")};
+    OperationChain chain;
+    const QStringList items = specification.split(',', Qt::SkipEmptyParts);
+    for (const QString &item : items) {
+        const QStringList parts = item.trimmed().split(':');
+        const QString name = parts.constFirst().toLower();
+        const QStringList arguments = parts.mid(1);
+
+        bool valid = true;
+        auto number = [&](int index, double fallback, double minimum, double maximum) {
+            if (index >= arguments.size())
+                return fallback;
+            bool ok = false;
+            const double value = arguments.at(index).toDouble(&ok);
+            if (!ok || value < minimum || value > maximum)
+                valid = false;
+            return value;
+        };
+        auto option = [&](int index, const QStringList &choices) {
+            if (index >= arguments.size())
+                return 0;
+            const int choice = int(choices.indexOf(arguments.at(index).toLower()));
+            if (choice < 0)
+                valid = false;
+            return std::max(choice, 0);
+        };
+
+        Step step{nullptr, {}, {}};
+        if (name == QLatin1String("gray")) {
+            step = {"gray", toGrayscale, {}};
+        } else if (name == QLatin1String("brightness")) {
+            const int value = int(number(0, 0, -255, 255));
+            step = {"brightness", [value](QImage &image) { ImageOps::brightness(image, value); }, canonical(value)};
+        } else if (name == QLatin1String("contrast")) {
+            const float factor = float(number(0, 1, 0.01, 10));
+            step = {"contrast", [factor](QImage &image) { ImageOps::contrast(image, factor); }, canonical(factor)};
+        } else if (name == QLatin1String("negative")) {
+            step = {"negative", ImageOps::negative, {}};
+        } else if (name == QLatin1String("quantize")) {
+            const int levels = int(number(0, 8, 1, 65536));
+            step = {"grayScaleQuantization", [levels](QImage &image) {
+                toGrayscale(image);
+                ImageOps::quantize(image, levels);
+            }, canonical(levels)};
+        } else if (name == QLatin1String("colors")) {
+            const int colors = int(number(0, 256, 2, 256));
+            const ImageOps::ColorQuantizer method = option(1, {QStringLiteral("mediancut"), QStringLiteral("kmeans")}) == 1
+                                                        ? ImageOps::ColorQuantizer::KMeans
+                                                        : ImageOps::ColorQuantizer::MedianCut;
+            step = {"colorQuantization", [colors, method](QImage &image) { ImageOps::quantizeColors(image, colors, method); },
+                    canonical(colors, double(method))};
+        } else if (name == QLatin1String("equalize")) {
+            static const ImageOps::ColorMode modes[] = {ImageOps::ColorMode::PerChannel, ImageOps::ColorMode::Luma,
+                                                        ImageOps::ColorMode::Lightness};
+            const ImageOps::ColorMode mode =
+                modes[option(0, {QStringLiteral("channels"), QStringLiteral("luma"), QStringLiteral("lightness")})];
+            step = {"histogramEqualization", [mode](QImage &image) { ImageOps::equalize(image, mode); }, canonical(double(mode))};
+        } else if (name == QLatin1String("clahe")) {
+            const int tiles = int(number(0, 8, 1, 64));
+            const float clipLimit = float(number(1, 2, 1, 100));
+            const bool luminance = option(2, {QStringLiteral("channels"), QStringLiteral("luma")}) == 1;
+            step = {"adaptiveEqualization", [tiles, clipLimit, luminance](QImage &image) {
+                ImageOps::clahe(image, tiles, tiles, clipLimit, luminance);
+            }, canonical(tiles, clipLimit, double(luminance))};
+        } else if (name == QLatin1String("fliph")) {
+            step = {"flipHorizontally", ImageOps::flipHorizontally, {}};
+        } else if (name == QLatin1String("flipv")) {
+            step = {"flipVertically", ImageOps::flipVertically, {}};
+        } else if (name == QLatin1String("rotl") || name == QLatin1String("rotr")) {
+            const bool left = name == QLatin1String("rotl");
+            step = {left ? "rotateLeft" : "rotateRight", [left](QImage &image) {
+                intoTarget(image, image.height(), image.width(), image.format(), left ? ImageOps::rotateLeft : ImageOps::rotateRight);
+            }, {}};
+        } else if (name == QLatin1String("box")) {
+            const int radius = int(number(0, 1, 0, 1000));
+            step = {"boxBlur", [radius](QImage &image) {
+                intoTarget(image, [radius](const QImage &source, QImage &target) { ImageOps::boxBlur(source, target, radius); });
+            }, canonical(radius)};
+        } else if (name == QLatin1String("gaussian")) {
+            const float sigma = float(number(0, 1, 0.1, 250));
+            step = {"gaussianBlur", [sigma](QImage &image) {
+                intoTarget(image, [sigma](const QImage &source, QImage &target) { ImageOps::gaussianBlur(source, target, sigma); });
+            }, canonical(sigma)};
+        } else if (name == QLatin1String("median") || name == QLatin1String("rank")) {
+            const int radius = int(number(0, 1, 1, 50));
+            const int percentile = name == QLatin1String("median") ? 50 : int(number(1, 50, 0, 100));
+            step = {percentile == 50 ? "median" : "rankFilter", [radius, percentile](QImage &image) {
+                intoTarget(image, [radius, percentile](const QImage &source, QImage &target) {
+                    ImageOps::rankFilter(source, target, radius, percentile);
+                });
+            }, canonical(radius, percentile)};
+        } else if (name == QLatin1String("gradient")) {
+            const ImageOps::GradientOperator op = option(0, {QStringLiteral("sobel"), QStringLiteral("prewitt")}) == 1
+                                                      ? ImageOps::GradientOperator::Prewitt
+                                                      : ImageOps::GradientOperator::Sobel;
+            const ImageOps::GradientNorm norm = option(1, {QStringLiteral("l1"), QStringLiteral("l2")}) == 1
+                                                    ? ImageOps::GradientNorm::L2
+                                                    : ImageOps::GradientNorm::L1;
+            step = {"gradient", [op, norm](QImage &image) {
+                intoTarget(image, image.width(), image.height(), grayFormat(image),
+                           [op, norm](const QImage &source, QImage &target) {
+                    ImageOps::gradient(source, target, nullptr, op, norm);
+                });
+            }, canonical(double(op), double(norm))};
+        } else if (morphologyOperations.contains(name)) {
+            // A radius of 0 along one axis makes the rectangle a line
+            static const char *const names[] = {"erode", "dilate", "open", "close", "topHat", "blackHat"};
+            const ImageOps::MorphologyOperation operation = ImageOps::MorphologyOperation(morphologyOperations.indexOf(name));
+            const int radiusX = int(number(0, 1, 0, 1000));
+            const int radiusY = int(number(1, radiusX, 0, 1000));
+            step = {names[int(operation)], [operation, radiusX, radiusY](QImage &image) {
+                intoTarget(image, [operation, radiusX, radiusY](const QImage &source, QImage &target) {
+                    ImageOps::morphology(source, target, operation, radiusX, radiusY);
+                });
+            }, canonical(radiusX, radiusY)};
+        } else if (name == QLatin1String("convolve")) {
+            // The values fill a square kernel row by row
+            const QStringList values = arguments.value(0).split('/', Qt::SkipEmptyParts);
+            const int size = int(std::lround(std::sqrt(double(values.size()))));
+            if (size * size != values.size() || size % 2 == 0) {
+                *errorString = QObject::tr("The kernel of \"%1\" needs an odd square number of values").arg(item.trimmed());
+                return {};
+            }
+            std::vector<std::vector<float>> kernel(size, std::vector<float>(size));
+            for (int i = 0; i < values.size(); ++i) {
+                bool ok = false;
+                kernel[i / size][i % size] = values.at(i).toFloat(&ok);
+                valid = valid && ok;
+            }
+            const float offset = float(number(1, 0, -65535, 65535));
+            std::vector<double> parameters;
+            for (const std::vector<float> &row : kernel)
+                parameters.insert(parameters.end(), row.begin(), row.end());
+            parameters.push_back(offset);
+            step = {"convolution", [kernel, offset](QImage &image) {
+                intoTarget(image, [&kernel, offset](const QImage &source, QImage &target) {
+                    ImageOps::convolve(source, target, kernel, offset);
+                });
+            }, canonical(parameters)};
+        } else {
+            *errorString = QObject::tr("Unknown operation \"%1\"").arg(name);
+            return {};
+        }
+
+        if (!valid) {
+            *errorString = QObject::tr("Invalid arguments in \"%1\"").arg(item.trimmed());
+            return {};
+        }
+        chain.steps.append(step);
+    }
+
+    if (chain.steps.isEmpty())
+        *errorString = QObject::tr("No operations given");
+    return chain;
+}
+
+QString OperationChain::recipe() const
+{
+    QStringList parts;
+    for (const Step &step : steps)
+        parts.append(step.arguments.isEmpty() ? QString::fromLatin1(step.name)
+                                              : QString::fromLatin1(step.name) + ':' + step.arguments);
+    return parts.join(QStringLiteral(", "));
+}
+
+void OperationChain::apply(QImage &image) const
+{
+    for (const Step &step : steps) {
+        TraceScope trace(step.name, "op", qint64(image.width()) * image.height());
+        step.run(image);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef OPERATIONCHAIN_H
+#define OPERATIONCHAIN_H
+
+#include <QImage>
+#include <QList>
+#include <QString>
+#include <functional>
+
+// A fixed list of editor operations for headless processing, parsed from a comma
+// separated specification such as "gray, contrast:1.2, gaussian:1.5". Arguments
+// follow the operation name after colons; convolution kernels list their values
+// row by row separated by slashes, e.g. "convolve:0/-1/0/-1/5/-1/0/-1/0".
+class OperationChain
+{
+public:
+    static OperationChain parse(const QString &specification, QString *errorString);
+    static QString syntax();
+
+    bool isEmpty() const { return steps.isEmpty(); }
+    // Steps with their parsed arguments in one canonical spelling, so specifications
+    // that differ only in case, defaults or number format give the same recipe
+    QString recipe() const;
+    // Runs every step on image, which may be replaced by one of another size or format
+    void apply(QImage &image) const;
+
+private:
+    struct Step
+    {
+        const char *name;
+        std::function<void(QImage &)> run;
+        QString arguments;
+    };
+
+    QList<Step> steps;
+};
+
+#endif // OPERATIONCHAIN_H
@@ -0,0 +1,151 @@
+#include "processingclient.h"
+#include "exportqueue.h"
+#include "imageloader.h"
+#include "imageops.h"
+#include "processingserver.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <algorithm>
+#include <cstring>
+
+static constexpr int TimeoutMs = 30000;
+
+static bool connectTo(QLocalSocket &socket, const QString &serverName)
+{
+    socket.connectToServer(serverName);
+    if (!socket.waitForConnected(TimeoutMs)) {
+        qWarning("Cannot connect to %s: %s", qPrintable(serverName), qPrintable(socket.errorString()));
+        return false;
+    }
+    return true;
+}
+
+static bool send(QLocalSocket &socket, const QJsonObject &message)
+{
+    socket.write(QJsonDocument(message).toJson(QJsonDocument::Compact) + '\n');
+    if (!socket.waitForBytesWritten(TimeoutMs)) {
+        qWarning("Cannot send the request: %s", qPrintable(socket.errorString()));
+        return false;
+    }
+    return true;
+}
+
+static bool receive(QLocalSocket &socket, QJsonObject *reply)
+{
+    while (!socket.canReadLine()) {
+        if (!socket.waitForReadyRead(TimeoutMs)) {
+            qWarning("No reply: %s", qPrintable(socket.errorString()));
+            return false;
+        }
+    }
+    *reply = QJsonDocument::fromJson(socket.readLine()).object();
+    return true;
+}
+
+int ProcessingClient::process(const QString &serverName, const QString &operations, const QString &input,
+                              const QString &output, bool sharedMemory, int repeat)
+{
+    QLocalSocket socket;
+    if (!connectTo(socket, serverName))
+        return -1;
+
+    QJsonObject request;
+    request[QStringLiteral("operations")] = operations;
+
+    // The client owns the input segment; the server maps it and may write the result into it
+    QSharedMemory segment(QStringLiteral("photochopp-client-%1").arg(QCoreApplication::applicationPid()));
+    QImage image;
+    if (sharedMemory) {
+        QString errorString;
+        image = ImageLoader::readImage(input, &errorString);
+        if (image.isNull()) {
+            qWarning("%s: %s", qPrintable(input), qPrintable(errorString));
+            return -1;
+        }
+        const bool highBitDepth = ImageOps::isHighBitDepth(image);
+        image = ImageOps::toWorkingFormat(std::move(image), highBitDepth);
+        if (!segment.create(image.sizeInBytes())) {
+            qWarning("Cannot create shared memory: %s", qPrintable(segment.errorString()));
+            return -1;
+        }
+        const QJsonObject header = ProcessingServer::imageHeader(image);
+        for (auto it = header.begin(); it != header.end(); ++it)
+            request.insert(it.key(), it.value());
+        request[QStringLiteral("shm")] = segment.key();
+    } else {
+        request[QStringLiteral("path")] = QFileInfo(input).absoluteFilePath();
+        if (!output.isEmpty())
+            request[QStringLiteral("output")] = QFileInfo(output).absoluteFilePath();
+    }
+
+    QJsonObject reply;
+    for (int i = 0; i < std::max(1, repeat); ++i) {
+        // Every round starts from the original pixels, since the server may work in place
+        if (sharedMemory)
+            std::memcpy(segment.data(), image.constBits(), size_t(image.sizeInBytes()));
+        request[QStringLiteral("id")] = i + 1;
+
+        QElapsedTimer roundTrip;
+        roundTrip.start();
+        if (!send(socket, request) || !receive(socket, &reply))
+            return -1;
+        if (reply.contains(QStringLiteral("error"))) {
+            qWarning("%s", qPrintable(reply.value(QStringLiteral("error")).toString()));
+            return -1;
+        }
+        const char *note = reply.value(QStringLiteral("cached")).toBool()    ? " (cached)"
+                           : reply.value(QStringLiteral("inPlace")).toBool() ? " (in place)"
+                                                                             : "";
+        qInfo("Request %d: %.2f ms round trip, %.2f ms waiting, %.2f ms processing%s", i + 1, roundTrip.nsecsElapsed() / 1e6,
+              reply.value(QStringLiteral("waitMs")).toDouble(), reply.value(QStringLiteral("processMs")).toDouble(), note);
+
+        if (!reply.contains(QStringLiteral("shm")) || reply.value(QStringLiteral("inPlace")).toBool())
+            continue;
+        // A result in a segment of the server is mapped, kept when it is the last one, and released
+        const QString key = reply.value(QStringLiteral("shm")).toString();
+        QSharedMemory result(key);
+        if (!result.attach(QSharedMemory::ReadOnly)) {
+            qWarning("Cannot map the result: %s", qPrintable(result.errorString()));
+            return -1;
+        }
+        if (i + 1 == std::max(1, repeat) && !output.isEmpty())
+            image = ProcessingServer::imageFromHeader(reply, static_cast<uchar *>(result.data()), result.size()).copy();
+        QJsonObject release;
+        release[QStringLiteral("release")] = key;
+        if (!send(socket, release))
+            return -1;
+    }
+
+    if (sharedMemory && !output.isEmpty()) {
+        if (reply.value(QStringLiteral("inPlace")).toBool())
+            image = ProcessingServer::imageFromHeader(reply, static_cast<uchar *>(segment.data()), segment.size()).copy();
+        ExportTarget target;
+        target.fileName = output;
+        target.format = QFileInfo(output).suffix().toLower().toLatin1();
+        QString errorString;
+        if (!ExportQueue::write(image, target, &errorString)) {
+            qWarning("%s: %s", qPrintable(output), qPrintable(errorString));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ProcessingClient::printStatistics(const QString &serverName)
+{
+    QLocalSocket socket;
+    if (!connectTo(socket, serverName))
+        return -1;
+    QJsonObject request;
+    request[QStringLiteral("stats")] = true;
+    QJsonObject reply;
+    if (!send(socket, request) || !receive(socket, &reply))
+        return -1;
+    qInfo("%s", QJsonDocument(reply).toJson(QJsonDocument::Indented).constData());
+    return 0;
+}
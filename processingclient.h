@@ -0,0 +1,19 @@
+#ifndef PROCESSINGCLIENT_H
+#define PROCESSINGCLIENT_H
+
+#include <QString>
+
+// Command line client of the processing server, to try it without other tools.
+// Both functions print what the server replied and return an exit code.
+namespace ProcessingClient {
+
+// Sends input by path, or its pixels in a shared memory segment, and writes the
+// result to output when one is given; repeat sends the same request again to
+// measure warm round trips
+int process(const QString &serverName, const QString &operations, const QString &input, const QString &output,
+            bool sharedMemory, int repeat);
+int printStatistics(const QString &serverName);
+
+}
+
+#endif // PROCESSINGCLIENT_H
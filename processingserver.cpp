@@ -0,0 +1,265 @@
+#include "processingserver.h"
+#include "exportqueue.h"
+#include "imageloader.h"
+#include "imageops.h"
+#include "operationchain.h"
+#include "resultcache.h"
+#include "tracer.h"
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QSharedMemory>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+
+// A request line longer than this is not JSON from our client
+static constexpr qint64 MaxRequestBytes = 1 << 20;
+
+static std::atomic<int> segmentCounter{0};
+
+ProcessingServer::ProcessingServer(int maxJobs, QObject *parent)
+    : QObject(parent)
+{
+    workers.setMaxThreadCount(std::max(1, maxJobs));
+    clock.start();
+    connect(&server, &QLocalServer::newConnection, this, &ProcessingServer::newConnection);
+}
+
+ProcessingServer::~ProcessingServer()
+{
+    workers.waitForDone();
+}
+
+QString ProcessingServer::defaultName()
+{
+    return QStringLiteral("photochopp");
+}
+
+bool ProcessingServer::listen(const QString &name, QString *errorString)
+{
+    // A server that crashed leaves its socket file behind
+    QLocalServer::removeServer(name);
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server.listen(name)) {
+        *errorString = server.errorString();
+        return false;
+    }
+    qInfo("Listening on %s with up to %d concurrent requests", qPrintable(server.fullServerName()), workers.maxThreadCount());
+    return true;
+}
+
+QJsonObject ProcessingServer::imageHeader(const QImage &image)
+{
+    QJsonObject header;
+    header[QStringLiteral("width")] = image.width();
+    header[QStringLiteral("height")] = image.height();
+    header[QStringLiteral("bytesPerLine")] = qint64(image.bytesPerLine());
+    header[QStringLiteral("format")] = int(image.format());
+    return header;
+}
+
+QImage ProcessingServer::imageFromHeader(const QJsonObject &header, uchar *data, qsizetype size)
+{
+    const int width = header.value(QStringLiteral("width")).toInt();
+    const int height = header.value(QStringLiteral("height")).toInt();
+    const qint64 bytesPerLine = header.value(QStringLiteral("bytesPerLine")).toInteger();
+    const int format = header.value(QStringLiteral("format")).toInt();
+    if (!data || width <= 0 || height <= 0 || format <= QImage::Format_Invalid || format >= QImage::NImageFormats)
+        return QImage();
+    const QImage::Format imageFormat = QImage::Format(format);
+    if (bytesPerLine < (qint64(width) * QImage::toPixelFormat(imageFormat).bitsPerPixel() + 7) / 8
+        || bytesPerLine * height > size)
+        return QImage();
+    return QImage(data, width, height, qsizetype(bytesPerLine), imageFormat);
+}
+
+void ProcessingServer::newConnection()
+{
+    while (QLocalSocket *socket = server.nextPendingConnection()) {
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { readRequests(socket); });
+        connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+            segments.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void ProcessingServer::readRequests(QLocalSocket *socket)
+{
+    while (socket->canReadLine()) {
+        QJsonParseError parseError;
+        const QJsonDocument document = QJsonDocument::fromJson(socket->readLine(), &parseError);
+        const QJsonObject request = document.object();
+        if (parseError.error != QJsonParseError::NoError || !document.isObject()) {
+            QJsonObject reply;
+            reply[QStringLiteral("error")] = tr("Invalid request: %1").arg(parseError.errorString());
+            socket->write(QJsonDocument(reply).toJson(QJsonDocument::Compact) + '\n');
+        } else if (request.contains(QStringLiteral("release"))) {
+            const QString key = request.value(QStringLiteral("release")).toString();
+            QList<std::shared_ptr<QSharedMemory>> &owned = segments[socket];
+            owned.erase(std::remove_if(owned.begin(), owned.end(),
+                                       [&key](const std::shared_ptr<QSharedMemory> &segment) { return segment->key() == key; }),
+                        owned.end());
+        } else if (request.contains(QStringLiteral("stats"))) {
+            socket->write(QJsonDocument(statistics()).toJson(QJsonDocument::Compact) + '\n');
+        } else {
+            submit(socket, request);
+        }
+    }
+    if (socket->bytesAvailable() > MaxRequestBytes)
+        socket->abort();
+}
+
+void ProcessingServer::submit(QLocalSocket *socket, const QJsonObject &request)
+{
+    const qint64 submitted = clock.nsecsElapsed();
+    peakQueued = std::max(peakQueued, ++queued);
+    updateQueueCounters();
+
+    QPointer<QLocalSocket> client(socket);
+    QFutureWatcher<Result> *watcher = new QFutureWatcher<Result>(this);
+    connect(watcher, &QFutureWatcher<Result>::finished, this, [this, watcher, client, submitted]() {
+        watcher->deleteLater();
+        const Result result = watcher->result();
+        --running;
+        updateQueueCounters();
+        if (result.reply.contains(QStringLiteral("error")))
+            ++failed;
+        else
+            ++completed;
+        totalLatency += clock.nsecsElapsed() - submitted;
+        totalWait += qint64(result.reply.value(QStringLiteral("waitMs")).toDouble() * 1e6);
+
+        // A client that went away drops its result with the last reference
+        if (!client || client->state() != QLocalSocket::ConnectedState)
+            return;
+        if (result.segment)
+            segments[client].append(result.segment);
+        client->write(QJsonDocument(result.reply).toJson(QJsonDocument::Compact) + '\n');
+    });
+    watcher->setFuture(QtConcurrent::run(&workers, [this, request, submitted]() {
+        --queued;
+        ++running;
+        updateQueueCounters();
+        return process(request, submitted);
+    }));
+}
+
+// Runs on a worker thread
+ProcessingServer::Result ProcessingServer::process(const QJsonObject &request, qint64 submitted)
+{
+    const qint64 started = clock.nsecsElapsed();
+    Result result;
+    QJsonObject &reply = result.reply;
+    if (request.contains(QStringLiteral("id")))
+        reply[QStringLiteral("id")] = request.value(QStringLiteral("id"));
+    reply[QStringLiteral("waitMs")] = (started - submitted) / 1e6;
+    auto fail = [&result](const QString &errorString) {
+        result.reply[QStringLiteral("error")] = errorString;
+        return result;
+    };
+
+    QString errorString;
+    const OperationChain chain = OperationChain::parse(request.value(QStringLiteral("operations")).toString(), &errorString);
+    if (chain.isEmpty())
+        return fail(errorString);
+
+    // The input segment stays attached until the reply is built, and the image over it goes first
+    std::unique_ptr<QSharedMemory> input;
+    QImage image;
+    const QString path = request.value(QStringLiteral("path")).toString();
+    if (request.contains(QStringLiteral("shm"))) {
+        input = std::make_unique<QSharedMemory>(request.value(QStringLiteral("shm")).toString());
+        if (!input->attach())
+            return fail(input->errorString());
+        image = imageFromHeader(request, static_cast<uchar *>(input->data()), input->size());
+        if (image.isNull())
+            return fail(tr("The image header does not match the shared memory segment"));
+    }
+
+    // A cached result replaces the decode of a file as well as the processing
+    QByteArray cacheKey;
+    QImage cached;
+    if (resultCache) {
+        cacheKey = input ? ResultCache::imageKey(image, chain.recipe()) : ResultCache::fileKey(path, chain.recipe());
+        cached = resultCache->find(cacheKey);
+    }
+
+    const uchar *inputPixels = image.constBits();
+    if (!cached.isNull()) {
+        image = cached;
+        reply[QStringLiteral("cached")] = true;
+    } else {
+        if (!input) {
+            TraceScope trace("decode", "io");
+            image = ImageLoader::readImage(path, &errorString);
+            if (image.isNull())
+                return fail(QStringLiteral("%1: %2").arg(path, errorString));
+            trace.setPixels(qint64(image.width()) * image.height());
+        }
+        const bool highBitDepth = ImageOps::isHighBitDepth(image);
+        image = ImageOps::toWorkingFormat(std::move(image), highBitDepth);
+        chain.apply(image);
+        if (resultCache)
+            resultCache->insert(cacheKey, image);
+    }
+    reply[QStringLiteral("processMs")] = (clock.nsecsElapsed() - started) / 1e6;
+
+    if (request.contains(QStringLiteral("output"))) {
+        ExportTarget target;
+        target.fileName = request.value(QStringLiteral("output")).toString();
+        target.format = QFileInfo(target.fileName).suffix().toLower().toLatin1();
+        if (!ExportQueue::write(image, target, &errorString))
+            return fail(errorString);
+        reply[QStringLiteral("output")] = target.fileName;
+    } else if (input && image.constBits() == inputPixels) {
+        // Every step worked in place, so the result is already in the client's segment
+        reply[QStringLiteral("shm")] = input->key();
+        reply[QStringLiteral("inPlace")] = true;
+    } else {
+        TraceScope trace("resultSegment", "io", qint64(image.width()) * image.height());
+        const QString key = QStringLiteral("photochopp-%1-%2").arg(QCoreApplication::applicationPid()).arg(++segmentCounter);
+        result.segment = std::make_shared<QSharedMemory>(key);
+        if (!result.segment->create(image.sizeInBytes()))
+            return fail(result.segment->errorString());
+        std::memcpy(result.segment->data(), image.constBits(), size_t(image.sizeInBytes()));
+        reply[QStringLiteral("shm")] = key;
+    }
+
+    if (reply.contains(QStringLiteral("shm"))) {
+        const QJsonObject header = imageHeader(image);
+        for (auto it = header.begin(); it != header.end(); ++it)
+            reply.insert(it.key(), it.value());
+    }
+    return result;
+}
+
+QJsonObject ProcessingServer::statistics() const
+{
+    const qint64 finished = completed + failed;
+    QJsonObject stats;
+    stats[QStringLiteral("queued")] = queued.load();
+    stats[QStringLiteral("running")] = running.load();
+    stats[QStringLiteral("peakQueued")] = peakQueued;
+    stats[QStringLiteral("maxJobs")] = workers.maxThreadCount();
+    stats[QStringLiteral("completed")] = completed;
+    stats[QStringLiteral("failed")] = failed;
+    stats[QStringLiteral("meanLatencyMs")] = finished ? totalLatency / 1e6 / finished : 0.0;
+    stats[QStringLiteral("meanWaitMs")] = finished ? totalWait / 1e6 / finished : 0.0;
+    stats[QStringLiteral("uptimeS")] = clock.elapsed() / 1000.0;
+    if (resultCache) {
+        stats[QStringLiteral("cacheHits")] = resultCache->hits();
+        stats[QStringLiteral("cacheMisses")] = resultCache->misses();
+    }
+    return stats;
+}
+
+void ProcessingServer::updateQueueCounters()
+{
+    Tracer::instance().counter("queuedRequests", queued.load());
+    Tracer::instance().counter("runningRequests", running.load());
+}
@@ -0,0 +1,78 @@
+#ifndef PROCESSINGSERVER_H
+#define PROCESSINGSERVER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QImage>
+#include <QJsonObject>
+#include <QList>
+#include <QLocalServer>
+#include <QObject>
+#include <QThreadPool>
+#include <atomic>
+#include <memory>
+
+class QLocalSocket;
+class QSharedMemory;
+class ResultCache;
+
+// Keeps the kernels, codecs and thread pools warm for other processes. Requests
+// are lines of JSON on a local socket (a Unix domain socket on Linux):
+//
+//   {"id": 1, "operations": "gray, box:2", "path": "in.png", "output": "out.png"}
+//   {"id": 2, "operations": "negative", "shm": "<key>", "width": 640, "height": 480,
+//    "bytesPerLine": 2560, "format": 4}
+//   {"release": "<key>"}
+//   {"stats": true}
+//
+// Pixels in a shared memory segment of the client are processed where they are.
+// A result that no longer fits that segment, or one of a path request without an
+// output file, comes back in a new segment that the client maps and then releases.
+// At most maxJobs requests run at once; the others wait in a queue.
+class ProcessingServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ProcessingServer(int maxJobs, QObject *parent = nullptr);
+    ~ProcessingServer();
+
+    static QString defaultName();
+    bool listen(const QString &name, QString *errorString);
+    // Results of sources and recipes seen before come from the cache
+    void setResultCache(ResultCache *cache) { resultCache = cache; }
+
+    // Geometry of an image in shared memory, and an image over such memory without a copy
+    static QJsonObject imageHeader(const QImage &image);
+    static QImage imageFromHeader(const QJsonObject &header, uchar *data, qsizetype size);
+
+private:
+    struct Result
+    {
+        QJsonObject reply;
+        std::shared_ptr<QSharedMemory> segment;
+    };
+
+    void newConnection();
+    void readRequests(QLocalSocket *socket);
+    void submit(QLocalSocket *socket, const QJsonObject &request);
+    Result process(const QJsonObject &request, qint64 submitted);
+    QJsonObject statistics() const;
+    void updateQueueCounters();
+
+    QLocalServer server;
+    QThreadPool workers;
+    ResultCache *resultCache = nullptr;
+    QElapsedTimer clock;
+    // Result segments stay mapped until their client releases them or disconnects
+    QHash<QLocalSocket *, QList<std::shared_ptr<QSharedMemory>>> segments;
+    std::atomic<int> queued{0};
+    std::atomic<int> running{0};
+    int peakQueued = 0;
+    qint64 completed = 0;
+    qint64 failed = 0;
+    qint64 totalLatency = 0;
+    qint64 totalWait = 0;
+};
+
+#endif // PROCESSINGSERVER_H
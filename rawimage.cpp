@@ -0,0 +1,165 @@
+#include "rawimage.h"
+#include "tracer.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTransform>
+#include <climits>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+constexpr char Magic[8] = {'P', 'C', 'R', 'A', 'W', '\r', '\n', '\x1a'};
+constexpr quint32 ByteOrderMark = 0x01020304;
+constexpr quint32 Version = 1;
+// The rows start on a page, so the mapped pixels are aligned for any vector width
+constexpr qint64 DataOffset = 4096;
+constexpr qint64 RowAlignment = 64;
+
+struct Header
+{
+    char magic[8];
+    quint32 byteOrder;
+    quint32 version;
+    quint32 width;
+    quint32 height;
+    quint64 bytesPerLine;
+    quint32 format;
+    quint32 orientation;
+    quint64 recipeHash;
+    quint64 dataOffset;
+    quint64 reserved;
+};
+static_assert(sizeof(Header) == 64, "the header layout is part of the file format");
+
+// Same order as QImageReader's auto transform: mirror and flip, then turn clockwise
+QImage oriented(QImage image, QImageIOHandler::Transformations orientation)
+{
+    const bool mirror = orientation.testFlag(QImageIOHandler::TransformationMirror);
+    const bool flip = orientation.testFlag(QImageIOHandler::TransformationFlip);
+    if (mirror || flip)
+        image = image.mirrored(mirror, flip);
+    if (orientation.testFlag(QImageIOHandler::TransformationRotate90))
+        image = image.transformed(QTransform().rotate(90));
+    return image;
+}
+
+// The image owns the file, and the mapping goes with it
+void closeMapping(void *file)
+{
+    delete static_cast<QFile *>(file);
+}
+
+} // namespace
+
+QByteArray RawImage::formatName()
+{
+    return QByteArrayLiteral("pcraw");
+}
+
+bool RawImage::isRawFile(const QString &fileName)
+{
+    return QFileInfo(fileName).suffix().toLower().toLatin1() == formatName();
+}
+
+QImage RawImage::read(const QString &fileName, QString *errorString, quint64 *recipeHash)
+{
+    TraceScope trace("map", "io");
+    auto file = std::make_unique<QFile>(fileName);
+    if (!file->open(QIODevice::ReadOnly)) {
+        *errorString = file->errorString();
+        return QImage();
+    }
+    const qint64 size = file->size();
+    Header header;
+    if (size < DataOffset || file->read(reinterpret_cast<char *>(&header), sizeof(header)) != qint64(sizeof(header))
+        || std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+        *errorString = QObject::tr("Not a Photochopp raw image");
+        return QImage();
+    }
+    if (header.byteOrder != ByteOrderMark || header.version != Version) {
+        *errorString = QObject::tr("Raw image of another version or byte order");
+        return QImage();
+    }
+
+    // The pixels are bounded by dividing the room after the offset, since a damaged
+    // stride times the height can wrap around to a size that fits
+    const int format = int(header.format);
+    if (header.width == 0 || header.height == 0 || header.width > INT_MAX || header.height > INT_MAX
+        || format <= QImage::Format_Indexed8 || format >= QImage::NImageFormats
+        || header.dataOffset % RowAlignment != 0 || header.bytesPerLine % RowAlignment != 0
+        || header.bytesPerLine > INT_MAX
+        || header.bytesPerLine < (quint64(header.width) * QImage::toPixelFormat(QImage::Format(format)).bitsPerPixel() + 7) / 8
+        || header.dataOffset > quint64(size)
+        || header.bytesPerLine > (quint64(size) - header.dataOffset) / header.height) {
+        *errorString = QObject::tr("The raw image header is damaged");
+        return QImage();
+    }
+
+    uchar *pixels = file->map(qint64(header.dataOffset), qint64(header.bytesPerLine * header.height), QFileDevice::MapPrivateOption);
+    if (!pixels) {
+        *errorString = file->errorString();
+        return QImage();
+    }
+    QFile *owner = file.release();
+    QImage image(pixels, int(header.width), int(header.height), qsizetype(header.bytesPerLine), QImage::Format(format),
+                 closeMapping, owner);
+    trace.setPixels(qint64(image.width()) * image.height());
+    if (recipeHash)
+        *recipeHash = header.recipeHash;
+    return oriented(std::move(image), QImageIOHandler::Transformations::fromInt(int(header.orientation)));
+}
+
+bool RawImage::write(const QImage &image, const QString &fileName, QString *errorString, quint64 recipeHash,
+                     QImageIOHandler::Transformations orientation)
+{
+    TraceScope trace("writeRaw", "io", qint64(image.width()) * image.height());
+    if (image.isNull()) {
+        *errorString = QObject::tr("The image is empty");
+        return false;
+    }
+    // There is no room for a color table, so indexed and 1-bit images are stored expanded
+    if (image.format() <= QImage::Format_Indexed8) {
+        return write(image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32), fileName,
+                     errorString, recipeHash, orientation);
+    }
+    const qint64 rowBytes = (qint64(image.width()) * image.depth() + 7) / 8;
+    const qint64 bytesPerLine = (rowBytes + RowAlignment - 1) / RowAlignment * RowAlignment;
+
+    QByteArray head(DataOffset, '\0');
+    Header *header = reinterpret_cast<Header *>(head.data());
+    std::memcpy(header->magic, Magic, sizeof(Magic));
+    header->byteOrder = ByteOrderMark;
+    header->version = Version;
+    header->width = quint32(image.width());
+    header->height = quint32(image.height());
+    header->bytesPerLine = quint64(bytesPerLine);
+    header->format = quint32(image.format());
+    header->orientation = quint32(orientation.toInt());
+    header->recipeHash = recipeHash;
+    header->dataOffset = quint64(DataOffset);
+
+    // A new file replaces the old one, whose pages other images may still have mapped
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        *errorString = file.errorString();
+        return false;
+    }
+    bool ok = file.write(head) == head.size();
+    if (image.bytesPerLine() == bytesPerLine) {
+        ok = ok && file.write(reinterpret_cast<const char *>(image.constBits()), image.sizeInBytes()) == image.sizeInBytes();
+    } else {
+        // Rows of other strides are padded one by one; the file buffer keeps the writes sequential
+        const QByteArray padding(bytesPerLine - rowBytes, '\0');
+        for (int y = 0; ok && y < image.height(); ++y) {
+            ok = file.write(reinterpret_cast<const char *>(image.constScanLine(y)), rowBytes) == rowBytes
+                 && file.write(padding) == padding.size();
+        }
+    }
+    if (!ok || !file.commit()) {
+        *errorString = file.errorString();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef RAWIMAGE_H
+#define RAWIMAGE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QImageIOHandler>
+#include <QString>
+
+// Uncompressed intermediate format (.pcraw) for hand-offs between pipeline stages.
+// A 4 KiB header holds the geometry, the QImage format, the orientation still to
+// apply and the hash of the recipe that made the pixels; the rows follow, each
+// starting on a 64-byte boundary. Pixels are in sRGB and in the byte order of the
+// machine that wrote them, which the header records. Indexed images are stored
+// expanded to 32 bits.
+namespace RawImage {
+
+QByteArray formatName();
+bool isRawFile(const QString &fileName);
+
+// Maps the file and wraps its pixels without a copy; the mapping is private, so
+// edits of the image copy the pages they touch and never reach the file. Only an
+// orientation other than none costs a copy.
+QImage read(const QString &fileName, QString *errorString, quint64 *recipeHash = nullptr);
+// Replaces fileName atomically, so images still mapped from the old file stay intact
+bool write(const QImage &image, const QString &fileName, QString *errorString, quint64 recipeHash = 0,
+           QImageIOHandler::Transformations orientation = QImageIOHandler::TransformationNone);
+
+}
+
+#endif // RAWIMAGE_H
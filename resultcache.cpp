@@ -0,0 +1,128 @@
+#include "resultcache.h"
+#include "rawimage.h"
+#include "tracer.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cstring>
+
+// Part of every key, so results of older kernels are never mistaken for current ones
+static const QByteArray KeyVersion = QByteArrayLiteral("photochopp-result-1\n");
+
+// The first eight bytes of the key also go into the file header as the recipe hash
+static quint64 recipeHash(const QByteArray &key)
+{
+    quint64 hash = 0;
+    std::memcpy(&hash, key.constData(), std::min(sizeof(hash), size_t(key.size())));
+    return hash;
+}
+
+ResultCache::ResultCache(const QString &directory, qint64 maxBytes)
+    : directory(directory), maxBytes(maxBytes)
+{
+    QDir().mkpath(directory);
+    QMutexLocker locker(&mutex);
+    evict();
+}
+
+QString ResultCache::defaultDirectory()
+{
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath(QStringLiteral("results"));
+}
+
+QByteArray ResultCache::fileKey(const QString &fileName, const QString &recipe)
+{
+    TraceScope trace("hashSource", "io");
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(KeyVersion);
+    hash.addData(recipe.toUtf8() + '\n');
+    if (!hash.addData(&file))
+        return QByteArray();
+    return hash.result();
+}
+
+QByteArray ResultCache::imageKey(const QImage &image, const QString &recipe)
+{
+    TraceScope trace("hashSource", "op", qint64(image.width()) * image.height());
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(KeyVersion);
+    hash.addData(recipe.toUtf8() + '\n');
+    hash.addData(QByteArray::number(image.width()) + 'x' + QByteArray::number(image.height()) + ':'
+                 + QByteArray::number(int(image.format())) + '\n');
+    // Only the pixels count, not the padding at the end of the rows
+    const qsizetype rowBytes = (qsizetype(image.width()) * image.depth() + 7) / 8;
+    for (int y = 0; y < image.height(); ++y)
+        hash.addData(QByteArrayView(image.constScanLine(y), rowBytes));
+    return hash.result();
+}
+
+QImage ResultCache::find(const QByteArray &key)
+{
+    if (key.isEmpty())
+        return QImage();
+    const QString path = fileName(key);
+    if (!QFileInfo::exists(path)) {
+        ++missCount;
+        return QImage();
+    }
+    QString errorString;
+    quint64 storedHash = 0;
+    QImage image = RawImage::read(path, &errorString, &storedHash);
+    if (image.isNull() || storedHash != recipeHash(key)) {
+        ++missCount;
+        return QImage();
+    }
+    ++hitCount;
+
+    // The modification time orders the eviction, so a hit makes the file the newest
+    QFile file(path);
+    if (file.open(QIODevice::ReadWrite))
+        file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+    return image;
+}
+
+void ResultCache::insert(const QByteArray &key, const QImage &image)
+{
+    if (key.isEmpty() || image.isNull())
+        return;
+    QString errorString;
+    if (!RawImage::write(image, fileName(key), &errorString, recipeHash(key))) {
+        qWarning("Cannot cache the result: %s", qPrintable(errorString));
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    totalBytes += QFileInfo(fileName(key)).size();
+    if (totalBytes > maxBytes)
+        evict();
+}
+
+QString ResultCache::fileName(const QByteArray &key) const
+{
+    return QDir(directory).filePath(QString::fromLatin1(key.toHex()) + '.' + QString::fromLatin1(RawImage::formatName()));
+}
+
+// Called with the mutex held. The directory is listed again each time, since other
+// processes may have added or removed results since the last count.
+void ResultCache::evict()
+{
+    TraceScope trace("evictResults", "io");
+    const QFileInfoList entries = QDir(directory).entryInfoList({QStringLiteral("*.") + QString::fromLatin1(RawImage::formatName())},
+                                                                QDir::Files, QDir::Time | QDir::Reversed);
+    totalBytes = 0;
+    for (const QFileInfo &entry : entries)
+        totalBytes += entry.size();
+    // Oldest first; a mapped result stays readable after its file is removed
+    for (const QFileInfo &entry : entries) {
+        if (totalBytes <= maxBytes)
+            break;
+        if (QFile::remove(entry.filePath()))
+            totalBytes -= entry.size();
+    }
+}
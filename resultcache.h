@@ -0,0 +1,46 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+
+// Persistent cache of processed images, addressed by the content of the source and
+// the recipe applied to it, so renamed or copied sources still hit and an edited one
+// misses. Results are .pcraw files: a hit is mapped, with neither a decode of the
+// source nor any processing. The least recently used results are removed once the
+// cache grows past its cap. Several threads, and processes, may share a directory.
+class ResultCache
+{
+public:
+    ResultCache(const QString &directory, qint64 maxBytes);
+
+    static QString defaultDirectory();
+    // Key of an encoded source file, hashed as it is stored without decoding it; empty
+    // when the file cannot be read
+    static QByteArray fileKey(const QString &fileName, const QString &recipe);
+    // Key of source pixels that are already decoded
+    static QByteArray imageKey(const QImage &image, const QString &recipe);
+
+    // A null image on a miss; hits count as a use for the eviction order
+    QImage find(const QByteArray &key);
+    void insert(const QByteArray &key, const QImage &image);
+
+    qint64 hits() const { return hitCount; }
+    qint64 misses() const { return missCount; }
+
+private:
+    QString fileName(const QByteArray &key) const;
+    void evict();
+
+    QString directory;
+    qint64 maxBytes;
+    QMutex mutex;
+    qint64 totalBytes = 0;
+    std::atomic<qint64> hitCount{0};
+    std::atomic<qint64> missCount{0};
+};
+
+#endif // RESULTCACHE_H
@@ -0,0 +1,139 @@
+#include "tracer.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+static int currentTraceThread()
+{
+    static std::atomic<int> nextThread{1};
+    thread_local int thread = nextThread.fetch_add(1);
+    return thread;
+}
+
+Tracer &Tracer::instance()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer()
+    : ring(new Slot[Capacity])
+{
+    clock.start();
+}
+
+void Tracer::record(const char *name, const char *category, qint64 start, qint64 duration, qint64 pixels)
+{
+    TraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.start = start;
+    event.duration = duration;
+    event.value = pixels;
+    append(event);
+}
+
+void Tracer::counter(const char *name, qint64 value)
+{
+    TraceEvent event;
+    event.name = name;
+    event.category = "memory";
+    event.phase = 'C';
+    event.start = now();
+    event.value = value;
+    append(event);
+}
+
+void Tracer::append(const TraceEvent &event)
+{
+    const quint64 sequence = next.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = ring[sequence % Capacity];
+
+    // Readers skip a slot whose sequence changes while they copy it
+    slot.sequence.store(0, std::memory_order_release);
+    slot.event = event;
+    slot.event.thread = currentTraceThread();
+    slot.sequence.store(sequence + 1, std::memory_order_release);
+}
+
+bool Tracer::exportChromeTrace(const QString &fileName, QString *errorString) const
+{
+    const quint64 end = next.load(std::memory_order_acquire);
+    const quint64 begin = end > Capacity ? end - Capacity : 0;
+    const qint64 pid = QCoreApplication::applicationPid();
+
+    QJsonArray traceEvents;
+    for (quint64 sequence = begin; sequence < end; ++sequence) {
+        const Slot &slot = ring[sequence % Capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+            continue;
+        const TraceEvent event = slot.event;
+        if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+            continue;
+
+        QJsonObject args;
+        if (event.phase == 'C') {
+            args[QString::fromLatin1(event.name)] = event.value;
+        } else if (event.value > 0) {
+            args["pixels"] = event.value;
+            if (event.duration > 0)
+                args["MP/s"] = event.value * 1000.0 / event.duration;
+        }
+
+        QJsonObject object;
+        object["name"] = QString::fromLatin1(event.name);
+        object["cat"] = QString::fromLatin1(event.category);
+        object["ph"] = QString(QChar::fromLatin1(event.phase));
+        object["ts"] = event.start / 1000.0;
+        if (event.phase == 'X')
+            object["dur"] = event.duration / 1000.0;
+        object["pid"] = pid;
+        object["tid"] = event.thread;
+        object["args"] = args;
+        traceEvents.append(object);
+    }
+
+    QJsonObject root;
+    root["traceEvents"] = traceEvents;
+    root["displayTimeUnit"] = "ms";
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        if (errorString)
+            *errorString = file.errorString();
+        return false;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    return true;
+}
+
+TraceScope::TraceScope(const char *name, const char *category, qint64 pixels)
+    : eventName(name), category(category), pixels(pixels), start(Tracer::instance().now())
+{
+}
+
+TraceScope::~TraceScope()
+{
+    finish();
+}
+
+void TraceScope::finish()
+{
+    if (duration >= 0)
+        return;
+    duration = Tracer::instance().now() - start;
+    Tracer::instance().record(eventName, category, start, duration, pixels);
+}
+
+qint64 TraceScope::elapsed() const
+{
+    return duration >= 0 ? duration : Tracer::instance().now() - start;
+}
+
+double TraceScope::megapixelsPerSecond() const
+{
+    const qint64 nsecs = elapsed();
+    return nsecs > 0 ? pixels * 1000.0 / nsecs : 0.0;
+}
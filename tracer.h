@@ -0,0 +1,70 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QElapsedTimer>
+#include <QString>
+#include <atomic>
+#include <memory>
+
+struct TraceEvent
+{
+    const char *name = nullptr;
+    const char *category = nullptr;
+    char phase = 'X';     // 'X' complete event, 'C' counter
+    qint64 start = 0;     // nanoseconds since the tracer was created
+    qint64 duration = 0;  // nanoseconds
+    qint64 value = 0;     // pixels processed, or the counter value
+    int thread = 0;
+};
+
+// Fixed-size ring buffer of trace events. Recording is lock-free so scopes can
+// be left in hot paths and on worker threads; the oldest events are overwritten.
+class Tracer
+{
+public:
+    static Tracer &instance();
+
+    qint64 now() const { return clock.nsecsElapsed(); }
+    void record(const char *name, const char *category, qint64 start, qint64 duration, qint64 pixels);
+    void counter(const char *name, qint64 value);
+    bool exportChromeTrace(const QString &fileName, QString *errorString = nullptr) const;
+
+private:
+    Tracer();
+    void append(const TraceEvent &event);
+
+    struct Slot
+    {
+        std::atomic<quint64> sequence{0};
+        TraceEvent event;
+    };
+
+    static constexpr quint64 Capacity = 1 << 16;
+
+    QElapsedTimer clock;
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<quint64> next{0};
+};
+
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *category, qint64 pixels = 0);
+    ~TraceScope();
+
+    void setPixels(qint64 count) { pixels = count; }
+    void finish();
+
+    const char *name() const { return eventName; }
+    qint64 elapsed() const;
+    double megapixelsPerSecond() const;
+
+private:
+    const char *eventName;
+    const char *category;
+    qint64 pixels;
+    qint64 start;
+    qint64 duration = -1;
+};
+
+#endif // TRACER_H